@@ -0,0 +1,128 @@
+// Compares the SAH, LBVH and SBVH builders on build time, tree quality and traversal speed.
+// Usage: BVHBenchmark [triangle count | path to .obj] [ray count]
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "../src/Utils.h"
+
+using namespace dae;
+
+namespace
+{
+	using Clock = std::chrono::high_resolution_clock;
+
+	constexpr int BuildRepetitions{ 3 };
+
+	TriangleMesh CreateTriangleSoup(size_t triangleCount)
+	{
+		std::mt19937 generator{ 1337 };
+		std::uniform_real_distribution<float> position{ -50.f, 50.f };
+		std::uniform_real_distribution<float> offset{ -.5f, .5f };
+
+		TriangleMesh mesh{};
+		mesh.positions.reserve(triangleCount * 3);
+		mesh.indices.reserve(triangleCount * 3);
+		for (size_t i{ 0 }; i < triangleCount; ++i)
+		{
+			const Vector3 center{ position(generator), position(generator), position(generator) };
+			for (int v{ 0 }; v < 3; ++v)
+			{
+				mesh.indices.push_back(static_cast<int>(mesh.positions.size()));
+				mesh.positions.push_back(center + Vector3{ offset(generator), offset(generator), offset(generator) });
+			}
+		}
+
+		return mesh;
+	}
+
+	// Rays from a sphere around the mesh towards random points inside its bounds
+	std::vector<Ray> CreateRays(const TriangleMesh& mesh, size_t rayCount)
+	{
+		const Vector3 center{ (mesh.minAABB + mesh.maxAABB) * .5f };
+		const float radius{ (mesh.maxAABB - mesh.minAABB).Magnitude() };
+
+		std::mt19937 generator{ 42 };
+		std::uniform_real_distribution<float> unit{ -1.f, 1.f };
+		std::uniform_real_distribution<float> fraction{ 0.f, 1.f };
+
+		std::vector<Ray> rays(rayCount);
+		for (Ray& ray : rays)
+		{
+			const Vector3 origin{ center + Vector3{ unit(generator), unit(generator), unit(generator) }.Normalized() * radius };
+			const Vector3 target{
+				Lerpf(mesh.minAABB.x, mesh.maxAABB.x, fraction(generator)),
+				Lerpf(mesh.minAABB.y, mesh.maxAABB.y, fraction(generator)),
+				Lerpf(mesh.minAABB.z, mesh.maxAABB.z, fraction(generator)) };
+
+			ray.origin = origin;
+			ray.direction = (target - origin).Normalized();
+		}
+
+		return rays;
+	}
+
+	void RunBenchmark(const char* name, TriangleMesh& mesh, BVHBuildMode buildMode, const std::vector<Ray>& rays)
+	{
+		mesh.bvhBuildMode = buildMode;
+
+		float bestBuildMs{ FLT_MAX };
+		for (int i{ 0 }; i < BuildRepetitions; ++i)
+		{
+			mesh.BuildBVH();
+			bestBuildMs = std::min(bestBuildMs, mesh.bvh.GetBuildStats().buildTimeMs);
+		}
+
+		size_t hitCount{ 0 };
+		const auto traceStart = Clock::now();
+		for (const Ray& ray : rays)
+		{
+			HitRecord hitRecord{};
+			hitCount += GeometryUtils::HitTest_TriangleMesh(mesh, ray, hitRecord) ? 1 : 0;
+		}
+		const float traceMs{ std::chrono::duration<float, std::milli>(Clock::now() - traceStart).count() };
+
+		std::cout << name
+			<< "\tbuild " << bestBuildMs << " ms"
+			<< "\tpeak " << static_cast<float>(mesh.bvh.GetBuildStats().peakMemoryBytes) / (1024.f * 1024.f) << " MB"
+			<< "\treferences " << mesh.bvh.GetPrimitiveIndices().size()
+			<< "\tSAH cost " << mesh.bvh.GetSAHCost()
+			<< "\ttrace " << static_cast<float>(rays.size()) / (traceMs * 1000.f) << " Mrays/s"
+			<< "\thits " << hitCount << '\n';
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const std::string source{ argc > 1 ? argv[1] : "1000000" };
+	const size_t rayCount{ argc > 2 ? std::stoul(argv[2]) : 1000000 };
+
+	TriangleMesh mesh{};
+	if (source.ends_with(".obj"))
+	{
+		if (!Utils::ParseOBJ(source, mesh.positions, mesh.normals, mesh.indices))
+		{
+			std::cout << "Could not load " << source << '\n';
+			return 1;
+		}
+	}
+	else
+	{
+		mesh = CreateTriangleSoup(std::stoul(source));
+	}
+
+	mesh.cullMode = TriangleCullMode::NoCulling;
+	mesh.CalculateNormals();
+	mesh.UpdateAABB();
+	mesh.UpdateTransforms();
+
+	const std::vector<Ray> rays{ CreateRays(mesh, rayCount) };
+
+	std::cout << mesh.indices.size() / 3 << " triangles, " << rays.size() << " rays\n";
+	RunBenchmark("SAH", mesh, BVHBuildMode::SAH, rays);
+	RunBenchmark("LBVH", mesh, BVHBuildMode::LBVH, rays);
+	RunBenchmark("SBVH", mesh, BVHBuildMode::SBVH, rays);
+
+	return 0;
+}
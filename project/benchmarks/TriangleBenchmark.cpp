@@ -0,0 +1,124 @@
+// Compares the ray/triangle kernels on precomputed records and SoA blocks against testing plain Triangle structs.
+// Usage: TriangleBenchmark [triangle count] [ray count]
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "../src/Utils.h"
+
+using namespace dae;
+
+namespace
+{
+	using Clock = std::chrono::high_resolution_clock;
+
+	// kernel(ray) tests the ray against every triangle and returns the number of hits
+	template<typename Kernel>
+	void RunBenchmark(const char* name, size_t triangleCount, const std::vector<Ray>& rays, Kernel&& kernel)
+	{
+		size_t hitCount{ 0 };
+		const auto start = Clock::now();
+		for (const Ray& ray : rays)
+			hitCount += kernel(ray);
+		const float elapsedMs{ std::chrono::duration<float, std::milli>(Clock::now() - start).count() };
+
+		const float testCount{ static_cast<float>(triangleCount) * static_cast<float>(rays.size()) };
+		std::cout << name << "\t" << testCount / (elapsedMs * 1000.f) << " Mtests/s\thits " << hitCount << '\n';
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const size_t triangleCount{ argc > 1 ? std::stoul(argv[1]) : 4096 };
+	const size_t rayCount{ argc > 2 ? std::stoul(argv[2]) : 4096 };
+
+	std::mt19937 generator{ 1337 };
+	std::uniform_real_distribution<float> position{ -5.f, 5.f };
+	std::uniform_real_distribution<float> offset{ -1.f, 1.f };
+
+	std::vector<Triangle> triangles{};
+	std::vector<TriangleRecord> records{};
+	TriangleMesh mesh{};
+	mesh.cullMode = TriangleCullMode::NoCulling;
+	triangles.reserve(triangleCount);
+	records.reserve(triangleCount);
+	for (size_t i{ 0 }; i < triangleCount; ++i)
+	{
+		const Vector3 center{ position(generator), position(generator), position(generator) };
+		Triangle& triangle = triangles.emplace_back(
+			center + Vector3{ offset(generator), offset(generator), offset(generator) },
+			center + Vector3{ offset(generator), offset(generator), offset(generator) },
+			center + Vector3{ offset(generator), offset(generator), offset(generator) });
+		triangle.cullMode = TriangleCullMode::NoCulling;
+
+		records.emplace_back(triangle);
+		mesh.AppendTriangle(triangle, true);
+	}
+	mesh.UpdateTriangleRecords();
+
+	std::vector<Ray> rays(rayCount);
+	for (Ray& ray : rays)
+	{
+		ray.origin = { position(generator), position(generator), -10.f };
+		ray.direction = Vector3{ offset(generator) * .5f, offset(generator) * .5f, 1.f }.Normalized();
+	}
+
+	std::cout << triangleCount << " triangles, " << rayCount << " rays\n";
+
+	RunBenchmark("Triangle", triangleCount, rays, [&](const Ray& ray)
+	{
+		size_t hitCount{ 0 };
+		for (const Triangle& triangle : triangles)
+		{
+			HitRecord hitRecord{};
+			hitCount += GeometryUtils::HitTest_Triangle(triangle, ray, hitRecord) ? 1 : 0;
+		}
+		return hitCount;
+	});
+
+	RunBenchmark("Moller-Trumbore", triangleCount, rays, [&](const Ray& ray)
+	{
+		size_t hitCount{ 0 };
+		for (const TriangleRecord& record : records)
+		{
+			GeometryUtils::TriangleHit hit{};
+			hitCount += GeometryUtils::Intersect_MollerTrumbore(record, ray, false, hit) ? 1 : 0;
+		}
+		return hitCount;
+	});
+
+	RunBenchmark("Watertight", triangleCount, rays, [&](const Ray& ray)
+	{
+		const GeometryUtils::WatertightRay watertightRay{ ray };
+
+		// Vertices read through the mesh's indices, like HitTest_TriangleLeaf does
+		size_t hitCount{ 0 };
+		for (uint32_t triangleIndex{ 0 }; triangleIndex < triangleCount; ++triangleIndex)
+		{
+			GeometryUtils::TriangleHit hit{};
+			hitCount += GeometryUtils::Intersect_Watertight(mesh.triangleRecords[triangleIndex], mesh.GetTriangleVertex(triangleIndex, 0),
+				mesh.GetTriangleVertex(triangleIndex, 1), mesh.GetTriangleVertex(triangleIndex, 2), ray, watertightRay, false, hit) ? 1 : 0;
+		}
+		return hitCount;
+	});
+
+	// Counts at most one hit per block of PrimitiveBlockWidth triangles
+	RunBenchmark("Moller-Trumbore x8", triangleCount, rays, [&](const Ray& ray)
+	{
+		const GeometryUtils::BlockRay blockRay{ ray };
+
+		size_t hitCount{ 0 };
+		for (size_t blockStart{ 0 }; blockStart < triangleCount; blockStart += PrimitiveBlockWidth)
+		{
+			const uint32_t laneEnd{ static_cast<uint32_t>(std::min<size_t>(triangleCount - blockStart, PrimitiveBlockWidth)) };
+
+			GeometryUtils::TriangleBlockHit hit{};
+			hitCount += GeometryUtils::Intersect_TriangleBlock(mesh.triangleBlocks[blockStart / PrimitiveBlockWidth], blockRay,
+				ray.min, ray.max, TriangleCullMode::NoCulling, false, 0, laneEnd, hit) ? 1 : 0;
+		}
+		return hitCount;
+	});
+
+	return 0;
+}
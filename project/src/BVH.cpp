@@ -0,0 +1,1383 @@
+#include "BVH.h"
+
+#include <atomic>
+#include <chrono>
+#include <execution>
+#include <thread>
+
+namespace dae
+{
+	namespace
+	{
+		constexpr uint32_t BinCount{ 16 };
+		constexpr uint32_t MaxLeafSize{ 8 };
+
+		// Cost of visiting one node relative to one primitive test
+		constexpr float TraversalCost{ 1.f };
+
+		struct Bin
+		{
+			AABB bounds{};
+			uint32_t count{ 0 };
+		};
+
+		// Nodes with at least this many primitives get binned and partitioned on every core, below it one core is faster
+		constexpr uint32_t ParallelSplitThreshold{ 1u << 16 };
+		constexpr uint32_t ParallelChunkSize{ 1u << 14 };
+
+		// LBVH leaves stay small, Morton order groups primitives less tightly than SAH splits do
+		constexpr uint32_t LBVHLeafSize{ 4 };
+
+		// 30-bit codes give 1024 cells per axis, past this many primitives too many of them start sharing a cell
+		constexpr uint32_t LBVH63BitThreshold{ 1u << 18 };
+
+		constexpr uint32_t RadixDigitBits{ 8 };
+		constexpr uint32_t RadixDigitCount{ 1u << RadixDigitBits };
+
+		// Spatial splits are only tried when the best object split leaves children overlapping by more than this fraction of the root area
+		constexpr float SpatialSplitOverlapThreshold{ 1e-5f };
+
+		struct SpatialBin
+		{
+			AABB bounds{};
+			uint32_t entryCount{ 0 };
+			uint32_t exitCount{ 0 };
+		};
+
+		struct RadixHistogram
+		{
+			uint32_t counts[RadixDigitCount]{};
+		};
+
+		struct SplitBins
+		{
+			Bin bins[3][BinCount]{};
+		};
+
+		uint32_t GetBinIndex(float centroid, float binMin, float binScale)
+		{
+			const auto bin = static_cast<uint32_t>((centroid - binMin) * binScale);
+			return std::min(bin, BinCount - 1);
+		}
+
+		// Calls task(begin, end) for chunks of [0, count), spread over every core unless parallel is off
+		template<typename Task>
+		void ParallelForChunks(uint32_t count, Task&& task, bool parallel = true)
+		{
+			if (!parallel)
+			{
+				for (uint32_t begin{ 0 }; begin < count; begin += ParallelChunkSize)
+					task(begin, std::min(begin + ParallelChunkSize, count));
+				return;
+			}
+
+			std::vector<uint32_t> chunkStarts((count + ParallelChunkSize - 1) / ParallelChunkSize);
+			for (size_t i{ 0 }; i < chunkStarts.size(); ++i)
+				chunkStarts[i] = static_cast<uint32_t>(i) * ParallelChunkSize;
+
+			std::for_each(std::execution::par, chunkStarts.begin(), chunkStarts.end(), [&](uint32_t begin)
+			{
+				task(begin, std::min(begin + ParallelChunkSize, count));
+			});
+		}
+
+		// Stable partition over fixed size chunks: every chunk counts its left elements, then scatters into its own slices
+		// of scratch. The order never depends on how the chunks got scheduled. Returns the left count
+		template<typename Element, typename Predicate>
+		uint32_t ChunkedStablePartition(Element* pElements, uint32_t count, std::vector<Element>& scratch, Predicate&& isLeft, bool parallel)
+		{
+			std::vector<uint32_t> chunkLeftOffsets((count + ParallelChunkSize - 1) / ParallelChunkSize);
+			ParallelForChunks(count, [&](uint32_t begin, uint32_t end)
+			{
+				uint32_t leftCount{ 0 };
+				for (uint32_t i{ begin }; i < end; ++i)
+					leftCount += isLeft(pElements[i]) ? 1 : 0;
+				chunkLeftOffsets[begin / ParallelChunkSize] = leftCount;
+			}, parallel);
+
+			uint32_t totalLeftCount{ 0 };
+			for (uint32_t& offset : chunkLeftOffsets)
+			{
+				const uint32_t leftCount{ offset };
+				offset = totalLeftCount;
+				totalLeftCount += leftCount;
+			}
+
+			scratch.resize(count);
+			ParallelForChunks(count, [&](uint32_t begin, uint32_t end)
+			{
+				uint32_t left{ chunkLeftOffsets[begin / ParallelChunkSize] };
+				uint32_t right{ totalLeftCount + begin - left };
+				for (uint32_t i{ begin }; i < end; ++i)
+					scratch[isLeft(pElements[i]) ? left++ : right++] = pElements[i];
+			}, parallel);
+
+			ParallelForChunks(count, [&](uint32_t begin, uint32_t end)
+			{
+				std::copy(scratch.begin() + begin, scratch.begin() + end, pElements + begin);
+			}, parallel);
+
+			return totalLeftCount;
+		}
+
+		void GrowBounds(AABB& bounds, const AABB& other)
+		{
+			// Growing by an empty box would flip its min and max into the result
+			if (other.IsValid())
+				bounds.Grow(other);
+		}
+
+		// Spreads the lower 10 bits so there are two zero bits between each of them
+		uint32_t ExpandBits(uint32_t value)
+		{
+			value = (value * 0x00010001u) & 0xFF0000FFu;
+			value = (value * 0x00000101u) & 0x0F00F00Fu;
+			value = (value * 0x00000011u) & 0xC30C30C3u;
+			value = (value * 0x00000005u) & 0x49249249u;
+			return value;
+		}
+
+		// Spreads the lower 21 bits so there are two zero bits between each of them
+		uint64_t ExpandBits(uint64_t value)
+		{
+			value &= 0x1FFFFF;
+			value = (value | value << 32) & 0x1F00000000FFFF;
+			value = (value | value << 16) & 0x1F0000FF0000FF;
+			value = (value | value << 8) & 0x100F00F00F00F00F;
+			value = (value | value << 4) & 0x10C30C30C30C30C3;
+			value = (value | value << 2) & 0x1249249249249249;
+			return value;
+		}
+
+		// Interleaves a position normalized to [0, 1] into a 30-bit (uint32_t) or 63-bit (uint64_t) Morton code
+		template<typename MortonCode>
+		MortonCode EncodeMorton(float x, float y, float z)
+		{
+			constexpr uint32_t bitsPerAxis{ sizeof(MortonCode) == 4 ? 10 : 21 };
+			constexpr float cellCount{ static_cast<float>(1u << bitsPerAxis) };
+
+			const auto quantize = [&](float value)
+			{
+				return static_cast<MortonCode>(std::clamp(value * cellCount, 0.f, cellCount - 1.f));
+			};
+
+			return ExpandBits(quantize(x)) << 2 | ExpandBits(quantize(y)) << 1 | ExpandBits(quantize(z));
+		}
+
+		// Stable LSD radix sort of the codes, carrying the primitive indices along. Every pass histograms
+		// and scatters chunks in parallel, passes where all codes share the same digit are skipped
+		template<typename MortonCode>
+		void RadixSort(std::vector<MortonCode>& codes, std::vector<uint32_t>& indices)
+		{
+			const auto count = static_cast<uint32_t>(codes.size());
+
+			std::vector<MortonCode> sortedCodes(count);
+			std::vector<uint32_t> sortedIndices(count);
+			std::vector<RadixHistogram> chunkHistograms((count + ParallelChunkSize - 1) / ParallelChunkSize);
+
+			for (uint32_t shift{ 0 }; shift < sizeof(MortonCode) * 8; shift += RadixDigitBits)
+			{
+				ParallelForChunks(count, [&](uint32_t begin, uint32_t end)
+				{
+					RadixHistogram& histogram = chunkHistograms[begin / ParallelChunkSize];
+					histogram = {};
+					for (uint32_t i{ begin }; i < end; ++i)
+						++histogram.counts[(codes[i] >> shift) & (RadixDigitCount - 1)];
+				});
+
+				// Digit major, chunk minor prefix sum, so every chunk scatters into its own slice of each digit
+				uint32_t offset{ 0 };
+				bool isSingleDigit{ false };
+				for (uint32_t digit{ 0 }; digit < RadixDigitCount; ++digit)
+				{
+					const uint32_t digitStart{ offset };
+					for (RadixHistogram& histogram : chunkHistograms)
+					{
+						const uint32_t digitCount = histogram.counts[digit];
+						histogram.counts[digit] = offset;
+						offset += digitCount;
+					}
+
+					isSingleDigit |= offset - digitStart == count;
+				}
+
+				if (isSingleDigit)
+					continue;
+
+				ParallelForChunks(count, [&](uint32_t begin, uint32_t end)
+				{
+					RadixHistogram& histogram = chunkHistograms[begin / ParallelChunkSize];
+					for (uint32_t i{ begin }; i < end; ++i)
+					{
+						const uint32_t destination = histogram.counts[(codes[i] >> shift) & (RadixDigitCount - 1)]++;
+						sortedCodes[destination] = codes[i];
+						sortedIndices[destination] = indices[i];
+					}
+				});
+
+				codes.swap(sortedCodes);
+				indices.swap(sortedIndices);
+			}
+		}
+
+		// Bounds of the part of a triangle inside the slab [slabMin, slabMax] along axis
+		AABB ClipTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2, int axis, float slabMin, float slabMax)
+		{
+			const Vector3* vertices[3]{ &v0, &v1, &v2 };
+
+			AABB bounds{};
+			for (int i{ 0 }; i < 3; ++i)
+			{
+				const Vector3& start = *vertices[i];
+				const Vector3& end = *vertices[(i + 1) % 3];
+				const float startValue{ start[axis] }, endValue{ end[axis] };
+
+				if (startValue >= slabMin && startValue <= slabMax)
+					bounds.Grow(start);
+
+				// Add the points where the edge crosses either slab plane
+				for (const float plane : { slabMin, slabMax })
+				{
+					if ((startValue < plane && endValue > plane) || (startValue > plane && endValue < plane))
+					{
+						const float t{ (plane - startValue) / (endValue - startValue) };
+						Vector3 crossing{ start + (end - start) * t };
+						crossing[axis] = plane;
+						bounds.Grow(crossing);
+					}
+				}
+			}
+
+			return bounds;
+		}
+
+		AABB IntersectBounds(const AABB& a, const AABB& b)
+		{
+			return { Vector3::Max(a.min, b.min), Vector3::Min(a.max, b.max) };
+		}
+
+		// Components are read directly, Vector3::operator[] is not inlined across translation units
+		void GetCentroid(const BVH::BuildPrimitive& primitive, float centroid[3])
+		{
+			centroid[0] = (primitive.min.x + primitive.max.x) * .5f;
+			centroid[1] = (primitive.min.y + primitive.max.y) * .5f;
+			centroid[2] = (primitive.min.z + primitive.max.z) * .5f;
+		}
+
+		float GetCentroid(const BVH::BuildPrimitive& primitive, int axis)
+		{
+			float centroid[3];
+			GetCentroid(primitive, centroid);
+			return centroid[axis];
+		}
+
+		void BinPrimitives(const BVH::BuildPrimitive* pPrimitives, uint32_t count, const float axisMin[3], const float axisScale[3], SplitBins& splitBins)
+		{
+			for (uint32_t i{ 0 }; i < count; ++i)
+			{
+				const BVH::BuildPrimitive& primitive = pPrimitives[i];
+
+				float centroid[3];
+				GetCentroid(primitive, centroid);
+
+				for (int a{ 0 }; a < 3; ++a)
+				{
+					// Flat axis, nothing to split along
+					if (axisScale[a] <= 0.f)
+						continue;
+
+					Bin& bin = splitBins.bins[a][GetBinIndex(centroid[a], axisMin[a], axisScale[a])];
+					++bin.count;
+					bin.bounds.Grow(AABB{ primitive.min, primitive.max });
+				}
+			}
+		}
+	}
+
+	void BVH::Build(const std::vector<AABB>& primitiveBounds, BVHBuildMode buildMode)
+	{
+		BuildTree(primitiveBounds, buildMode, nullptr);
+	}
+
+	void BVH::BuildTree(const std::vector<AABB>& primitiveBounds, BVHBuildMode buildMode, const TriangleSource* pTriangles)
+	{
+		const auto buildStart = std::chrono::high_resolution_clock::now();
+
+		Clear();
+
+		const auto primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+		if (primitiveCount == 0)
+			return;
+
+		size_t builderBytes{};
+		if (buildMode == BVHBuildMode::LBVH)
+		{
+			builderBytes = primitiveCount > LBVH63BitThreshold
+				? BuildLBVH<uint64_t>(primitiveBounds)
+				: BuildLBVH<uint32_t>(primitiveBounds);
+		}
+		else if (buildMode == BVHBuildMode::SBVH)
+		{
+			builderBytes = BuildSBVH(primitiveBounds, pTriangles);
+		}
+		else
+		{
+			builderBytes = BuildSAH(primitiveBounds);
+		}
+
+		m_SAHCost = CalculateSAHCost();
+		m_BuildSAHCost = m_SAHCost;
+
+		Collapse();
+
+		const size_t collapseBytes{ primitiveBounds.size() * sizeof(AABB) + m_PrimitiveIndices.size() * sizeof(uint32_t)
+			+ m_Nodes.size() * sizeof(BVHNode) + m_WideNodes.capacity() * sizeof(WideBVHNode) };
+		m_BuildStats.peakMemoryBytes = std::max(builderBytes, collapseBytes);
+		m_BuildStats.buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+	}
+
+	size_t BVH::BuildSAH(const std::vector<AABB>& primitiveBounds)
+	{
+		const auto primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+
+		// The primitives get partitioned themselves instead of an index list, so binning walks memory linearly
+		std::vector<BuildPrimitive> buildPrimitives(primitiveCount);
+		ParallelForChunks(primitiveCount, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i{ begin }; i < end; ++i)
+				buildPrimitives[i] = { primitiveBounds[i].min, i, primitiveBounds[i].max };
+		});
+
+		// A binary tree with N leaves never needs more than 2N - 1 nodes, so allocating a node is a single atomic add
+		m_Nodes.resize(2 * primitiveCount - 1);
+		std::atomic<uint32_t> nodeCount{ 1 };
+
+		m_Nodes[0].leftFirst = 0;
+		m_Nodes[0].primitiveCount = primitiveCount;
+		UpdateNodeBounds(0, buildPrimitives, m_ParallelBuild && primitiveCount >= ParallelSplitThreshold);
+
+		// Split the top levels breadth first until there are enough independent subtrees to keep every core busy,
+		// those first splits are the largest and bin their primitives in parallel instead
+		const size_t targetSubtreeCount{ m_ParallelBuild ? std::max(1u, std::thread::hardware_concurrency()) * 4 : 1 };
+
+		std::vector<uint32_t> subtreeRoots{ 0 };
+		while (!subtreeRoots.empty() && subtreeRoots.size() < targetSubtreeCount)
+		{
+			std::vector<uint32_t> nextLevel{};
+			nextLevel.reserve(subtreeRoots.size() * 2);
+
+			// Nodes that don't split are finished leaves and drop out
+			for (const uint32_t nodeIndex : subtreeRoots)
+			{
+				const bool parallel{ m_ParallelBuild && m_Nodes[nodeIndex].primitiveCount >= ParallelSplitThreshold };
+				if (!SplitNode(nodeIndex, buildPrimitives, nodeCount, parallel))
+					continue;
+
+				nextLevel.push_back(m_Nodes[nodeIndex].leftFirst);
+				nextLevel.push_back(m_Nodes[nodeIndex].leftFirst + 1);
+			}
+
+			subtreeRoots = std::move(nextLevel);
+		}
+
+		std::for_each(std::execution::par, subtreeRoots.begin(), subtreeRoots.end(), [&](uint32_t rootIndex)
+		{
+			Subdivide(rootIndex, buildPrimitives, nodeCount);
+		});
+
+		m_PrimitiveIndices.resize(primitiveCount);
+		ParallelForChunks(primitiveCount, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i{ begin }; i < end; ++i)
+				m_PrimitiveIndices[i] = buildPrimitives[i].index;
+		});
+
+		// The root's partition scratch and the final indices are never alive together, renumbering copies the used nodes
+		const size_t partitionBytes{ primitiveCount >= ParallelSplitThreshold ? buildPrimitives.size() * sizeof(BuildPrimitive) : 0 };
+		const size_t builderBytes{ primitiveBounds.size() * sizeof(AABB) + buildPrimitives.size() * sizeof(BuildPrimitive)
+			+ m_Nodes.size() * sizeof(BVHNode)
+			+ std::max(partitionBytes, m_PrimitiveIndices.size() * sizeof(uint32_t) + nodeCount.load() * sizeof(BVHNode)) };
+
+		m_Nodes.resize(nodeCount.load());
+		OrderNodesDepthFirst();
+
+		return builderBytes;
+	}
+
+	template<typename MortonCode>
+	size_t BVH::BuildLBVH(const std::vector<AABB>& primitiveBounds)
+	{
+		const auto primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+
+		std::vector<AABB> chunkBounds((primitiveCount + ParallelChunkSize - 1) / ParallelChunkSize);
+		ParallelForChunks(primitiveCount, [&](uint32_t begin, uint32_t end)
+		{
+			AABB& currentBounds = chunkBounds[begin / ParallelChunkSize];
+			for (uint32_t i{ begin }; i < end; ++i)
+				currentBounds.Grow(primitiveBounds[i].Center());
+		});
+
+		AABB centroidBounds{};
+		for (const AABB& currentBounds : chunkBounds)
+			GrowBounds(centroidBounds, currentBounds);
+
+		// Flat axes get a scale of 0 and all land in cell 0
+		const Vector3 extent{ centroidBounds.max - centroidBounds.min };
+		const Vector3 scale{
+			extent.x > 0.f ? 1.f / extent.x : 0.f,
+			extent.y > 0.f ? 1.f / extent.y : 0.f,
+			extent.z > 0.f ? 1.f / extent.z : 0.f };
+
+		std::vector<MortonCode> mortonCodes(primitiveCount);
+		m_PrimitiveIndices.resize(primitiveCount);
+		ParallelForChunks(primitiveCount, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i{ begin }; i < end; ++i)
+			{
+				const Vector3 centroid{ primitiveBounds[i].Center() };
+				mortonCodes[i] = EncodeMorton<MortonCode>(
+					(centroid.x - centroidBounds.min.x) * scale.x,
+					(centroid.y - centroidBounds.min.y) * scale.y,
+					(centroid.z - centroidBounds.min.z) * scale.z);
+				m_PrimitiveIndices[i] = i;
+			}
+		});
+
+		RadixSort(mortonCodes, m_PrimitiveIndices);
+
+		m_Nodes.resize(2 * primitiveCount - 1);
+		std::atomic<uint32_t> nodeCount{ 1 };
+
+		m_Nodes[0].leftFirst = 0;
+		m_Nodes[0].primitiveCount = primitiveCount;
+
+		// Sorted codes that share their top bits form a contiguous range, so every node splits its range
+		// where the highest bit that differs between its first and last code flips
+		const auto splitNode = [&](uint32_t nodeIndex)
+		{
+			BVHNode& node = m_Nodes[nodeIndex];
+			if (node.primitiveCount <= LBVHLeafSize)
+				return false;
+
+			const uint32_t first = node.leftFirst;
+			const MortonCode firstCode = mortonCodes[first];
+			const MortonCode lastCode = mortonCodes[first + node.primitiveCount - 1];
+
+			uint32_t leftCount{ node.primitiveCount / 2 };
+
+			// Identical codes carry no spatial information, just halve the range
+			if (firstCode != lastCode)
+			{
+				const MortonCode splitBit = MortonCode{ 1 } << (sizeof(MortonCode) * 8 - 1 - std::countl_zero(static_cast<MortonCode>(firstCode ^ lastCode)));
+
+				const auto begin = mortonCodes.begin() + first;
+				const auto middle = std::partition_point(begin, begin + node.primitiveCount, [&](MortonCode code)
+				{
+					return (code & splitBit) == 0;
+				});
+
+				leftCount = static_cast<uint32_t>(middle - begin);
+			}
+
+			const uint32_t leftIndex = nodeCount.fetch_add(2, std::memory_order_relaxed);
+			const uint32_t rightCount = node.primitiveCount - leftCount;
+
+			node.leftFirst = leftIndex;
+			node.primitiveCount = 0;
+
+			m_Nodes[leftIndex] = { {}, first, {}, leftCount };
+			m_Nodes[leftIndex + 1] = { {}, first + leftCount, {}, rightCount };
+			return true;
+		};
+
+		// Same scheme as the SAH builder, emit the top levels breadth first and the subtrees concurrently
+		const size_t targetSubtreeCount{ m_ParallelBuild ? std::max(1u, std::thread::hardware_concurrency()) * 4 : 1 };
+
+		std::vector<uint32_t> subtreeRoots{ 0 };
+		while (!subtreeRoots.empty() && subtreeRoots.size() < targetSubtreeCount)
+		{
+			std::vector<uint32_t> nextLevel{};
+			nextLevel.reserve(subtreeRoots.size() * 2);
+
+			for (const uint32_t nodeIndex : subtreeRoots)
+			{
+				if (!splitNode(nodeIndex))
+					continue;
+
+				nextLevel.push_back(m_Nodes[nodeIndex].leftFirst);
+				nextLevel.push_back(m_Nodes[nodeIndex].leftFirst + 1);
+			}
+
+			subtreeRoots = std::move(nextLevel);
+		}
+
+		std::for_each(std::execution::par, subtreeRoots.begin(), subtreeRoots.end(), [&](uint32_t rootIndex)
+		{
+			std::vector<uint32_t> nodeStack{ rootIndex };
+			while (!nodeStack.empty())
+			{
+				const uint32_t nodeIndex = nodeStack.back();
+				nodeStack.pop_back();
+
+				if (!splitNode(nodeIndex))
+					continue;
+
+				nodeStack.push_back(m_Nodes[nodeIndex].leftFirst);
+				nodeStack.push_back(m_Nodes[nodeIndex].leftFirst + 1);
+			}
+		});
+
+		// Radix sort double buffers the codes and indices
+		const size_t builderBytes{ primitiveBounds.size() * sizeof(AABB) + mortonCodes.size() * sizeof(MortonCode) * 2
+			+ m_PrimitiveIndices.size() * sizeof(uint32_t) * 2 + m_Nodes.size() * sizeof(BVHNode) };
+
+		m_Nodes.resize(nodeCount.load());
+		OrderNodesDepthFirst();
+
+		// The topology only depends on the codes, the bounds follow bottom-up
+		auto getPrimitiveBounds = [&](uint32_t primitiveIndex) { return primitiveBounds[primitiveIndex]; };
+		RefitBounds(getPrimitiveBounds);
+
+		return builderBytes;
+	}
+
+	size_t BVH::BuildSBVH(const std::vector<AABB>& primitiveBounds, const TriangleSource* pTriangles)
+	{
+		const auto primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+
+		// Part of a primitive, spatial splits duplicate a primitive into one clipped reference per side
+		struct Reference
+		{
+			AABB bounds;
+			uint32_t index;
+		};
+
+		struct BuildTask
+		{
+			uint32_t nodeIndex;
+			std::vector<Reference> references;
+		};
+
+		const auto maxReferenceCount = static_cast<size_t>(static_cast<float>(primitiveCount) * (1.f + m_SpatialSplitBudget));
+		size_t referenceCount{ primitiveCount };
+		size_t peakReferenceCount{ primitiveCount };
+
+		// Clipped part of a reference inside the slab, refined against the triangle when there is one
+		const auto clipReference = [&](const Reference& reference, int axis, float slabMin, float slabMax)
+		{
+			AABB slab{ reference.bounds };
+			slab.min[axis] = std::max(slab.min[axis], slabMin);
+			slab.max[axis] = std::min(slab.max[axis], slabMax);
+
+			if (pTriangles == nullptr)
+				return slab;
+
+			const std::vector<Vector3>& positions = pTriangles->positions;
+			const std::vector<int>& indices = pTriangles->indices;
+			const AABB triangleBounds{ ClipTriangle(positions[indices[reference.index * 3]], positions[indices[reference.index * 3 + 1]],
+				positions[indices[reference.index * 3 + 2]], axis, slabMin, slabMax) };
+
+			// Float error can leave the clipped triangle just outside a thin slab, fall back to the clipped box then
+			const AABB clipped{ IntersectBounds(triangleBounds, slab) };
+			return clipped.IsValid() ? clipped : slab;
+		};
+
+		m_Nodes.reserve(2 * maxReferenceCount);
+		m_Nodes.emplace_back();
+		m_PrimitiveIndices.reserve(maxReferenceCount);
+
+		std::vector<Reference> rootReferences(primitiveCount);
+		for (uint32_t i{ 0 }; i < primitiveCount; ++i)
+			rootReferences[i] = { primitiveBounds[i], i };
+
+		std::vector<BuildTask> taskStack{};
+		taskStack.push_back({ 0, std::move(rootReferences) });
+
+		float rootArea{ 0.f };
+		while (!taskStack.empty())
+		{
+			BuildTask task{ std::move(taskStack.back()) };
+			taskStack.pop_back();
+
+			std::vector<Reference>& references = task.references;
+			const auto count = static_cast<uint32_t>(references.size());
+
+			AABB nodeBounds{}, centroidBounds{};
+			for (const Reference& reference : references)
+			{
+				nodeBounds.Grow(reference.bounds);
+				centroidBounds.Grow(reference.bounds.Center());
+			}
+
+			if (task.nodeIndex == 0)
+				rootArea = std::max(nodeBounds.Area(), FLT_MIN);
+
+			m_Nodes[task.nodeIndex].minAABB = nodeBounds.min;
+			m_Nodes[task.nodeIndex].maxAABB = nodeBounds.max;
+
+			const auto makeLeaf = [&]()
+			{
+				BVHNode& node = m_Nodes[task.nodeIndex];
+				node.leftFirst = static_cast<uint32_t>(m_PrimitiveIndices.size());
+				node.primitiveCount = count;
+				for (const Reference& reference : references)
+					m_PrimitiveIndices.push_back(reference.index);
+			};
+
+			if (count <= 1)
+			{
+				makeLeaf();
+				continue;
+			}
+
+			const float nodeArea = std::max(nodeBounds.Area(), FLT_MIN);
+
+			// Object split, binned over the reference centroids like the SAH builder
+			float objectCost{ FLT_MAX };
+			int objectAxis{ -1 };
+			uint32_t objectBin{};
+			float objectBinMin{}, objectBinScale{};
+			AABB objectLeftBounds{}, objectRightBounds{};
+
+			for (int a{ 0 }; a < 3; ++a)
+			{
+				const float axisMin{ centroidBounds.min[a] };
+				const float extent{ centroidBounds.max[a] - axisMin };
+				if (extent <= 0.f)
+					continue;
+
+				const float scale{ static_cast<float>(BinCount) / extent };
+
+				Bin bins[BinCount]{};
+				for (const Reference& reference : references)
+				{
+					Bin& bin = bins[GetBinIndex(reference.bounds.Center()[a], axisMin, scale)];
+					++bin.count;
+					bin.bounds.Grow(reference.bounds);
+				}
+
+				for (uint32_t split{ 1 }; split < BinCount; ++split)
+				{
+					AABB leftBounds{}, rightBounds{};
+					uint32_t leftCount{ 0 }, rightCount{ 0 };
+					for (uint32_t b{ 0 }; b < BinCount; ++b)
+					{
+						if (bins[b].count == 0)
+							continue;
+
+						(b < split ? leftBounds : rightBounds).Grow(bins[b].bounds);
+						(b < split ? leftCount : rightCount) += bins[b].count;
+					}
+
+					if (leftCount == 0 || rightCount == 0)
+						continue;
+
+					const float cost = TraversalCost
+						+ (static_cast<float>(leftCount) * leftBounds.Area() + static_cast<float>(rightCount) * rightBounds.Area()) / nodeArea;
+
+					if (cost < objectCost)
+					{
+						objectCost = cost;
+						objectAxis = a;
+						objectBin = split;
+						objectBinMin = axisMin;
+						objectBinScale = scale;
+						objectLeftBounds = leftBounds;
+						objectRightBounds = rightBounds;
+					}
+				}
+			}
+
+			// Spatial split, only worth it when the object split children overlap noticeably
+			float spatialCost{ FLT_MAX };
+			int spatialAxis{ -1 };
+			float spatialPlane{};
+
+			const AABB objectOverlap{ IntersectBounds(objectLeftBounds, objectRightBounds) };
+			const bool trySpatialSplit{ referenceCount < maxReferenceCount
+				&& (objectAxis < 0 || (objectOverlap.IsValid() && objectOverlap.Area() > SpatialSplitOverlapThreshold * rootArea)) };
+
+			if (trySpatialSplit)
+			{
+				for (int a{ 0 }; a < 3; ++a)
+				{
+					const float axisMin{ nodeBounds.min[a] };
+					const float extent{ nodeBounds.max[a] - axisMin };
+					if (extent <= 0.f)
+						continue;
+
+					const float binWidth{ extent / static_cast<float>(BinCount) };
+					const float scale{ static_cast<float>(BinCount) / extent };
+
+					// Every reference gets clipped into each bin it spans, entry and exit counts give the child sizes
+					SpatialBin bins[BinCount]{};
+					for (const Reference& reference : references)
+					{
+						const uint32_t firstBin = GetBinIndex(reference.bounds.min[a], axisMin, scale);
+						const uint32_t lastBin = GetBinIndex(reference.bounds.max[a], axisMin, scale);
+
+						++bins[firstBin].entryCount;
+						++bins[lastBin].exitCount;
+
+						for (uint32_t b{ firstBin }; b <= lastBin; ++b)
+						{
+							const float slabMin{ axisMin + binWidth * static_cast<float>(b) };
+							const float slabMax{ b == BinCount - 1 ? nodeBounds.max[a] : slabMin + binWidth };
+							GrowBounds(bins[b].bounds, firstBin == lastBin ? reference.bounds : clipReference(reference, a, slabMin, slabMax));
+						}
+					}
+
+					for (uint32_t split{ 1 }; split < BinCount; ++split)
+					{
+						AABB leftBounds{}, rightBounds{};
+						uint32_t leftCount{ 0 }, rightCount{ 0 };
+						for (uint32_t b{ 0 }; b < BinCount; ++b)
+						{
+							GrowBounds(b < split ? leftBounds : rightBounds, bins[b].bounds);
+							if (b < split)
+								leftCount += bins[b].entryCount;
+							else
+								rightCount += bins[b].exitCount;
+						}
+
+						if (leftCount == 0 || rightCount == 0)
+							continue;
+
+						const float cost = TraversalCost
+							+ (static_cast<float>(leftCount) * leftBounds.Area() + static_cast<float>(rightCount) * rightBounds.Area()) / nodeArea;
+
+						if (cost < spatialCost)
+						{
+							spatialCost = cost;
+							spatialAxis = a;
+							spatialPlane = axisMin + binWidth * static_cast<float>(split);
+						}
+					}
+				}
+			}
+
+			const float bestCost{ std::min(objectCost, spatialCost) };
+			if ((bestCost >= static_cast<float>(count) && count <= MaxLeafSize) || bestCost == FLT_MAX)
+			{
+				makeLeaf();
+				continue;
+			}
+
+			std::vector<Reference> leftReferences{}, rightReferences{};
+			leftReferences.reserve(count);
+			rightReferences.reserve(count);
+
+			bool useSpatialSplit{ spatialCost < objectCost };
+			if (useSpatialSplit)
+			{
+				for (const Reference& reference : references)
+				{
+					if (reference.bounds.max[spatialAxis] <= spatialPlane)
+						leftReferences.push_back(reference);
+					else if (reference.bounds.min[spatialAxis] >= spatialPlane)
+						rightReferences.push_back(reference);
+					else
+					{
+						leftReferences.push_back({ clipReference(reference, spatialAxis, reference.bounds.min[spatialAxis], spatialPlane), reference.index });
+						rightReferences.push_back({ clipReference(reference, spatialAxis, spatialPlane, reference.bounds.max[spatialAxis]), reference.index });
+					}
+				}
+
+				// Over budget, or the plane failed to separate anything, use the object split after all
+				const size_t addedReferences{ leftReferences.size() + rightReferences.size() - count };
+				if (referenceCount + addedReferences > maxReferenceCount || leftReferences.empty() || rightReferences.empty())
+				{
+					useSpatialSplit = false;
+					leftReferences.clear();
+					rightReferences.clear();
+				}
+				else
+				{
+					referenceCount += addedReferences;
+					peakReferenceCount = std::max(peakReferenceCount, referenceCount);
+				}
+			}
+
+			if (!useSpatialSplit)
+			{
+				if (objectAxis < 0)
+				{
+					makeLeaf();
+					continue;
+				}
+
+				for (const Reference& reference : references)
+				{
+					if (GetBinIndex(reference.bounds.Center()[objectAxis], objectBinMin, objectBinScale) < objectBin)
+						leftReferences.push_back(reference);
+					else
+						rightReferences.push_back(reference);
+				}
+			}
+
+			const auto leftIndex = static_cast<uint32_t>(m_Nodes.size());
+			m_Nodes.emplace_back();
+			m_Nodes.emplace_back();
+
+			m_Nodes[task.nodeIndex].leftFirst = leftIndex;
+			m_Nodes[task.nodeIndex].primitiveCount = 0;
+
+			references.clear();
+			references.shrink_to_fit();
+
+			taskStack.push_back({ leftIndex + 1, std::move(rightReferences) });
+			taskStack.push_back({ leftIndex, std::move(leftReferences) });
+		}
+
+		m_Nodes.shrink_to_fit();
+		m_PrimitiveIndices.shrink_to_fit();
+
+		// Every reference is alive at most twice, once in its parent list and once in a child list
+		return primitiveBounds.size() * sizeof(AABB) + peakReferenceCount * sizeof(Reference) * 2
+			+ m_Nodes.capacity() * sizeof(BVHNode) + m_PrimitiveIndices.size() * sizeof(uint32_t);
+	}
+
+	void BVH::BuildFromTriangles(const std::vector<Vector3>& positions, const std::vector<int>& indices, BVHBuildMode buildMode)
+	{
+		const auto buildStart = std::chrono::high_resolution_clock::now();
+
+		const auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+		std::vector<AABB> triangleBounds(triangleCount);
+		ParallelForChunks(triangleCount, [&](uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i{ begin }; i < end; ++i)
+			{
+				triangleBounds[i].Grow(positions[indices[i * 3]]);
+				triangleBounds[i].Grow(positions[indices[i * 3 + 1]]);
+				triangleBounds[i].Grow(positions[indices[i * 3 + 2]]);
+			}
+		});
+
+		const TriangleSource triangles{ positions, indices };
+		BuildTree(triangleBounds, buildMode, &triangles);
+
+		// Count the triangle bounds as part of the build
+		m_BuildStats.buildTimeMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+	}
+
+	void BVH::Clear()
+	{
+		m_Nodes.clear();
+		m_WideNodes.clear();
+		m_PrimitiveIndices.clear();
+
+		m_SAHCost = 0.f;
+		m_BuildSAHCost = 0.f;
+		m_BuildStats = {};
+	}
+
+	void BVH::Refit(const std::vector<AABB>& primitiveBounds)
+	{
+		RefitNodes([&](uint32_t primitiveIndex) { return primitiveBounds[primitiveIndex]; });
+	}
+
+	void BVH::RefitFromTriangles(const std::vector<Vector3>& positions, const std::vector<int>& indices)
+	{
+		RefitNodes([&](uint32_t triangleIndex)
+		{
+			AABB bounds{};
+			bounds.Grow(positions[indices[triangleIndex * 3]]);
+			bounds.Grow(positions[indices[triangleIndex * 3 + 1]]);
+			bounds.Grow(positions[indices[triangleIndex * 3 + 2]]);
+			return bounds;
+		});
+	}
+
+	template<typename PrimitiveBounds>
+	void BVH::RefitNodes(PrimitiveBounds&& getPrimitiveBounds)
+	{
+		if (m_Nodes.empty())
+			return;
+
+		RefitBounds(getPrimitiveBounds);
+
+		m_SAHCost = CalculateSAHCost();
+
+		// Same topology, so this reproduces the same wide layout with the new bounds
+		Collapse();
+	}
+
+	template<typename PrimitiveBounds>
+	void BVH::RefitBounds(PrimitiveBounds& getPrimitiveBounds)
+	{
+
+		// Split the top of the tree breadth first until there are enough independent subtrees to keep every core busy
+		const size_t targetSubtreeCount{ std::max(1u, std::thread::hardware_concurrency()) * 4 };
+
+		std::vector<uint32_t> topNodes{};
+		std::vector<uint32_t> subtreeRoots{ 0 };
+		while (subtreeRoots.size() < targetSubtreeCount)
+		{
+			std::vector<uint32_t> nextLevel{};
+			nextLevel.reserve(subtreeRoots.size() * 2);
+
+			for (const uint32_t nodeIndex : subtreeRoots)
+			{
+				const BVHNode& node = m_Nodes[nodeIndex];
+				if (node.IsLeaf())
+				{
+					nextLevel.push_back(nodeIndex);
+					continue;
+				}
+
+				topNodes.push_back(nodeIndex);
+				nextLevel.push_back(node.leftFirst);
+				nextLevel.push_back(node.leftFirst + 1);
+			}
+
+			// Only leaves left, the tree is too small to split any further
+			if (nextLevel.size() == subtreeRoots.size())
+				break;
+
+			subtreeRoots = std::move(nextLevel);
+		}
+
+		std::for_each(std::execution::par, subtreeRoots.begin(), subtreeRoots.end(), [&](uint32_t rootIndex)
+		{
+			RefitSubtree(rootIndex, getPrimitiveBounds);
+		});
+
+		// Breadth first order puts parents before children, walking it backwards finishes the top of the tree
+		for (auto it = topNodes.rbegin(); it != topNodes.rend(); ++it)
+		{
+			BVHNode& node = m_Nodes[*it];
+			const BVHNode& left = m_Nodes[node.leftFirst];
+			const BVHNode& right = m_Nodes[node.leftFirst + 1];
+
+			node.minAABB = Vector3::Min(left.minAABB, right.minAABB);
+			node.maxAABB = Vector3::Max(left.maxAABB, right.maxAABB);
+		}
+	}
+
+	template<typename PrimitiveBounds>
+	void BVH::RefitSubtree(uint32_t rootIndex, PrimitiveBounds& getPrimitiveBounds)
+	{
+		// Collect the subtree in pre-order, walking that list backwards visits every child before its parent
+		std::vector<uint32_t> subtreeNodes{};
+		std::vector<uint32_t> nodeStack{ rootIndex };
+		while (!nodeStack.empty())
+		{
+			const uint32_t nodeIndex = nodeStack.back();
+			nodeStack.pop_back();
+
+			subtreeNodes.push_back(nodeIndex);
+
+			const BVHNode& node = m_Nodes[nodeIndex];
+			if (!node.IsLeaf())
+			{
+				nodeStack.push_back(node.leftFirst);
+				nodeStack.push_back(node.leftFirst + 1);
+			}
+		}
+
+		for (auto it = subtreeNodes.rbegin(); it != subtreeNodes.rend(); ++it)
+		{
+			BVHNode& node = m_Nodes[*it];
+
+			AABB bounds{};
+			if (node.IsLeaf())
+			{
+				for (uint32_t i{ 0 }; i < node.primitiveCount; ++i)
+					bounds.Grow(getPrimitiveBounds(m_PrimitiveIndices[node.leftFirst + i]));
+			}
+			else
+			{
+				bounds.Grow(AABB{ m_Nodes[node.leftFirst].minAABB, m_Nodes[node.leftFirst].maxAABB });
+				bounds.Grow(AABB{ m_Nodes[node.leftFirst + 1].minAABB, m_Nodes[node.leftFirst + 1].maxAABB });
+			}
+
+			node.minAABB = bounds.min;
+			node.maxAABB = bounds.max;
+		}
+	}
+
+	void BVH::OrderNodesDepthFirst()
+	{
+		// Concurrent subtrees and breadth first top levels hand out node indices in whatever order they get there.
+		// Replaying the allocation of Subdivide() from the root, right child popped first, gives every build the same numbering
+		std::vector<BVHNode> orderedNodes(m_Nodes.size());
+		orderedNodes[0] = m_Nodes[0];
+		uint32_t orderedCount{ 1 };
+
+		struct OrderEntry
+		{
+			uint32_t oldIndex;
+			uint32_t newIndex;
+		};
+
+		std::vector<OrderEntry> orderStack{ { 0, 0 } };
+		while (!orderStack.empty())
+		{
+			const OrderEntry entry = orderStack.back();
+			orderStack.pop_back();
+
+			BVHNode& node = orderedNodes[entry.newIndex];
+			if (node.IsLeaf())
+				continue;
+
+			const uint32_t oldLeft{ node.leftFirst };
+			node.leftFirst = orderedCount;
+			orderedNodes[orderedCount] = m_Nodes[oldLeft];
+			orderedNodes[orderedCount + 1] = m_Nodes[oldLeft + 1];
+
+			orderStack.push_back({ oldLeft, orderedCount });
+			orderStack.push_back({ oldLeft + 1, orderedCount + 1 });
+			orderedCount += 2;
+		}
+
+		m_Nodes = std::move(orderedNodes);
+	}
+
+	float BVH::CalculateSAHCost() const
+	{
+		if (m_Nodes.empty())
+			return 0.f;
+
+		float cost{ 0.f };
+		for (const BVHNode& node : m_Nodes)
+		{
+			const float area = AABB{ node.minAABB, node.maxAABB }.Area();
+			cost += node.IsLeaf() ? area * static_cast<float>(node.primitiveCount) : area * TraversalCost;
+		}
+
+		const float rootArea = AABB{ m_Nodes[0].minAABB, m_Nodes[0].maxAABB }.Area();
+		return cost / std::max(rootArea, FLT_MIN);
+	}
+
+	void BVH::Collapse()
+	{
+		m_WideNodes.clear();
+		if (m_Nodes.empty())
+			return;
+
+		struct CollapseEntry
+		{
+			uint32_t wideIndex;
+			uint32_t binaryIndex;
+		};
+
+		std::vector<CollapseEntry> collapseStack{ { 0, 0 } };
+		m_WideNodes.emplace_back();
+
+		while (!collapseStack.empty())
+		{
+			const CollapseEntry entry = collapseStack.back();
+			collapseStack.pop_back();
+
+			// Start from the binary children and keep opening the largest inner child until every slot is used
+			uint32_t children[WideBVHWidth]{};
+			uint32_t childCount{ 0 };
+
+			const BVHNode& binaryNode = m_Nodes[entry.binaryIndex];
+			if (binaryNode.IsLeaf())
+			{
+				children[childCount++] = entry.binaryIndex;
+			}
+			else
+			{
+				children[childCount++] = binaryNode.leftFirst;
+				children[childCount++] = binaryNode.leftFirst + 1;
+			}
+
+			while (childCount < WideBVHWidth)
+			{
+				int largestChild{ -1 };
+				float largestArea{ -1.f };
+				for (uint32_t i{ 0 }; i < childCount; ++i)
+				{
+					const BVHNode& child = m_Nodes[children[i]];
+					const float area = AABB{ child.minAABB, child.maxAABB }.Area();
+					if (!child.IsLeaf() && area > largestArea)
+					{
+						largestChild = static_cast<int>(i);
+						largestArea = area;
+					}
+				}
+
+				if (largestChild < 0)
+					break;
+
+				const uint32_t openedNode = children[largestChild];
+				children[largestChild] = m_Nodes[openedNode].leftFirst;
+				children[childCount++] = m_Nodes[openedNode].leftFirst + 1;
+			}
+
+			for (uint32_t slot{ 0 }; slot < WideBVHWidth; ++slot)
+			{
+				uint32_t childIndex{ 0 }, primitiveCount{ 0 };
+				AABB childBounds{};
+
+				if (slot < childCount)
+				{
+					const BVHNode& child = m_Nodes[children[slot]];
+					childBounds = { child.minAABB, child.maxAABB };
+
+					if (child.IsLeaf())
+					{
+						childIndex = child.leftFirst;
+						primitiveCount = child.primitiveCount;
+					}
+					else
+					{
+						childIndex = static_cast<uint32_t>(m_WideNodes.size());
+						m_WideNodes.emplace_back();
+						collapseStack.push_back({ childIndex, children[slot] });
+					}
+				}
+
+				// Index instead of a reference, emplace_back above may have moved the nodes
+				WideBVHNode& wideNode = m_WideNodes[entry.wideIndex];
+				wideNode.bounds[0][slot] = childBounds.min.x;
+				wideNode.bounds[1][slot] = childBounds.min.y;
+				wideNode.bounds[2][slot] = childBounds.min.z;
+				wideNode.bounds[3][slot] = childBounds.max.x;
+				wideNode.bounds[4][slot] = childBounds.max.y;
+				wideNode.bounds[5][slot] = childBounds.max.z;
+				wideNode.children[slot] = childIndex;
+				wideNode.primitiveCounts[slot] = primitiveCount;
+			}
+		}
+	}
+
+	void BVH::UpdateNodeBounds(uint32_t nodeIndex, const std::vector<BuildPrimitive>& buildPrimitives, bool parallel)
+	{
+		BVHNode& node = m_Nodes[nodeIndex];
+		const BuildPrimitive* pPrimitives = buildPrimitives.data() + node.leftFirst;
+
+		AABB bounds{};
+		if (parallel)
+		{
+			std::vector<AABB> chunkBounds((node.primitiveCount + ParallelChunkSize - 1) / ParallelChunkSize);
+			ParallelForChunks(node.primitiveCount, [&](uint32_t begin, uint32_t end)
+			{
+				AABB& currentBounds = chunkBounds[begin / ParallelChunkSize];
+				for (uint32_t i{ begin }; i < end; ++i)
+					currentBounds.Grow(AABB{ pPrimitives[i].min, pPrimitives[i].max });
+			});
+
+			for (const AABB& currentBounds : chunkBounds)
+				GrowBounds(bounds, currentBounds);
+		}
+		else
+		{
+			for (uint32_t i{ 0 }; i < node.primitiveCount; ++i)
+				bounds.Grow(AABB{ pPrimitives[i].min, pPrimitives[i].max });
+		}
+
+		node.minAABB = bounds.min;
+		node.maxAABB = bounds.max;
+	}
+
+	void BVH::Subdivide(uint32_t rootIndex, std::vector<BuildPrimitive>& buildPrimitives, std::atomic<uint32_t>& nodeCount)
+	{
+		// Iterative instead of recursive, degenerate meshes can produce very deep trees
+		std::vector<uint32_t> nodeStack{ rootIndex };
+
+		while (!nodeStack.empty())
+		{
+			const uint32_t nodeIndex = nodeStack.back();
+			nodeStack.pop_back();
+
+			if (!SplitNode(nodeIndex, buildPrimitives, nodeCount, false))
+				continue;
+
+			nodeStack.push_back(m_Nodes[nodeIndex].leftFirst);
+			nodeStack.push_back(m_Nodes[nodeIndex].leftFirst + 1);
+		}
+	}
+
+	bool BVH::SplitNode(uint32_t nodeIndex, std::vector<BuildPrimitive>& buildPrimitives, std::atomic<uint32_t>& nodeCount, bool parallel)
+	{
+		BVHNode& node = m_Nodes[nodeIndex];
+		if (node.primitiveCount <= 1)
+			return false;
+
+		int axis{};
+		uint32_t splitBin{};
+		float binMin{}, binScale{};
+		const float splitCost = FindBestSplit(node, buildPrimitives, axis, splitBin, binMin, binScale, parallel);
+
+		// All centroids coincide, there is no way to separate these primitives
+		if (axis < 0)
+			return false;
+
+		const float leafCost = static_cast<float>(node.primitiveCount);
+		if (splitCost >= leafCost && node.primitiveCount <= MaxLeafSize)
+			return false;
+
+		// Partition the primitives in place around the split bin. Large nodes pick the chunked partition whether or not
+		// they run it in parallel, so their order never depends on the thread count
+		const uint32_t first = node.leftFirst;
+		uint32_t leftCount{};
+		if (node.primitiveCount >= ParallelSplitThreshold)
+		{
+			std::vector<BuildPrimitive> scratch{};
+			leftCount = ChunkedStablePartition(buildPrimitives.data() + first, node.primitiveCount, scratch, [&](const BuildPrimitive& primitive)
+			{
+				return GetBinIndex(GetCentroid(primitive, axis), binMin, binScale) < splitBin;
+			}, parallel);
+		}
+		else
+		{
+			int64_t i = first;
+			int64_t j = static_cast<int64_t>(first) + node.primitiveCount - 1;
+			while (i <= j)
+			{
+				if (GetBinIndex(GetCentroid(buildPrimitives[i], axis), binMin, binScale) < splitBin)
+					++i;
+				else
+					std::swap(buildPrimitives[i], buildPrimitives[j--]);
+			}
+
+			leftCount = static_cast<uint32_t>(i - first);
+		}
+
+		if (leftCount == 0 || leftCount == node.primitiveCount)
+			return false;
+
+		// Children are always allocated as a pair, Build() sized m_Nodes for every possible node so node stays valid
+		const uint32_t leftIndex = nodeCount.fetch_add(2, std::memory_order_relaxed);
+		const uint32_t rightCount = node.primitiveCount - leftCount;
+
+		node.leftFirst = leftIndex;
+		node.primitiveCount = 0;
+
+		m_Nodes[leftIndex] = { {}, first, {}, leftCount };
+		m_Nodes[leftIndex + 1] = { {}, first + leftCount, {}, rightCount };
+
+		UpdateNodeBounds(leftIndex, buildPrimitives, parallel && leftCount >= ParallelSplitThreshold);
+		UpdateNodeBounds(leftIndex + 1, buildPrimitives, parallel && rightCount >= ParallelSplitThreshold);
+
+		return true;
+	}
+
+	float BVH::FindBestSplit(const BVHNode& node, const std::vector<BuildPrimitive>& buildPrimitives,
+		int& axis, uint32_t& splitBin, float& binMin, float& binScale, bool parallel) const
+	{
+		axis = -1;
+		float bestCost{ FLT_MAX };
+
+		const BuildPrimitive* pPrimitives = buildPrimitives.data() + node.leftFirst;
+		const size_t chunkCount{ parallel ? (node.primitiveCount + ParallelChunkSize - 1) / ParallelChunkSize : 1 };
+
+		// Bin over the centroid bounds rather than the node bounds, large primitives would waste bins otherwise
+		const auto growCentroidBounds = [&](AABB& bounds, uint32_t begin, uint32_t end)
+		{
+			for (uint32_t i{ begin }; i < end; ++i)
+			{
+				float centroid[3];
+				GetCentroid(pPrimitives[i], centroid);
+				bounds.Grow(Vector3{ centroid[0], centroid[1], centroid[2] });
+			}
+		};
+
+		AABB centroidBounds{};
+		if (parallel)
+		{
+			std::vector<AABB> chunkBounds(chunkCount);
+			ParallelForChunks(node.primitiveCount, [&](uint32_t begin, uint32_t end)
+			{
+				growCentroidBounds(chunkBounds[begin / ParallelChunkSize], begin, end);
+			});
+
+			for (const AABB& currentBounds : chunkBounds)
+				GrowBounds(centroidBounds, currentBounds);
+		}
+		else
+		{
+			growCentroidBounds(centroidBounds, 0, node.primitiveCount);
+		}
+
+		float axisMin[3]{}, axisScale[3]{};
+		for (int a{ 0 }; a < 3; ++a)
+		{
+			axisMin[a] = centroidBounds.min[a];
+			const float extent = centroidBounds.max[a] - axisMin[a];
+			axisScale[a] = extent > 0.f ? static_cast<float>(BinCount) / extent : 0.f;
+		}
+
+		// Every chunk fills its own bins, merging them afterwards keeps the workers independent
+		SplitBins splitBins{};
+		if (parallel)
+		{
+			std::vector<SplitBins> chunkBins(chunkCount);
+			ParallelForChunks(node.primitiveCount, [&](uint32_t begin, uint32_t end)
+			{
+				BinPrimitives(pPrimitives + begin, end - begin, axisMin, axisScale, chunkBins[begin / ParallelChunkSize]);
+			});
+
+			for (const SplitBins& currentBins : chunkBins)
+			{
+				for (int a{ 0 }; a < 3; ++a)
+				{
+					for (uint32_t b{ 0 }; b < BinCount; ++b)
+					{
+						splitBins.bins[a][b].count += currentBins.bins[a][b].count;
+						GrowBounds(splitBins.bins[a][b].bounds, currentBins.bins[a][b].bounds);
+					}
+				}
+			}
+		}
+		else
+		{
+			BinPrimitives(pPrimitives, node.primitiveCount, axisMin, axisScale, splitBins);
+		}
+
+		const AABB nodeBounds{ node.minAABB, node.maxAABB };
+		const float nodeArea = std::max(nodeBounds.Area(), FLT_MIN);
+
+		for (int a{ 0 }; a < 3; ++a)
+		{
+			if (axisScale[a] <= 0.f)
+				continue;
+
+			const Bin* bins = splitBins.bins[a];
+
+			// Sweep from both sides to gather the cost of every split plane in one pass
+			float leftArea[BinCount - 1]{}, rightArea[BinCount - 1]{};
+			uint32_t leftCount[BinCount - 1]{}, rightCount[BinCount - 1]{};
+
+			AABB leftBounds{}, rightBounds{};
+			uint32_t leftSum{ 0 }, rightSum{ 0 };
+			for (uint32_t i{ 0 }; i < BinCount - 1; ++i)
+			{
+				leftSum += bins[i].count;
+				leftCount[i] = leftSum;
+				if (bins[i].count > 0)
+					leftBounds.Grow(bins[i].bounds);
+				leftArea[i] = leftBounds.IsValid() ? leftBounds.Area() : 0.f;
+
+				rightSum += bins[BinCount - 1 - i].count;
+				rightCount[BinCount - 2 - i] = rightSum;
+				if (bins[BinCount - 1 - i].count > 0)
+					rightBounds.Grow(bins[BinCount - 1 - i].bounds);
+				rightArea[BinCount - 2 - i] = rightBounds.IsValid() ? rightBounds.Area() : 0.f;
+			}
+
+			for (uint32_t i{ 0 }; i < BinCount - 1; ++i)
+			{
+				if (leftCount[i] == 0 || rightCount[i] == 0)
+					continue;
+
+				const float cost = TraversalCost
+					+ (static_cast<float>(leftCount[i]) * leftArea[i] + static_cast<float>(rightCount[i]) * rightArea[i]) / nodeArea;
+
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					axis = a;
+					splitBin = i + 1;
+					binMin = axisMin[a];
+					binScale = axisScale[a];
+				}
+			}
+		}
+
+		return bestCost;
+	}
+}
@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "Maths.h"
+
+namespace dae
+{
+	struct AABB
+	{
+		Vector3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
+		Vector3 max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+		void Grow(const Vector3& p)
+		{
+			min.x = std::min(min.x, p.x);
+			min.y = std::min(min.y, p.y);
+			min.z = std::min(min.z, p.z);
+			max.x = std::max(max.x, p.x);
+			max.y = std::max(max.y, p.y);
+			max.z = std::max(max.z, p.z);
+		}
+
+		void Grow(const AABB& other)
+		{
+			Grow(other.min);
+			Grow(other.max);
+		}
+
+		// Half of the surface area, the factor 2 cancels out in every SAH ratio
+		float Area() const
+		{
+			const float ex{ max.x - min.x }, ey{ max.y - min.y }, ez{ max.z - min.z };
+			return ex * ey + ey * ez + ez * ex;
+		}
+
+		Vector3 Center() const
+		{
+			return { (min.x + max.x) * .5f, (min.y + max.y) * .5f, (min.z + max.z) * .5f };
+		}
+
+		bool IsValid() const { return min.x <= max.x; }
+	};
+
+	struct BVHNode
+	{
+		Vector3 minAABB{};
+		uint32_t leftFirst{};  // Index of the left child for inner nodes, first primitive for leaves
+		Vector3 maxAABB{};
+		uint32_t primitiveCount{};  // 0 for inner nodes, the right child is always leftFirst + 1
+
+		bool IsLeaf() const { return primitiveCount > 0; }
+	};
+
+#if defined(__AVX__)
+	constexpr uint32_t WideBVHWidth{ 8 };
+#else
+	constexpr uint32_t WideBVHWidth{ 4 };
+#endif
+
+	/**
+	 * \brief Collapsed BVH node with up to WideBVHWidth children (8 with AVX, 4 with SSE).
+	 * The child bounds are stored SoA so a single SIMD slab test checks every child at once,
+	 * bounds[0..2] are min x/y/z and bounds[3..5] max x/y/z. Empty slots have inverted bounds and never get hit.
+	 */
+	struct alignas(32) WideBVHNode
+	{
+		float bounds[6][WideBVHWidth];
+		uint32_t children[WideBVHWidth];  // Wide node index for inner children, first primitive for leaves
+		uint32_t primitiveCounts[WideBVHWidth];  // 0 for inner children and empty slots
+	};
+
+	/**
+	 * \brief Stack of a wide BVH traversal. Each visited node pushes at most WideBVHWidth entries, so the inline entries cover
+	 * trees 64 levels deep. Nothing caps the depth of the builders, deeper trees of degenerate meshes spill over to the heap
+	 */
+	template<typename Entry>
+	class TraversalStack final
+	{
+	public:
+		TraversalStack() = default;
+		~TraversalStack() = default;
+
+		TraversalStack(const TraversalStack&) = delete;
+		TraversalStack(TraversalStack&&) noexcept = delete;
+		TraversalStack& operator=(const TraversalStack&) = delete;
+		TraversalStack& operator=(TraversalStack&&) noexcept = delete;
+
+		void Push(const Entry& entry)
+		{
+			if (m_Size == m_Capacity)
+				Grow();
+
+			m_pEntries[m_Size++] = entry;
+		}
+		Entry Pop() { return m_pEntries[--m_Size]; }
+
+		bool IsEmpty() const { return m_Size == 0; }
+		uint32_t GetSize() const { return m_Size; }
+		// Entry i counted from the bottom, the top one is GetSize() - 1
+		const Entry& operator[](uint32_t i) const { return m_pEntries[i]; }
+
+	private:
+		static constexpr uint32_t InlineCapacity{ 64 * WideBVHWidth };
+
+		Entry m_InlineEntries[InlineCapacity];
+		std::vector<Entry> m_HeapEntries{};
+		Entry* m_pEntries{ m_InlineEntries };
+		uint32_t m_Size{ 0 };
+		uint32_t m_Capacity{ InlineCapacity };
+
+		void Grow()
+		{
+			const bool isInline{ m_pEntries == m_InlineEntries };
+			m_Capacity *= 2;
+			m_HeapEntries.resize(m_Capacity);
+			if (isInline)
+				std::copy(m_InlineEntries, m_InlineEntries + m_Size, m_HeapEntries.begin());
+
+			m_pEntries = m_HeapEntries.data();
+		}
+	};
+
+	enum class BVHBuildMode
+	{
+		SAH,  // Binned SAH, best traversal speed
+		LBVH,  // Morton code order, builds several times faster for geometry that changes every frame
+		SBVH  // SAH with spatial splits that duplicate references, slowest build but tightest nodes for long thin triangles
+	};
+
+	struct BVHBuildStats
+	{
+		float buildTimeMs{};
+		size_t peakMemoryBytes{};  // Largest total of the builder's buffers alive at once, input bounds included
+	};
+
+	/**
+	 * \brief Binary bounding volume hierarchy, built with binned SAH, as an LBVH or as an SBVH over a list of primitive bounds.
+	 * The primitives themselves are never stored, leaves point into GetPrimitiveIndices()
+	 * which maps back to the caller's primitive list (e.g. the triangles of a TriangleMesh).
+	 * SBVH builds can list a primitive in several leaves.
+	 * Every build or refit also collapses the binary tree into a wide BVH, which is what gets traversed.
+	 * Both builders split the top levels first, then finish the subtrees concurrently. Every split depends only on the
+	 * primitives of its node and the nodes get renumbered depth first afterwards, so the tree is the same for any thread count.
+	 */
+	class BVH final
+	{
+	public:
+		void Build(const std::vector<AABB>& primitiveBounds, BVHBuildMode buildMode = BVHBuildMode::SAH);
+		void BuildFromTriangles(const std::vector<Vector3>& positions, const std::vector<int>& indices, BVHBuildMode buildMode = BVHBuildMode::SAH);
+		void Clear();
+
+		/**
+		 * \brief Recomputes every node's bounds bottom-up for primitives that moved, the topology stays untouched.
+		 * Independent subtrees get refitted in parallel. The tree quality slowly degrades when primitives move far,
+		 * compare GetSAHCost() to GetBuildSAHCost() to decide when a full rebuild is due.
+		 */
+		void Refit(const std::vector<AABB>& primitiveBounds);
+		void RefitFromTriangles(const std::vector<Vector3>& positions, const std::vector<int>& indices);
+
+		bool IsEmpty() const { return m_Nodes.empty(); }
+		const std::vector<BVHNode>& GetNodes() const { return m_Nodes; }
+		const std::vector<WideBVHNode>& GetWideNodes() const { return m_WideNodes; }
+		const std::vector<uint32_t>& GetPrimitiveIndices() const { return m_PrimitiveIndices; }
+
+		// Expected traversal cost relative to testing a single primitive, lower is better
+		float GetSAHCost() const { return m_SAHCost; }
+		float GetBuildSAHCost() const { return m_BuildSAHCost; }
+
+		const BVHBuildStats& GetBuildStats() const { return m_BuildStats; }
+
+		// Off builds one node after the other, the tree comes out identical either way
+		void SetParallelBuild(bool parallelBuild) { m_ParallelBuild = parallelBuild; }
+		bool IsParallelBuild() const { return m_ParallelBuild; }
+
+		// Extra references spatial splits may add, as a fraction of the primitive count
+		void SetSpatialSplitBudget(float budget) { m_SpatialSplitBudget = std::max(budget, 0.f); }
+		float GetSpatialSplitBudget() const { return m_SpatialSplitBudget; }
+
+		// Bounds and caller index of one primitive while building
+		struct BuildPrimitive
+		{
+			Vector3 min;
+			uint32_t index;
+			Vector3 max;
+		};
+
+	private:
+		// Triangle geometry for spatial splits, without it references are clipped as boxes
+		struct TriangleSource
+		{
+			const std::vector<Vector3>& positions;
+			const std::vector<int>& indices;
+		};
+
+		void BuildTree(const std::vector<AABB>& primitiveBounds, BVHBuildMode buildMode, const TriangleSource* pTriangles);
+
+		template<typename PrimitiveBounds>
+		void RefitNodes(PrimitiveBounds&& getPrimitiveBounds);
+		template<typename PrimitiveBounds>
+		void RefitBounds(PrimitiveBounds& getPrimitiveBounds);
+		template<typename PrimitiveBounds>
+		void RefitSubtree(uint32_t rootIndex, PrimitiveBounds& getPrimitiveBounds);
+		// Renumbers the nodes in the order a build without concurrent subtrees allocates them
+		void OrderNodesDepthFirst();
+		float CalculateSAHCost() const;
+		void Collapse();
+
+		// Both return the peak size of their working buffers
+		size_t BuildSAH(const std::vector<AABB>& primitiveBounds);
+		template<typename MortonCode>
+		size_t BuildLBVH(const std::vector<AABB>& primitiveBounds);
+		size_t BuildSBVH(const std::vector<AABB>& primitiveBounds, const TriangleSource* pTriangles);
+
+		void UpdateNodeBounds(uint32_t nodeIndex, const std::vector<BuildPrimitive>& buildPrimitives, bool parallel);
+		void Subdivide(uint32_t rootIndex, std::vector<BuildPrimitive>& buildPrimitives, std::atomic<uint32_t>& nodeCount);
+		bool SplitNode(uint32_t nodeIndex, std::vector<BuildPrimitive>& buildPrimitives, std::atomic<uint32_t>& nodeCount, bool parallel);
+		float FindBestSplit(const BVHNode& node, const std::vector<BuildPrimitive>& buildPrimitives,
+			int& axis, uint32_t& splitBin, float& binMin, float& binScale, bool parallel) const;
+
+		std::vector<BVHNode> m_Nodes{};
+		std::vector<WideBVHNode> m_WideNodes{};
+		std::vector<uint32_t> m_PrimitiveIndices{};
+
+		float m_SAHCost{ 0.f };
+		float m_BuildSAHCost{ 0.f };
+
+		BVHBuildStats m_BuildStats{};
+		float m_SpatialSplitBudget{ .3f };
+		bool m_ParallelBuild{ true };
+	};
+}
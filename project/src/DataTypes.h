@@ -1,8 +1,10 @@
 #pragma once
+#include <cfloat>
 #include <complex>
 #include <stdexcept>
 #include <vector>
 
+#include "BVH.h"
 #include "Maths.h"
 
 namespace dae
@@ -14,6 +16,8 @@ namespace dae
 		float radius{};
 
 		unsigned char materialIndex{ 0 };
+		bool castsShadow{ true };  // Blocks the light reaching other objects
+		bool receivesShadow{ true };  // Gets darkened by the objects casting shadows
 	};
 
 	struct Plane
@@ -22,15 +26,39 @@ namespace dae
 		Vector3 normal{};
 
 		unsigned char materialIndex{ 0 };
+		bool castsShadow{ true };  // Blocks the light reaching other objects
+		bool receivesShadow{ true };  // Gets darkened by the objects casting shadows
 	};
 
-	enum class TriangleCullMode
+	constexpr uint32_t PrimitiveBlockWidth{ 8 };
+
+	// PrimitiveBlockWidth spheres in SoA layout for the SIMD kernel. Unused lanes get a radiusSquared of -infinity and never hit
+	struct alignas(32) SphereBlock
+	{
+		float center[3][PrimitiveBlockWidth];
+		float radiusSquared[PrimitiveBlockWidth];
+	};
+
+	// PrimitiveBlockWidth planes as Dot(normal, p) = distance. Unused lanes stay zeroed and never hit
+	struct alignas(32) PlaneBlock
+	{
+		float normal[3][PrimitiveBlockWidth];
+		float distance[PrimitiveBlockWidth];
+	};
+
+	enum class TriangleCullMode : unsigned char
 	{
 		FrontFaceCulling,
 		BackFaceCulling,
 		NoCulling
 	};
 
+	enum class TriangleIntersector
+	{
+		MollerTrumbore,  // Fastest, can let rays slip through the shared edge of two triangles
+		Watertight  // Woop et al., no cracks between neighbouring triangles but a few more operations per test
+	};
+
 	struct Triangle
 	{
 		Triangle() = default;
@@ -55,6 +83,32 @@ namespace dae
 		unsigned char materialIndex{};
 	};
 
+	// Everything the intersection kernels read for one triangle, precomputed and packed together
+	struct TriangleRecord
+	{
+		TriangleRecord() = default;
+		explicit TriangleRecord(const Triangle& triangle) :
+			v0{ triangle.v0 }, edge1{ triangle.v1 - triangle.v0 }, edge2{ triangle.v2 - triangle.v0 },
+			normal{ triangle.normal }, cullMode{ triangle.cullMode }, materialIndex{ triangle.materialIndex } {}
+
+		Vector3 v0{};
+		Vector3 edge1{};  // v1 - v0
+		Vector3 edge2{};  // v2 - v0
+		Vector3 normal{};
+
+		TriangleCullMode cullMode{};
+		unsigned char materialIndex{};
+	};
+
+	// PrimitiveBlockWidth triangles in SoA layout for the SIMD kernel, [0..2] are x/y/z. Unused lanes stay zeroed
+	struct alignas(32) TriangleBlock
+	{
+		float v0[3][PrimitiveBlockWidth];
+		float edge1[3][PrimitiveBlockWidth];
+		float edge2[3][PrimitiveBlockWidth];
+		float normal[3][PrimitiveBlockWidth];
+	};
+
 	struct TriangleMesh
 	{
 		TriangleMesh() = default;
@@ -78,8 +132,17 @@ namespace dae
 		std::vector<Vector3> normals{};
 		std::vector<int> indices{};
 		unsigned char materialIndex{};
+		bool castsShadow{ true };
+		bool receivesShadow{ true };
 
 		TriangleCullMode cullMode{ TriangleCullMode::BackFaceCulling };
+		TriangleIntersector intersector{ TriangleIntersector::MollerTrumbore };
+
+		// One record per triangle (indices / 3), rebuilt by UpdateTriangleRecords()
+		std::vector<TriangleRecord> triangleRecords{};
+
+		// The same triangles in BVH leaf order (plain order without a BVH), packed per PrimitiveBlockWidth
+		std::vector<TriangleBlock> triangleBlocks{};
 
 		Matrix rotationTransform{};
 		Matrix translationTransform{};
@@ -91,8 +154,17 @@ namespace dae
 		Vector3 transformedMinAABB;
 		Vector3 transformedMaxAABB;
 
-		std::vector<Vector3> transformedPositions{};
-		std::vector<Vector3> transformedNormals{};
+		// Rays get transformed into object space instead of transforming every vertex,
+		// normals go back to world space with the inverse transpose
+		Matrix worldToObject{};
+		Matrix normalToWorld{};
+
+		// Bottom-level acceleration structure over the object space triangles, indexed by triangle (indices / 3)
+		BVH bvh{};
+		BVHBuildMode bvhBuildMode{ BVHBuildMode::SAH };
+
+		// Relative SAH cost increase after which UpdateDeformation() rebuilds the BVH instead of refitting it
+		float bvhRebuildThreshold{ 1.5f };
 
 		void Translate(const Vector3& translation)
 		{
@@ -130,7 +202,8 @@ namespace dae
 
 		void CalculateNormals()
 		{
-			normals.reserve(indices.size() / 3);
+			// Overwrites in place, deforming meshes recalculate their normals every update
+			normals.resize(indices.size() / 3);
 
 			for(size_t i{ 0 }; i < indices.size(); i += 3)
 			{
@@ -141,7 +214,7 @@ namespace dae
 				const Vector3 side1 = positions[v1Index] - positions[v0Index];
 				const Vector3 side2 = positions[v2Index] - positions[v0Index];
 
-				normals.emplace_back(Vector3::Cross(side1, side2).Normalized());
+				normals[i / 3] = Vector3::Cross(side1, side2).Normalized();
 			}
 		}
 
@@ -149,49 +222,82 @@ namespace dae
 		{
 			const Matrix finalTransform = scaleTransform * rotationTransform * translationTransform;
 
-			UpdatePositions(finalTransform);
-			UpdateNormals(finalTransform);
+			worldToObject = Matrix::Inverse(finalTransform);
+			normalToWorld = Matrix::Transpose(worldToObject);
 
 			// Update AABB
 			UpdateTransformedAABB(finalTransform);
 		}
 
-		void UpdatePositions(const Matrix& finalTransfrom)
+		// Corner 0, 1 or 2 of a triangle exactly as stored in positions, shared by every triangle using the vertex
+		const Vector3& GetTriangleVertex(uint32_t triangleIndex, uint32_t corner) const
 		{
-			if (transformedPositions.empty())
+			return positions[indices[triangleIndex * 3 + corner]];
+		}
+
+		// Packs the object space triangles with the current cull mode and material for the intersection kernels,
+		// call after building the BVH since the triangle blocks follow its leaf order
+		void UpdateTriangleRecords()
+		{
+			triangleRecords.resize(indices.size() / 3);
+
+			for (size_t i{ 0 }; i < triangleRecords.size(); ++i)
 			{
-				transformedPositions.reserve(positions.size());
-				for (size_t i{ 0 }; i < positions.size(); ++i)
-				{
-					transformedPositions.emplace_back(finalTransfrom.TransformPoint(positions[i]));
-				}
+				TriangleRecord& record = triangleRecords[i];
+				record.v0 = positions[indices[i * 3]];
+				record.edge1 = positions[indices[i * 3 + 1]] - record.v0;
+				record.edge2 = positions[indices[i * 3 + 2]] - record.v0;
+				record.normal = normals[i];
+				record.cullMode = cullMode;
+				record.materialIndex = materialIndex;
 			}
-			else
+
+			const std::vector<uint32_t>& primitiveIndices = bvh.GetPrimitiveIndices();
+			const size_t slotCount{ bvh.IsEmpty() ? triangleRecords.size() : primitiveIndices.size() };
+
+			triangleBlocks.assign((slotCount + PrimitiveBlockWidth - 1) / PrimitiveBlockWidth, TriangleBlock{});
+			for (size_t slot{ 0 }; slot < slotCount; ++slot)
 			{
-				for (size_t i{ 0 }; i < positions.size(); ++i)
+				const TriangleRecord& record = triangleRecords[bvh.IsEmpty() ? slot : primitiveIndices[slot]];
+				TriangleBlock& block = triangleBlocks[slot / PrimitiveBlockWidth];
+				const size_t lane{ slot % PrimitiveBlockWidth };
+
+				const auto store = [lane](float (&target)[3][PrimitiveBlockWidth], const Vector3& value)
 				{
-					transformedPositions[i] = finalTransfrom.TransformPoint(positions[i]);
-				}
+					target[0][lane] = value.x;
+					target[1][lane] = value.y;
+					target[2][lane] = value.z;
+				};
+				store(block.v0, record.v0);
+				store(block.edge1, record.edge1);
+				store(block.edge2, record.edge2);
+				store(block.normal, record.normal);
 			}
 		}
 
-		void UpdateNormals(const Matrix& finalTransform)
+		void BuildBVH()
 		{
-			if (transformedNormals.empty())
-			{
-				transformedNormals.reserve(normals.size());
-				for (size_t i{ 0 }; i < normals.size(); ++i)
-				{
-					transformedNormals.emplace_back(finalTransform.TransformVector(normals[i]));
-				}
-			}
-			else
+			bvh.BuildFromTriangles(positions, indices, bvhBuildMode);
+			UpdateTriangleRecords();
+		}
+
+		// Call after writing new (object space) positions for deforming meshes, refits the BVH instead of rebuilding it
+		void UpdateDeformation()
+		{
+			CalculateNormals();
+			UpdateAABB();
+			UpdateTransforms();
+
+			if (!bvh.IsEmpty())
 			{
-				for (size_t i{ 0 }; i < normals.size(); i++)
-				{
-					transformedNormals[i] = finalTransform.TransformVector(normals[i].Normalized());
-				}
+				bvh.RefitFromTriangles(positions, indices);
+
+				// Refitting keeps the topology of the original positions, rebuild once traversal got too expensive
+				if (bvh.GetSAHCost() > bvh.GetBuildSAHCost() * bvhRebuildThreshold)
+					bvh.BuildFromTriangles(positions, indices, bvhBuildMode);
 			}
+
+			UpdateTriangleRecords();
 		}
 
 
@@ -255,6 +361,152 @@ namespace dae
 			transformedMaxAABB = tMaxAABB;
 		}
 	};
+
+	// Sphere in 16-bit fixed point relative to the bounds of its cloud, half the size of a Vector4
+	struct QuantizedSphere
+	{
+		uint16_t x, y, z, radius;
+	};
+
+	/**
+	 * \brief Large set of world space spheres sharing one material, e.g. particles or a point cloud.
+	 * Every sphere is a Vector4 (center xyz, radius w), or a QuantizedSphere when built quantized.
+	 * The spheres get reordered into the leaf order of their own BVH, so each leaf reads one contiguous range.
+	 */
+	struct SphereCloud
+	{
+		SphereCloud() = default;
+		SphereCloud(const std::vector<Vector4>& _spheres, bool quantize, unsigned char _materialIndex) :
+			materialIndex(_materialIndex)
+		{
+			Build(_spheres, quantize);
+		}
+
+		std::vector<Vector4> spheres{};
+		std::vector<QuantizedSphere> quantizedSpheres{};  // Used instead of spheres when quantized
+		unsigned char materialIndex{};
+		bool castsShadow{ true };
+		bool receivesShadow{ true };
+
+		// Decoding of quantized spheres: center = quantizationOrigin + q * quantizationScale, radius = q * radiusScale
+		Vector3 quantizationOrigin{};
+		Vector3 quantizationScale{};
+		float radiusScale{};
+
+		Vector3 minAABB{};
+		Vector3 maxAABB{};
+
+		BVH bvh{};
+
+		bool IsQuantized() const { return !quantizedSpheres.empty(); }
+		size_t GetSphereCount() const { return IsQuantized() ? quantizedSpheres.size() : spheres.size(); }
+
+		Vector4 GetSphere(size_t index) const
+		{
+			if (!IsQuantized())
+				return spheres[index];
+
+			const QuantizedSphere& sphere = quantizedSpheres[index];
+			return {
+				quantizationOrigin.x + sphere.x * quantizationScale.x,
+				quantizationOrigin.y + sphere.y * quantizationScale.y,
+				quantizationOrigin.z + sphere.z * quantizationScale.z,
+				sphere.radius * radiusScale };
+		}
+
+		// Decodes the spheres [first, first + count) into the first count lanes of a block, count <= PrimitiveBlockWidth
+		void LoadSphereBlock(size_t first, uint32_t count, SphereBlock& block) const
+		{
+			for (uint32_t lane{ 0 }; lane < count; ++lane)
+			{
+				const Vector4 sphere{ GetSphere(first + lane) };
+				block.center[0][lane] = sphere.x;
+				block.center[1][lane] = sphere.y;
+				block.center[2][lane] = sphere.z;
+				block.radiusSquared[lane] = sphere.w * sphere.w;
+			}
+		}
+
+		void Build(const std::vector<Vector4>& inputSpheres, bool quantize)
+		{
+			spheres.clear();
+			quantizedSpheres.clear();
+
+			AABB cloudBounds{};
+			float maxRadius{ 0.f };
+			for (const Vector4& sphere : inputSpheres)
+			{
+				cloudBounds.Grow(Vector3{ sphere.x, sphere.y, sphere.z });
+				maxRadius = std::max(maxRadius, sphere.w);
+			}
+
+			if (quantize && !inputSpheres.empty())
+			{
+				constexpr float maxQuantized{ 65535.f };
+				quantizationOrigin = cloudBounds.min;
+				quantizationScale = {
+					(cloudBounds.max.x - cloudBounds.min.x) / maxQuantized,
+					(cloudBounds.max.y - cloudBounds.min.y) / maxQuantized,
+					(cloudBounds.max.z - cloudBounds.min.z) / maxQuantized };
+				radiusScale = maxRadius / maxQuantized;
+
+				const auto quantizeComponent = [](float value, float origin, float scale)
+				{
+					return static_cast<uint16_t>(scale > 0.f ? std::clamp(std::round((value - origin) / scale), 0.f, 65535.f) : 0.f);
+				};
+
+				// Radii round up so small spheres never collapse to nothing
+				quantizedSpheres.resize(inputSpheres.size());
+				for (size_t i{ 0 }; i < inputSpheres.size(); ++i)
+				{
+					const Vector4& sphere = inputSpheres[i];
+					quantizedSpheres[i] = {
+						quantizeComponent(sphere.x, quantizationOrigin.x, quantizationScale.x),
+						quantizeComponent(sphere.y, quantizationOrigin.y, quantizationScale.y),
+						quantizeComponent(sphere.z, quantizationOrigin.z, quantizationScale.z),
+						static_cast<uint16_t>(radiusScale > 0.f ? std::min(std::ceil(sphere.w / radiusScale), 65535.f) : 0.f) };
+				}
+			}
+			else
+			{
+				spheres = inputSpheres;
+			}
+
+			// Bounds of what gets intersected, i.e. after quantization
+			std::vector<AABB> sphereBounds(GetSphereCount());
+			AABB bounds{};
+			for (size_t i{ 0 }; i < sphereBounds.size(); ++i)
+			{
+				const Vector4 sphere{ GetSphere(i) };
+				sphereBounds[i] = {
+					{ sphere.x - sphere.w, sphere.y - sphere.w, sphere.z - sphere.w },
+					{ sphere.x + sphere.w, sphere.y + sphere.w, sphere.z + sphere.w } };
+				bounds.Grow(sphereBounds[i]);
+			}
+
+			minAABB = bounds.min;
+			maxAABB = bounds.max;
+
+			// SAH never duplicates primitives, so the leaf order is a permutation of the spheres
+			bvh.Build(sphereBounds, BVHBuildMode::SAH);
+			const std::vector<uint32_t>& order = bvh.GetPrimitiveIndices();
+
+			if (IsQuantized())
+			{
+				std::vector<QuantizedSphere> reordered(order.size());
+				for (size_t slot{ 0 }; slot < order.size(); ++slot)
+					reordered[slot] = quantizedSpheres[order[slot]];
+				quantizedSpheres = std::move(reordered);
+			}
+			else
+			{
+				std::vector<Vector4> reordered(order.size());
+				for (size_t slot{ 0 }; slot < order.size(); ++slot)
+					reordered[slot] = spheres[order[slot]];
+				spheres = std::move(reordered);
+			}
+		}
+	};
 #pragma endregion
 #pragma region LIGHT
 	enum class LightType
@@ -283,6 +535,66 @@ namespace dae
 		float max{ FLT_MAX };
 	};
 
+	// Neighbouring rays traced together through the BVHs, which lanes are in use is passed alongside as a bitmask
+	struct RayPacket
+	{
+		Ray rays[PrimitiveBlockWidth];
+	};
+
+	// Pyramid of rays leaving one origin, bounded by four side planes with normalized inward normals. It has no near or far plane
+	struct Frustum
+	{
+		Vector3 origin{};
+		Vector3 normals[4]{};
+
+		// corners are the directions of the four edges, in order around the pyramid
+		static Frustum FromCorners(const Vector3& origin, const Vector3 (&corners)[4])
+		{
+			Frustum frustum{ origin };
+			for (int i{ 0 }; i < 4; ++i)
+			{
+				Vector3 normal{ Vector3::Cross(corners[i], corners[(i + 1) % 4]).Normalized() };
+
+				// The opposite edge is always inside, whichever way round the corners were given
+				if (Vector3::Dot(normal, corners[(i + 2) % 4]) < 0.f)
+					normal = -normal;
+
+				frustum.normals[i] = normal;
+			}
+
+			return frustum;
+		}
+
+		// Conservative, a box next to an edge of the pyramid can pass without touching it
+		bool Overlaps(const Vector3& minAABB, const Vector3& maxAABB) const
+		{
+			for (const Vector3& normal : normals)
+			{
+				// Corner of the box furthest inside this plane
+				const Vector3 corner{
+					normal.x >= 0.f ? maxAABB.x : minAABB.x,
+					normal.y >= 0.f ? maxAABB.y : minAABB.y,
+					normal.z >= 0.f ? maxAABB.z : minAABB.z };
+
+				if (Vector3::Dot(normal, corner - origin) < 0.f)
+					return false;
+			}
+
+			return true;
+		}
+
+		bool Overlaps(const Vector3& center, float radius) const
+		{
+			for (const Vector3& normal : normals)
+			{
+				if (Vector3::Dot(normal, center - origin) < -radius)
+					return false;
+			}
+
+			return true;
+		}
+	};
+
 	struct HitRecord
 	{
 		Vector3 origin{};
@@ -291,6 +603,29 @@ namespace dae
 
 		bool didHit{ false };
 		unsigned char materialIndex{ 0 };
+		bool receivesShadow{ true };  // False skips the shadow rays of the hit
+	};
+
+	enum class HitObjectType : uint8_t
+	{
+		None,
+		Plane,
+		Sphere,
+		Triangle,
+		SphereCloud
+	};
+
+	// Closest hit while tracing, only what it takes to compare hits and find the winner again.
+	// Position, normal and material are derived once for the winner, see Scene::MaterializeHit
+	struct PrimitiveHit
+	{
+		float t{ FLT_MAX };
+		uint32_t objectIndex{};  // Into the scene's planes, spheres, meshes or sphere clouds
+		uint32_t primitiveIndex{};  // Triangle of a mesh, sphere of a sphere cloud
+		float barycentricU{}, barycentricV{};  // Weights of a triangle's second and third vertex
+		HitObjectType type{ HitObjectType::None };
+
+		bool DidHit() const { return type != HitObjectType::None; }
 	};
 #pragma endregion
 }
@@ -25,6 +25,12 @@ namespace dae
 		 * \return color
 		 */
 		virtual ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) = 0;
+
+		/**
+		 * \brief Upper bound of every channel Shade() can return, over all light and view directions
+		 * \return bound, infinity when the material has no finite one
+		 */
+		virtual float GetMaxBRDF() const = 0;
 	};
 #pragma endregion
 
@@ -43,6 +49,11 @@ namespace dae
 			return m_Color;
 		}
 
+		float GetMaxBRDF() const override
+		{
+			return std::max({ m_Color.r, m_Color.g, m_Color.b });
+		}
+
 	private:
 		ColorRGB m_Color{ colors::White };
 	};
@@ -62,6 +73,11 @@ namespace dae
 			return BRDF::Lambert(m_DiffuseReflectance, m_DiffuseColor);
 		}
 
+		float GetMaxBRDF() const override
+		{
+			return m_DiffuseReflectance * std::max({ m_DiffuseColor.r, m_DiffuseColor.g, m_DiffuseColor.b }) / PI;
+		}
+
 	private:
 		ColorRGB m_DiffuseColor{ colors::White };
 		float m_DiffuseReflectance{ 1.f }; //kd
@@ -86,6 +102,12 @@ namespace dae
 				+ BRDF::Phong(m_SpecularReflectance, m_PhongExponent, l, v, hitRecord.normal);
 		}
 
+		// The Phong lobe peaks at ks when the view lines up with the reflected light
+		float GetMaxBRDF() const override
+		{
+			return m_DiffuseReflectance * std::max({ m_DiffuseColor.r, m_DiffuseColor.g, m_DiffuseColor.b }) / PI + m_SpecularReflectance;
+		}
+
 	private:
 		ColorRGB m_DiffuseColor{ colors::White };
 		float m_DiffuseReflectance{ 0.5f }; //kd
@@ -126,6 +148,17 @@ namespace dae
 			return diffuse + specular;
 		}
 
+		// Fresnel stays under 1 and GGX peaks at 1 / (PI * a^2) facing the half vector. Each Schlick-GGX term divided by its
+		// cosine peaks at 1 / k at grazing angles, so smooth surfaces get a very large bound
+		float GetMaxBRDF() const override
+		{
+			const float a{ Square(m_Roughness) };
+			const float k{ Square(a + 1.f) / 8.f };
+			const float maxDistribution{ 1.f / (PI * std::max(Square(a), FLT_MIN)) };
+			const float maxDiffuse{ m_Metalness < 1.f ? std::max({ m_Albedo.r, m_Albedo.g, m_Albedo.b }) / PI : 0.f };
+			return maxDiffuse + maxDistribution / (4.f * k * k);
+		}
+
 	private:
 		ColorRGB m_Albedo{ 0.955f, 0.637f, 0.538f }; //Copper
 		float m_Metalness{ 1.0f };
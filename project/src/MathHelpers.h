@@ -1,6 +1,8 @@
 #pragma once
 #include <cmath>
 #include <cfloat>
+#include <cstdint>
+#include <utility>
 
 namespace dae
 {
@@ -26,6 +28,89 @@ namespace dae
 
 	inline bool AreEqual(float a, float b, float epsilon = FLT_EPSILON)
 	{
-		return abs(a - b) < epsilon;
+		return std::abs(a - b) < epsilon;
+	}
+
+	/* --- SPACE-FILLING CURVES --- */
+	// Used to walk 2D grids so that consecutive cells stay close together
+
+	// Spreads the lower 16 bits over the even bit positions
+	inline uint32_t SpreadBits2D(uint32_t value)
+	{
+		value &= 0x0000FFFF;
+		value = (value | (value << 8)) & 0x00FF00FF;
+		value = (value | (value << 4)) & 0x0F0F0F0F;
+		value = (value | (value << 2)) & 0x33333333;
+		value = (value | (value << 1)) & 0x55555555;
+		return value;
+	}
+
+	// Inverse of SpreadBits2D, gathers the even bit positions
+	inline uint32_t CompactBits2D(uint32_t value)
+	{
+		value &= 0x55555555;
+		value = (value | (value >> 1)) & 0x33333333;
+		value = (value | (value >> 2)) & 0x0F0F0F0F;
+		value = (value | (value >> 4)) & 0x00FF00FF;
+		value = (value | (value >> 8)) & 0x0000FFFF;
+		return value;
+	}
+
+	inline uint32_t EncodeMorton2D(uint32_t x, uint32_t y)
+	{
+		return SpreadBits2D(x) | (SpreadBits2D(y) << 1);
+	}
+
+	inline void DecodeMorton2D(uint32_t index, uint32_t& x, uint32_t& y)
+	{
+		x = CompactBits2D(index);
+		y = CompactBits2D(index >> 1);
+	}
+
+	// Position along the Hilbert curve filling a side x side grid, side has to be a power of two
+	// https://en.wikipedia.org/wiki/Hilbert_curve#Applications_and_mapping_algorithms
+	inline uint32_t EncodeHilbert2D(uint32_t side, uint32_t x, uint32_t y)
+	{
+		uint32_t index{ 0 };
+		for (uint32_t s{ side / 2 }; s > 0; s /= 2)
+		{
+			const uint32_t rx{ (x & s) > 0 ? 1u : 0u }, ry{ (y & s) > 0 ? 1u : 0u };
+			index += s * s * ((3 * rx) ^ ry);
+
+			// Rotate the quadrant so the sub curve starts where the previous one ended
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = side - 1 - x;
+					y = side - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return index;
+	}
+
+	inline void DecodeHilbert2D(uint32_t side, uint32_t index, uint32_t& x, uint32_t& y)
+	{
+		x = 0;
+		y = 0;
+		for (uint32_t s{ 1 }; s < side; s *= 2)
+		{
+			const uint32_t rx{ 1 & (index / 2) }, ry{ 1 & (index ^ rx) };
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+
+			x += s * rx;
+			y += s * ry;
+			index /= 4;
+		}
 	}
 }
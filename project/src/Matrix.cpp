@@ -83,6 +83,72 @@ namespace dae {
 		return out;
 	}
 
+	const Matrix& Matrix::Inverse()
+	{
+		float m[4][4]{};
+		for (int r{ 0 }; r < 4; ++r)
+		{
+			for (int c{ 0 }; c < 4; ++c)
+			{
+				m[r][c] = data[r][c];
+			}
+		}
+
+		// 2x2 sub-determinants of the upper and lower two rows (Laplace expansion)
+		const float s0 = m[0][0] * m[1][1] - m[1][0] * m[0][1];
+		const float s1 = m[0][0] * m[1][2] - m[1][0] * m[0][2];
+		const float s2 = m[0][0] * m[1][3] - m[1][0] * m[0][3];
+		const float s3 = m[0][1] * m[1][2] - m[1][1] * m[0][2];
+		const float s4 = m[0][1] * m[1][3] - m[1][1] * m[0][3];
+		const float s5 = m[0][2] * m[1][3] - m[1][2] * m[0][3];
+
+		const float c5 = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+		const float c4 = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+		const float c3 = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+		const float c2 = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+		const float c1 = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+		const float c0 = m[2][0] * m[3][1] - m[3][0] * m[2][1];
+
+		const float determinant = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+		assert(determinant != 0.f && "Matrix is not invertible");
+
+		const float invDet = 1.f / determinant;
+
+		data[0] = {
+			(m[1][1] * c5 - m[1][2] * c4 + m[1][3] * c3) * invDet,
+			(-m[0][1] * c5 + m[0][2] * c4 - m[0][3] * c3) * invDet,
+			(m[3][1] * s5 - m[3][2] * s4 + m[3][3] * s3) * invDet,
+			(-m[2][1] * s5 + m[2][2] * s4 - m[2][3] * s3) * invDet };
+
+		data[1] = {
+			(-m[1][0] * c5 + m[1][2] * c2 - m[1][3] * c1) * invDet,
+			(m[0][0] * c5 - m[0][2] * c2 + m[0][3] * c1) * invDet,
+			(-m[3][0] * s5 + m[3][2] * s2 - m[3][3] * s1) * invDet,
+			(m[2][0] * s5 - m[2][2] * s2 + m[2][3] * s1) * invDet };
+
+		data[2] = {
+			(m[1][0] * c4 - m[1][1] * c2 + m[1][3] * c0) * invDet,
+			(-m[0][0] * c4 + m[0][1] * c2 - m[0][3] * c0) * invDet,
+			(m[3][0] * s4 - m[3][1] * s2 + m[3][3] * s0) * invDet,
+			(-m[2][0] * s4 + m[2][1] * s2 - m[2][3] * s0) * invDet };
+
+		data[3] = {
+			(-m[1][0] * c3 + m[1][1] * c1 - m[1][2] * c0) * invDet,
+			(m[0][0] * c3 - m[0][1] * c1 + m[0][2] * c0) * invDet,
+			(-m[3][0] * s3 + m[3][1] * s1 - m[3][2] * s0) * invDet,
+			(m[2][0] * s3 - m[2][1] * s1 + m[2][2] * s0) * invDet };
+
+		return *this;
+	}
+
+	Matrix Matrix::Inverse(const Matrix& m)
+	{
+		Matrix out{ m };
+		out.Inverse();
+
+		return out;
+	}
+
 	Vector3 Matrix::GetAxisX() const
 	{
 		return data[0];
@@ -0,0 +1,79 @@
+#include "PerformanceCounters.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace dae;
+
+#if defined(__linux__)
+namespace
+{
+	int OpenEvent(uint32_t type, uint64_t config)
+	{
+		perf_event_attr attributes{};
+		attributes.size = sizeof(perf_event_attr);
+		attributes.type = type;
+		attributes.config = config;
+		// Count threads spawned from here on too, user space only so it works with the default paranoid level
+		attributes.inherit = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+
+		return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+	}
+}
+
+PerformanceCounters::PerformanceCounters()
+{
+	m_FileDescriptors[static_cast<size_t>(Event::CacheReferences)] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+	m_FileDescriptors[static_cast<size_t>(Event::CacheMisses)] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	m_FileDescriptors[static_cast<size_t>(Event::L1DataMisses)] = OpenEvent(PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+PerformanceCounters::~PerformanceCounters()
+{
+	for (const int fileDescriptor : m_FileDescriptors)
+	{
+		if (fileDescriptor >= 0)
+			close(fileDescriptor);
+	}
+}
+
+PerformanceCounters::Values PerformanceCounters::Read() const
+{
+	Values values{};
+	for (size_t i{ 0 }; i < m_FileDescriptors.size(); ++i)
+	{
+		uint64_t count{ 0 };
+		if (m_FileDescriptors[i] >= 0 && read(m_FileDescriptors[i], &count, sizeof(count)) == sizeof(count))
+			values.counts[i] = count;
+	}
+	return values;
+}
+#else
+PerformanceCounters::PerformanceCounters()
+{
+	m_FileDescriptors.fill(-1);
+}
+
+PerformanceCounters::~PerformanceCounters() = default;
+
+PerformanceCounters::Values PerformanceCounters::Read() const
+{
+	return {};
+}
+#endif
+
+bool PerformanceCounters::IsAvailable() const
+{
+	for (const int fileDescriptor : m_FileDescriptors)
+	{
+		if (fileDescriptor >= 0)
+			return true;
+	}
+	return false;
+}
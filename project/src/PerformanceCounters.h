@@ -0,0 +1,55 @@
+#pragma once
+
+//Standard includes
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace dae
+{
+	/**
+	 * \brief Hardware cache counters of the whole process, read through perf_event_open on Linux.
+	 * The counters are inherited by threads created after construction, so create this before any worker threads
+	 * that should be included. Unavailable (and every value 0) on other platforms or when the kernel refuses access.
+	 */
+	class PerformanceCounters final
+	{
+	public:
+		enum class Event
+		{
+			CacheReferences,  // Last level cache accesses
+			CacheMisses,  // Last level cache misses
+			L1DataMisses,  // L1 data cache read misses
+			TOTAL_EVENTS
+		};
+
+		struct Values
+		{
+			std::array<uint64_t, static_cast<size_t>(Event::TOTAL_EVENTS)> counts{};
+
+			uint64_t operator[](Event event) const { return counts[static_cast<size_t>(event)]; }
+			Values operator-(const Values& other) const
+			{
+				Values difference{};
+				for (size_t i{ 0 }; i < counts.size(); ++i)
+					difference.counts[i] = counts[i] - other.counts[i];
+				return difference;
+			}
+		};
+
+		PerformanceCounters();
+		~PerformanceCounters();
+
+		PerformanceCounters(const PerformanceCounters&) = delete;
+		PerformanceCounters(PerformanceCounters&&) noexcept = delete;
+		PerformanceCounters& operator=(const PerformanceCounters&) = delete;
+		PerformanceCounters& operator=(PerformanceCounters&&) noexcept = delete;
+
+		// True if at least one of the events could be opened, the others read as 0
+		bool IsAvailable() const;
+		Values Read() const;
+
+	private:
+		std::array<int, static_cast<size_t>(Event::TOTAL_EVENTS)> m_FileDescriptors{};
+	};
+}
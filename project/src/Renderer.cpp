@@ -3,7 +3,11 @@
 #include "SDL_surface.h"
 
 
+#include <bit>
+#include <cassert>
+#include <chrono>
 #include <execution>
+#include <limits>
 //Project includes
 #include "Renderer.h"
 #include "Maths.h"
@@ -11,14 +15,89 @@
 #include "Material.h"
 #include "Scene.h"
 #include "Utils.h"
+#include "VisibilityBuffer.h"
 
 using namespace dae;
 
-#define PARALLEL_EXECUTION
+namespace
+{
+	// Tasks to aim for per thread, leaves the stealing enough slack to even out misestimated tiles
+	constexpr uint32_t TasksPerThread{ 16 };
+
+	// Upper bound for SetThreadCount, leaves room for oversubscription experiments without spawning runaway threads
+	constexpr uint32_t MaxThreadCount{ 256 };
+
+	// Pixels per wavefront, the streams of one fit in the L2 cache at the highest MSAA setting
+	constexpr uint32_t WavefrontPixelCount{ 256 };
+
+	// Longer culled object lists are slower to test one by one than to traverse the top-level BVH
+	constexpr size_t MaxVisibleObjects{ 16 };
+
+	// Streams of one render thread's wavefront, kept around so they stop allocating once they have grown
+	struct WavefrontStreams
+	{
+		struct PrimaryHit
+		{
+			HitRecord hit;
+			Vector3 rayDirection;
+			uint32_t pixelSlot;  // Position of the pixel within the wavefront
+		};
+
+		std::vector<PrimaryHit> primaryHits{};
+		std::vector<Ray> shadowRays{};  // Light count rays per primary hit, in primary hit order
+		std::vector<ColorRGB> lightColors{};  // Unshadowed light of each shadow ray
+		std::vector<uint32_t> shadowRayKeys{};  // NoShadowRay for the rays left untraced
+		std::vector<uint32_t> keyOffsets{};
+		std::vector<uint32_t> sortedShadowRays{};
+		std::vector<uint8_t> isOccluded{};
+		std::vector<ColorRGB> pixelColors{};
+	};
+
+	constexpr uint32_t NoShadowRay{ std::numeric_limits<uint32_t>::max() };
+
+	// What blocked the calling thread's last shadow ray towards each light, see Scene::IsOccluded
+	std::vector<PrimitiveHit>& GetLastOccluders(size_t lightCount)
+	{
+		static thread_local std::vector<PrimitiveHit> lastOccluders{};
+		if (lastOccluders.size() < lightCount)
+			lastOccluders.resize(lightCount);
+		return lastOccluders;
+	}
+
+	// Ray from a hit towards a light, ending at the light for point lights
+	// Calls visit(x, y) for every cell of a width x height rectangle along a Morton or Hilbert curve.
+	// Merged tasks are long strips, so the curve fills power of two squares one after the other along the longer side.
+	// A Hilbert square ends next to where the following one starts
+	template<typename Visit>
+	void WalkCurve(bool isHilbert, uint32_t width, uint32_t height, Visit&& visit)
+	{
+		const bool alongX{ width >= height };
+		const uint32_t side{ std::bit_ceil(std::min(width, height)) };
+		const uint32_t length{ alongX ? width : height };
+
+		for (uint32_t offset{ 0 }; offset < length; offset += side)
+		{
+			for (uint32_t index{ 0 }; index < side * side; ++index)
+			{
+				uint32_t u{}, v{};
+				if (isHilbert)
+					DecodeHilbert2D(side, index, u, v);
+				else
+					DecodeMorton2D(index, u, v);
+
+				const uint32_t x{ alongX ? offset + u : v }, y{ alongX ? v : offset + u };
+				if (x < width && y < height)
+					visit(x, y);
+			}
+		}
+	}
+}
 
 Renderer::Renderer(SDL_Window * pWindow) :
 	m_pWindow(pWindow),
-	m_pBuffer(SDL_GetWindowSurface(pWindow))
+	m_pBuffer(SDL_GetWindowSurface(pWindow)),
+	m_ThreadCount(std::max(std::thread::hardware_concurrency(), 1u)),
+	m_pThreadPool(std::make_unique<ThreadPool>(m_ThreadCount))
 {
 	//Initialize
 	SDL_GetWindowSize(pWindow, &m_Width, &m_Height);
@@ -30,38 +109,118 @@ Renderer::Renderer(SDL_Window * pWindow) :
 	// Calculate Samples positions, based on a grid in uniform distribution
 	// https://en.wikipedia.org/wiki/Supersampling#Supersampling_patterns
 	CalculateSamplePositions();
-
-	// Calculates each samples color strength,
-	// instead of static_casting each samples and each frame,
-	// it's done here once and once IncreaseSamples() or DecreaseSamples() gets called
-	CalculateSampleColorStrength();
 }
 
-void Renderer::Render(Scene* pScene) const
+void Renderer::Render(Scene* pScene)
 {
+	// Objects may have moved during Update, refresh the scene's BVH before tracing
+	pScene->UpdateAccelerationStructure();
+	BuildLightTable(pScene);
+
 	Camera& camera = pScene->GetCamera();
 	const Matrix& cameraToWorld = camera.CalculateCameraToWorld();
 	const float fov = camera.GetFovValue();
 
-#if defined(PARALLEL_EXECUTION)
-	uint32_t amountOfPixels{ uint32_t(m_Width * m_Height) };
-	std::vector<uint32_t> pixelIndices{};
+	const uint32_t width{ static_cast<uint32_t>(m_Width) };
+	m_TaskScheduler.ScheduleTasks(width, static_cast<uint32_t>(m_Height), GetActiveThreadCount() * TasksPerThread);
+	std::vector<RenderTask>& renderTasks{ m_TaskScheduler.GetTasks() };
 
-	pixelIndices.reserve(amountOfPixels);
-	for(uint32_t index{}; index < amountOfPixels; ++index) 
-		pixelIndices.emplace_back(index);
+	// The settings can only change between frames
+	const RenderKernels kernels{ SelectRenderKernels() };
 
-	std::for_each(std::execution::par, pixelIndices.begin(), pixelIndices.end(), [&](int i)
+	const auto renderTask = [&](RenderTask& task)
 	{
-		RenderPixel(pScene, i, fov, m_AspectRatio, cameraToWorld, camera.origin);
-	});
-#else
-	uint32_t amountOfPixels{ uint32_t(m_Width * m_Height) };
-	for(uint32_t pixelIndex{}; pixelIndex < amountOfPixels; pixelIndex++)
+		const auto start = std::chrono::steady_clock::now();
+
+		if (m_VisibilityPrepassEnabled)
+		{
+			(this->*kernels.renderRasterizedTask)(pScene, task, fov, m_AspectRatio, cameraToWorld, camera.origin);
+			task.measuredCost = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+			return;
+		}
+
+		// Pixels are gathered in visiting order, a packet is the next PrimitiveBlockWidth pixels along the curve.
+		// Only aligned Morton runs make 2x4 blocks, Hilbert runs are 8 connected cells of any shape and Scanline runs 8x1 rows
+		const uint32_t batchSize{ m_WavefrontEnabled ? WavefrontPixelCount : (m_PacketTracingEnabled ? PrimitiveBlockWidth : 1) };
+		uint32_t batchPixels[WavefrontPixelCount];
+		uint32_t batchCount{ 0 };
+
+		// Objects outside the task's frustum can't be hit by its primary rays
+		const VisibleObjects* pVisibleObjects{ nullptr };
+		if (m_FrustumCullingEnabled)
+		{
+			static thread_local VisibleObjects visibleObjects{};
+			pScene->CullObjects(CalculateTaskFrustum(task, fov, m_AspectRatio, cameraToWorld, camera.origin), visibleObjects);
+			if (visibleObjects.GetObjectCount() <= MaxVisibleObjects)
+				pVisibleObjects = &visibleObjects;
+		}
+
+		const auto renderPixel = [&](uint32_t pixelIndex)
+		{
+			batchPixels[batchCount++] = pixelIndex;
+			if (batchCount == batchSize)
+			{
+				(this->*kernels.renderPixels)(pScene, batchPixels, batchCount, fov, m_AspectRatio, cameraToWorld, camera.origin, pVisibleObjects);
+				batchCount = 0;
+			}
+		};
+
+		if (m_PixelOrder == PixelOrder::Scanline)
+		{
+			for (uint32_t py{ task.y }; py < task.y + task.height; ++py)
+			{
+				for (uint32_t px{ task.x }; px < task.x + task.width; ++px)
+					renderPixel(px + py * width);
+			}
+		}
+		else
+		{
+			WalkCurve(m_PixelOrder == PixelOrder::Hilbert, task.width, task.height, [&](uint32_t x, uint32_t y)
+			{
+				renderPixel(task.x + x + (task.y + y) * width);
+			});
+		}
+
+		if (batchCount > 0)
+			(this->*kernels.renderPixels)(pScene, batchPixels, batchCount, fov, m_AspectRatio, cameraToWorld, camera.origin, pVisibleObjects);
+
+		task.measuredCost = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	const PerformanceCounters::Values countersStart{ m_PerformanceCounters.Read() };
+
+	switch (m_ExecutionBackend)
+	{
+	case ExecutionBackend::StdParallel:
+		std::for_each(std::execution::par, renderTasks.begin(), renderTasks.end(), renderTask);
+		break;
+	case ExecutionBackend::ThreadPool:
+		// The tasks are sorted by cost, dealing them out round robin lets every worker start on an expensive one
+		m_pThreadPool->ParallelFor(static_cast<uint32_t>(renderTasks.size()), [&](uint32_t taskIndex)
+		{
+			renderTask(renderTasks[taskIndex]);
+		}, TaskDistribution::Interleaved);
+		break;
+#if defined(_OPENMP)
+	case ExecutionBackend::OpenMP:
 	{
-		RenderPixel(pScene, pixelIndex, fov, aspectRatio, cameraToWorld, camera.origin);
+		const int taskCount{ static_cast<int>(renderTasks.size()) };
+		// Dynamic scheduling hands out the cost sorted tasks one by one, the expensive ones go first
+#pragma omp parallel for schedule(dynamic, 1) num_threads(static_cast<int>(m_ThreadCount))
+		for (int taskIndex = 0; taskIndex < taskCount; ++taskIndex)
+			renderTask(renderTasks[taskIndex]);
+		break;
 	}
 #endif
+	default:
+		for (RenderTask& task : renderTasks)
+			renderTask(task);
+		break;
+	}
+
+	m_FrameCounters = m_PerformanceCounters.Read() - countersStart;
+
+	m_TaskScheduler.UpdateTileCosts();
 
 	//@END
 	//Update SDL Surface
@@ -69,111 +228,510 @@ void Renderer::Render(Scene* pScene) const
 }
 
 
-void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Matrix cameraToWorld, const Vector3 cameraOrigin) const
+Renderer::RenderKernels Renderer::SelectRenderKernels() const
 {
-	// Initialize local variables once each 
-	auto materials{pScene->GetMaterials()};
-	const auto& lights = pScene->GetLights();
-	const uint32_t px{ pixelIndex % m_Width }, py{ pixelIndex / m_Width };
-	ColorRGB finalColor{};
+	const auto withShadows = [this]<uint32_t SampleCount, LightingMode Mode>() -> RenderKernels
+	{
+		if (m_ShadowsEnabled)
+			return { &Renderer::RenderPixels<SampleCount, Mode, true>, &Renderer::RenderRasterizedTask<SampleCount, Mode, true> };
+		return { &Renderer::RenderPixels<SampleCount, Mode, false>, &Renderer::RenderRasterizedTask<SampleCount, Mode, false> };
+	};
 
-	for(const auto& s : m_SamplePositions)
+	const auto withLightingMode = [&]<uint32_t SampleCount>() -> RenderKernels
 	{
-		// Calculate ray start pos in screen space based on samples positions
-		// NOTE: The sample positions are grid based that is why only factor of 4 can be used
-		const float rx{px + s.x}, ry{ py + s.y };
+		switch (m_CurrentLightingMode)
+		{
+		case LightingMode::ObservedArea:
+			return withShadows.template operator()<SampleCount, LightingMode::ObservedArea>();
+		case LightingMode::Radiance:
+			return withShadows.template operator()<SampleCount, LightingMode::Radiance>();
+		case LightingMode::BRDF:
+			return withShadows.template operator()<SampleCount, LightingMode::BRDF>();
+		default:
+			return withShadows.template operator()<SampleCount, LightingMode::Combined>();
+		}
+	};
 
-		// Convert screen space coordinates to NDC
-		const float cx{ (2 * (rx / float(m_Width)) - 1) * aspectRatio * fov };
-		const float cy{ (1 - (2 * (ry / float(m_Height)))) * fov };
+	// IncreaseMSAA and DecreaseMSAA step through 1, 4 and 16 samples
+	assert(m_SampleAmount == m_SamplePositions.size() && "Sample positions out of date");
+	switch (m_SampleAmount)
+	{
+	case 1:
+		return withLightingMode.template operator()<1>();
+	case 4:
+		return withLightingMode.template operator()<4>();
+	default:
+		assert(m_SampleAmount == 16 && "No render kernels for this sample count");
+		return withLightingMode.template operator()<16>();
+	}
+}
 
-		Vector3 rayDirection{ cx, cy, 1 };
-		rayDirection = cameraToWorld.TransformVector(rayDirection);
-		rayDirection.Normalize();
+template<uint32_t SampleCount, Renderer::LightingMode Mode, bool ShadowsEnabled>
+void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Matrix cameraToWorld, const Vector3 cameraOrigin,
+	const VisibleObjects* pVisibleObjects) const
+{
+	constexpr float sampleColorStrength{ 1.f / SampleCount };
+	ColorRGB finalColor{};
 
-		Ray viewRay{ cameraOrigin, rayDirection };
+	for (uint32_t s{ 0 }; s < SampleCount; ++s)
+	{
+		const Ray viewRay{ GeneratePrimaryRay(pixelIndex, m_SamplePositions[s], fov, aspectRatio, cameraToWorld, cameraOrigin) };
 		HitRecord closestHit{};
 
-		pScene->GetClosestHit(viewRay, closestHit);
+		pScene->GetClosestHit(viewRay, closestHit, pVisibleObjects);
 
-		ColorRGB currentSampleColor{};
 		if (closestHit.didHit)
+			finalColor += ShadeSample<Mode, ShadowsEnabled>(pScene, closestHit, viewRay.direction) * sampleColorStrength;
+	}
+
+	WritePixel(pixelIndex, finalColor);
+}
+
+template<uint32_t SampleCount, Renderer::LightingMode Mode, bool ShadowsEnabled>
+void Renderer::RenderPixels(Scene* pScene, const uint32_t* pixelIndices, uint32_t pixelCount, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin,
+	const VisibleObjects* pVisibleObjects) const
+{
+	if (m_WavefrontEnabled)
+	{
+		RenderWavefront<SampleCount, Mode, ShadowsEnabled>(pScene, pixelIndices, pixelCount, fov, aspectRatio, cameraToWorld, cameraOrigin, pVisibleObjects);
+		return;
+	}
+
+	if (!m_PacketTracingEnabled)
+	{
+		for (uint32_t i{ 0 }; i < pixelCount; ++i)
+			RenderPixel<SampleCount, Mode, ShadowsEnabled>(pScene, pixelIndices[i], fov, aspectRatio, cameraToWorld, cameraOrigin, pVisibleObjects);
+		return;
+	}
+
+	for (uint32_t first{ 0 }; first < pixelCount; first += PrimitiveBlockWidth)
+		RenderPixelPacket<SampleCount, Mode, ShadowsEnabled>(pScene, pixelIndices + first, std::min(pixelCount - first, PrimitiveBlockWidth), fov, aspectRatio, cameraToWorld, cameraOrigin,
+			pVisibleObjects);
+}
+
+template<uint32_t SampleCount, Renderer::LightingMode Mode, bool ShadowsEnabled>
+void Renderer::RenderWavefront(Scene* pScene, const uint32_t* pixelIndices, uint32_t pixelCount, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin,
+	const VisibleObjects* pVisibleObjects) const
+{
+	static thread_local WavefrontStreams streams{};
+	const uint32_t lightCount{ m_LightTable.GetLightCount() };
+
+	// Primary pass, only the hits go into the stream
+	streams.primaryHits.clear();
+	for (uint32_t first{ 0 }; first < pixelCount; first += PrimitiveBlockWidth)
+	{
+		const uint32_t count{ std::min(pixelCount - first, PrimitiveBlockWidth) };
+		for (uint32_t sampleIndex{ 0 }; sampleIndex < SampleCount; ++sampleIndex)
 		{
-			for (const Light& light : lights)
+			const Vector2& s = m_SamplePositions[sampleIndex];
+			if (m_PacketTracingEnabled)
 			{
-				ColorRGB currentLightColor{};
+				RayPacket packet{};
+				GeneratePrimaryRays(pixelIndices + first, count, s, fov, aspectRatio, cameraToWorld, cameraOrigin, packet);
 
-				// Add 0.0001 distance to prevents the model to cast shadows on itself
-				const Vector3 lightRayOrigin{ closestHit.origin + closestHit.normal * 0.0001f };   
-				const Vector3 lightRayDirection{ LightUtils::GetDirectionToLight(light, lightRayOrigin) };
-				const Vector3 lightDirNormalized{ lightRayDirection.Normalized() };
+				HitRecord closestHits[PrimitiveBlockWidth]{};
+				pScene->GetClosestHits(packet, (1u << count) - 1, closestHits, pVisibleObjects);
 
-				const Ray lightRay
+				for (uint32_t lane{ 0 }; lane < count; ++lane)
 				{
-					lightRayOrigin,
-					lightDirNormalized,
-					0.0001f,
-					light.type == LightType::Directional ? FLT_MAX : lightRayDirection.Magnitude()
-				};
+					if (closestHits[lane].didHit)
+						streams.primaryHits.push_back({ closestHits[lane], packet.rays[lane].direction, first + lane });
+				}
+				continue;
+			}
 
-				// Check if shadow needs to be cast on current sample
-				const bool shadowOnSample{ pScene->DoesHit(lightRay) && m_ShadowsEnabled };
+			for (uint32_t lane{ 0 }; lane < count; ++lane)
+			{
+				const Ray viewRay{ GeneratePrimaryRay(pixelIndices[first + lane], s, fov, aspectRatio, cameraToWorld, cameraOrigin) };
+				HitRecord closestHit{};
+				pScene->GetClosestHit(viewRay, closestHit, pVisibleObjects);
 
-				// Lambert cosine law
-				const float ObservedArea{ Vector3::Dot(closestHit.normal, lightDirNormalized) };  
+				if (closestHit.didHit)
+					streams.primaryHits.push_back({ closestHit, viewRay.direction, first + lane });
+			}
+		}
+	}
 
-				// Different Render settings based on each mode
-				switch (m_CurrentLightingMode)
-				{
-				case LightingMode::Combined:
-					if (ObservedArea > 0)
-					{
-						const ColorRGB BRDF{
-							materials[closestHit.materialIndex]->Shade(
-								closestHit, 
-								lightDirNormalized, 
-								-rayDirection.Normalized()
-							)
-						};
-
-						currentLightColor += LightUtils::GetRadiance(light, closestHit.origin) * BRDF * ObservedArea;
-					}
-					break;
-				case LightingMode::ObservedArea:
-
-					if (ObservedArea > 0)
-						currentLightColor += ColorRGB(1, 1, 1) * ObservedArea;
-
-					break;
-				case LightingMode::Radiance:
-					currentLightColor += LightUtils::GetRadiance(light, closestHit.origin);
-					break;
-				case LightingMode::BRDF:
-					const ColorRGB BRDF{
-						materials[closestHit.materialIndex]->Shade(
-							closestHit, 
-							lightDirNormalized, 
-							-rayDirection.Normalized()
-						)
-					};
-
-					currentLightColor += BRDF;
-					break;
-				}
+	// Shadow rays in bulk, grouped by light and direction octant (counting sort, stable so each group stays in pixel order).
+	// The lights get culled and shaded first, the rays that can't change their hit never get sorted nor traced
+	const size_t shadowRayCount{ streams.primaryHits.size() * lightCount };
+	streams.shadowRays.resize(shadowRayCount);
+	streams.lightColors.assign(shadowRayCount, ColorRGB{});
+	streams.shadowRayKeys.assign(shadowRayCount, NoShadowRay);
+	streams.keyOffsets.assign(lightCount * 8 + 1, 0);
+	for (size_t hitIndex{ 0 }; hitIndex < streams.primaryHits.size(); ++hitIndex)
+	{
+		const WavefrontStreams::PrimaryHit& primaryHit = streams.primaryHits[hitIndex];
+		for (uint32_t lightIndex{ 0 }; lightIndex < lightCount; ++lightIndex)
+		{
+			const size_t rayIndex{ hitIndex * lightCount + lightIndex };
+			ColorRGB& lightColor = streams.lightColors[rayIndex];
+			Ray& shadowRay = streams.shadowRays[rayIndex];
+			if (!ShadeLight<Mode>(pScene, primaryHit.hit, primaryHit.rayDirection, lightIndex, lightColor, shadowRay))
+				continue;
+
+			if (!ShadowsEnabled || !NeedsShadowRay(primaryHit.hit, lightColor))
+				continue;
+
+			const uint32_t octant{ (shadowRay.direction.x < 0.f ? 1u : 0u) | (shadowRay.direction.y < 0.f ? 2u : 0u) | (shadowRay.direction.z < 0.f ? 4u : 0u) };
+			streams.shadowRayKeys[rayIndex] = lightIndex * 8 + octant;
+			++streams.keyOffsets[streams.shadowRayKeys[rayIndex] + 1];
+		}
+	}
+
+	streams.isOccluded.assign(shadowRayCount, 0);
+	if constexpr (ShadowsEnabled)
+	{
+		for (size_t key{ 1 }; key < streams.keyOffsets.size(); ++key)
+			streams.keyOffsets[key] += streams.keyOffsets[key - 1];
+
+		streams.sortedShadowRays.resize(streams.keyOffsets.back());
+		for (uint32_t rayIndex{ 0 }; rayIndex < shadowRayCount; ++rayIndex)
+		{
+			if (streams.shadowRayKeys[rayIndex] != NoShadowRay)
+				streams.sortedShadowRays[streams.keyOffsets[streams.shadowRayKeys[rayIndex]]++] = rayIndex;
+		}
+
+		// The sorted rays of a light run one after the other, so its cached occluder stays warm
+		std::vector<PrimitiveHit>& lastOccluders = GetLastOccluders(lightCount);
+		for (const uint32_t rayIndex : streams.sortedShadowRays)
+		{
+			PrimitiveHit& lastOccluder = lastOccluders[streams.shadowRayKeys[rayIndex] / 8];
+			streams.isOccluded[rayIndex] = pScene->IsOccluded(streams.shadowRays[rayIndex], lastOccluder) ? 1 : 0;
+		}
+	}
+
+	// Shading pass, samples get added in the same order as RenderPixel does
+	constexpr float sampleColorStrength{ 1.f / SampleCount };
+	streams.pixelColors.assign(pixelCount, ColorRGB{});
+	for (size_t hitIndex{ 0 }; hitIndex < streams.primaryHits.size(); ++hitIndex)
+	{
+		const WavefrontStreams::PrimaryHit& primaryHit = streams.primaryHits[hitIndex];
+
+		ColorRGB sampleColor{};
+		for (uint32_t lightIndex{ 0 }; lightIndex < lightCount; ++lightIndex)
+		{
+			const size_t rayIndex{ hitIndex * lightCount + lightIndex };
+			ColorRGB lightColor{ streams.lightColors[rayIndex] };
+			if (streams.isOccluded[rayIndex] != 0)
+				lightColor *= m_ShadowStrength;
+
+			sampleColor += lightColor;
+		}
+
+		streams.pixelColors[primaryHit.pixelSlot] += sampleColor * sampleColorStrength;
+	}
+
+	for (uint32_t i{ 0 }; i < pixelCount; ++i)
+		WritePixel(pixelIndices[i], streams.pixelColors[i]);
+}
+
+Ray Renderer::GeneratePrimaryRay(uint32_t pixelIndex, const Vector2& samplePosition, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin) const
+{
+	const uint32_t px{ pixelIndex % m_Width }, py{ pixelIndex / m_Width };
+
+	// Calculate ray start pos in screen space based on samples positions
+	// NOTE: The sample positions are grid based that is why only factor of 4 can be used
+	const float rx{ px + samplePosition.x }, ry{ py + samplePosition.y };
+
+	// Convert screen space coordinates to NDC
+	const float cx{ (2 * (rx / float(m_Width)) - 1) * aspectRatio * fov };
+	const float cy{ (1 - (2 * (ry / float(m_Height)))) * fov };
+
+	Vector3 rayDirection{ cx, cy, 1 };
+	rayDirection = cameraToWorld.TransformVector(rayDirection);
+	rayDirection.Normalize();
+
+	return Ray{ cameraOrigin, rayDirection };
+}
+
+template<uint32_t SampleCount, Renderer::LightingMode Mode, bool ShadowsEnabled>
+void Renderer::RenderPixelPacket(Scene* pScene, const uint32_t* pixelIndices, uint32_t pixelCount, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin,
+	const VisibleObjects* pVisibleObjects) const
+{
+	constexpr float sampleColorStrength{ 1.f / SampleCount };
+	const uint32_t laneMask{ (1u << pixelCount) - 1 };
+	ColorRGB finalColors[PrimitiveBlockWidth]{};
+
+	for (uint32_t s{ 0 }; s < SampleCount; ++s)
+	{
+		RayPacket packet{};
+		GeneratePrimaryRays(pixelIndices, pixelCount, m_SamplePositions[s], fov, aspectRatio, cameraToWorld, cameraOrigin, packet);
+
+		HitRecord closestHits[PrimitiveBlockWidth]{};
+		pScene->GetClosestHits(packet, laneMask, closestHits, pVisibleObjects);
+
+		for (uint32_t lane{ 0 }; lane < pixelCount; ++lane)
+		{
+			if (closestHits[lane].didHit)
+				finalColors[lane] += ShadeSample<Mode, ShadowsEnabled>(pScene, closestHits[lane], packet.rays[lane].direction) * sampleColorStrength;
+		}
+	}
+
+	for (uint32_t lane{ 0 }; lane < pixelCount; ++lane)
+		WritePixel(pixelIndices[lane], finalColors[lane]);
+}
+
+void Renderer::GeneratePrimaryRays(const uint32_t* pixelIndices, uint32_t pixelCount, const Vector2& samplePosition,
+	float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin, RayPacket& packet) const
+{
+	// Unused lanes repeat the last pixel so every lane stays finite
+	alignas(32) float rx[PrimitiveBlockWidth], ry[PrimitiveBlockWidth];
+	for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
+	{
+		const uint32_t pixelIndex{ pixelIndices[std::min(lane, pixelCount - 1)] };
+		rx[lane] = pixelIndex % m_Width + samplePosition.x;
+		ry[lane] = pixelIndex / m_Width + samplePosition.y;
+	}
+
+	const Vector3 axisX{ cameraToWorld.GetAxisX() }, axisY{ cameraToWorld.GetAxisY() }, axisZ{ cameraToWorld.GetAxisZ() };
+	alignas(32) float directionX[PrimitiveBlockWidth], directionY[PrimitiveBlockWidth], directionZ[PrimitiveBlockWidth];
+
+#if defined(__AVX__)
+	// Same math as RenderPixel but not bit identical: with FMA enabled the compiler contracts the scalar
+	// TransformVector and Normalized into fused multiply-adds, these separate multiplies and adds round once more.
+	// The directions differ by at most a few ulps, nothing compares packet rays against single rays exactly
+	const __m256 one = _mm256_set1_ps(1.f), two = _mm256_set1_ps(2.f);
+	const __m256 cx = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(two, _mm256_div_ps(_mm256_load_ps(rx), _mm256_set1_ps(float(m_Width)))), one),
+		_mm256_set1_ps(aspectRatio)), _mm256_set1_ps(fov));
+	const __m256 cy = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_div_ps(_mm256_load_ps(ry), _mm256_set1_ps(float(m_Height))))),
+		_mm256_set1_ps(fov));
+
+	const auto transform = [&](float x, float y, float z)
+	{
+		return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(x), cx), _mm256_mul_ps(_mm256_set1_ps(y), cy)), _mm256_set1_ps(z));
+	};
+
+	const __m256 x = transform(axisX.x, axisY.x, axisZ.x);
+	const __m256 y = transform(axisX.y, axisY.y, axisZ.y);
+	const __m256 z = transform(axisX.z, axisY.z, axisZ.z);
+	const __m256 magnitude = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+
+	_mm256_store_ps(directionX, _mm256_div_ps(x, magnitude));
+	_mm256_store_ps(directionY, _mm256_div_ps(y, magnitude));
+	_mm256_store_ps(directionZ, _mm256_div_ps(z, magnitude));
+#else
+	for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
+	{
+		const float cx{ (2 * (rx[lane] / float(m_Width)) - 1) * aspectRatio * fov };
+		const float cy{ (1 - (2 * (ry[lane] / float(m_Height)))) * fov };
+		const Vector3 direction{ cameraToWorld.TransformVector(cx, cy, 1).Normalized() };
+
+		directionX[lane] = direction.x;
+		directionY[lane] = direction.y;
+		directionZ[lane] = direction.z;
+	}
+#endif
+
+	for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
+		packet.rays[lane] = { cameraOrigin, { directionX[lane], directionY[lane], directionZ[lane] } };
+}
+
+template<uint32_t SampleCount, Renderer::LightingMode Mode, bool ShadowsEnabled>
+void Renderer::RenderRasterizedTask(Scene* pScene, const RenderTask& task, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin) const
+{
+	static thread_local VisibilityBuffer visibilityBuffer{};
+	static thread_local std::vector<Vector3> rayDirections{};
+
+	// The rasterizer tests against the very rays the tracer would shoot, so both agree on every edge
+	constexpr float sampleColorStrength{ 1.f / SampleCount };
+	rayDirections.resize(static_cast<size_t>(task.width) * task.height * SampleCount);
+	size_t sampleIndex{ 0 };
+	for (uint32_t py{ task.y }; py < task.y + task.height; ++py)
+	{
+		for (uint32_t px{ task.x }; px < task.x + task.width; ++px)
+		{
+			for (uint32_t s{ 0 }; s < SampleCount; ++s)
+				rayDirections[sampleIndex++] = GeneratePrimaryRay(px + py * m_Width, m_SamplePositions[s], fov, aspectRatio, cameraToWorld, cameraOrigin).direction;
+		}
+	}
 
-				if(shadowOnSample)
-					currentLightColor *= m_ShadowStrength;
+	const VisibilityBuffer::View view{ cameraToWorld, cameraOrigin, fov, aspectRatio, static_cast<uint32_t>(m_Width), static_cast<uint32_t>(m_Height) };
+	visibilityBuffer.Rasterize(*pScene, view, task.x, task.y, task.width, task.height, SampleCount, rayDirections.data());
 
-				currentSampleColor += currentLightColor;
+	sampleIndex = 0;
+	for (uint32_t py{ task.y }; py < task.y + task.height; ++py)
+	{
+		for (uint32_t px{ task.x }; px < task.x + task.width; ++px)
+		{
+			ColorRGB finalColor{};
+			for (uint32_t s{ 0 }; s < SampleCount; ++s, ++sampleIndex)
+			{
+				const Ray viewRay{ cameraOrigin, rayDirections[sampleIndex] };
+				HitRecord closestHit{};
+				if (visibilityBuffer.Resolve(*pScene, sampleIndex, viewRay, closestHit))
+					finalColor += ShadeSample<Mode, ShadowsEnabled>(pScene, closestHit, viewRay.direction) * sampleColorStrength;
 			}
+
+			WritePixel(px + py * m_Width, finalColor);
 		}
+	}
+}
+
+Frustum Renderer::CalculateTaskFrustum(const RenderTask& task, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin) const
+{
+	// The margin covers every sample position inside the border pixels and the rounding of the ray generation
+	const float left{ static_cast<float>(task.x) - 1.f }, right{ static_cast<float>(task.x + task.width) + 1.f };
+	const float top{ static_cast<float>(task.y) - 1.f }, bottom{ static_cast<float>(task.y + task.height) + 1.f };
+
+	// Same mapping as GeneratePrimaryRay, the directions don't need normalizing
+	const auto cornerDirection = [&](float rx, float ry)
+	{
+		const float cx{ (2 * (rx / float(m_Width)) - 1) * aspectRatio * fov };
+		const float cy{ (1 - (2 * (ry / float(m_Height)))) * fov };
+		return cameraToWorld.TransformVector(cx, cy, 1);
+	};
+
+	const Vector3 corners[4]{ cornerDirection(left, top), cornerDirection(right, top), cornerDirection(right, bottom), cornerDirection(left, bottom) };
+	return Frustum::FromCorners(cameraOrigin, corners);
+}
 
-		finalColor += currentSampleColor * m_SampleColorStrength;
+template<Renderer::LightingMode Mode, bool ShadowsEnabled>
+ColorRGB Renderer::ShadeSample(const Scene* pScene, const HitRecord& closestHit, const Vector3& rayDirection) const
+{
+	const uint32_t lightCount{ m_LightTable.GetLightCount() };
+	std::vector<PrimitiveHit>& lastOccluders = GetLastOccluders(lightCount);
+
+	ColorRGB currentSampleColor{};
+	for (uint32_t lightIndex{ 0 }; lightIndex < lightCount; ++lightIndex)
+	{
+		// Culled lights are rejected before their shadow ray gets traced
+		ColorRGB lightColor{};
+		Ray lightRay{};
+		if (!ShadeLight<Mode>(pScene, closestHit, rayDirection, lightIndex, lightColor, lightRay))
+			continue;
+
+		// Check if shadow needs to be cast on current sample
+		if constexpr (ShadowsEnabled)
+		{
+			if (NeedsShadowRay(closestHit, lightColor) && pScene->IsOccluded(lightRay, lastOccluders[lightIndex]))
+				lightColor *= m_ShadowStrength;
+		}
+
+		currentSampleColor += lightColor;
 	}
 
+	return currentSampleColor;
+}
+
+template<Renderer::LightingMode Mode>
+bool Renderer::ShadeLight(const Scene* pScene, const HitRecord& closestHit, const Vector3& rayDirection, uint32_t lightIndex,
+	ColorRGB& lightColor, Ray& lightRay) const
+{
+	const LightTable& lights = m_LightTable;
+
+	// Radiance falls off with the squared distance, out of the light's influence radius it can't be seen anymore.
+	// Combined mode scales the radius by the material's BRDF bound, the cosine never adds to it.
+	// The modes leaving the radiance out light every hit no matter how far the light is
+	const Vector3 lightOrigin{ lights.originX[lightIndex], lights.originY[lightIndex], lights.originZ[lightIndex] };
+	const float distanceSquared{ (lightOrigin - closestHit.origin).SqrMagnitude() };
+	if constexpr (Mode == LightingMode::Radiance)
+	{
+		if (distanceSquared > lights.influenceRadiusSquared[lightIndex])
+			return false;
+	}
+	else if constexpr (Mode == LightingMode::Combined)
+	{
+		if (distanceSquared > lights.influenceRadiusSquared[lightIndex] * pScene->GetMaterials()[closestHit.materialIndex]->GetMaxBRDF())
+			return false;
+	}
+
+	// Add 0.0001 distance to prevents the model to cast shadows on itself
+	const Vector3 lightRayOrigin{ closestHit.origin + closestHit.normal * 0.0001f };
+	const bool isDirectional{ lights.isDirectional[lightIndex] != 0 };
+	const Vector3 toLight{ isDirectional
+		? Vector3{ lights.directionX[lightIndex], lights.directionY[lightIndex], lights.directionZ[lightIndex] }
+		: lightOrigin - lightRayOrigin };
+	lightRay = Ray{ lightRayOrigin, toLight.Normalized(), 0.0001f, isDirectional ? FLT_MAX : toLight.Magnitude() };
+
+	// Lambert cosine law
+	const float ObservedArea{ Vector3::Dot(closestHit.normal, lightRay.direction) };
+
+	// Different Render settings based on each mode, the ones weighing by the cosine skip the lights behind the surface
+	const ColorRGB radiance{ ColorRGB{ lights.radianceR[lightIndex], lights.radianceG[lightIndex], lights.radianceB[lightIndex] } * (1.f / distanceSquared) };
+	if constexpr (Mode == LightingMode::Combined)
+	{
+		if (ObservedArea <= 0)
+			return false;
+
+		const ColorRGB BRDF{
+			pScene->GetMaterials()[closestHit.materialIndex]->Shade(
+				closestHit, 
+				lightRay.direction, 
+				-rayDirection.Normalized()
+			)
+		};
+
+		lightColor = radiance * BRDF * ObservedArea;
+	}
+	else if constexpr (Mode == LightingMode::ObservedArea)
+	{
+		if (ObservedArea <= 0)
+			return false;
+
+		lightColor = ColorRGB(1, 1, 1) * ObservedArea;
+	}
+	else if constexpr (Mode == LightingMode::Radiance)
+	{
+		lightColor = radiance;
+	}
+	else if constexpr (Mode == LightingMode::BRDF)
+	{
+		lightColor = pScene->GetMaterials()[closestHit.materialIndex]->Shade(
+			closestHit, 
+			lightRay.direction, 
+			-rayDirection.Normalized()
+		);
+	}
+
+	return true;
+}
+
+bool Renderer::NeedsShadowRay(const HitRecord& closestHit, const ColorRGB& lightColor) const
+{
+	// Halving light under the threshold changes the hit by less than the threshold
+	return closestHit.receivesShadow && std::max({ lightColor.r, lightColor.g, lightColor.b }) >= m_LightThreshold;
+}
+
+void Renderer::BuildLightTable(const Scene* pScene)
+{
+	const std::vector<Light>& lights = pScene->GetLights();
+	LightTable& table = m_LightTable;
+	for (std::vector<float>* pColumn : { &table.originX, &table.originY, &table.originZ, &table.directionX, &table.directionY, &table.directionZ,
+		&table.radianceR, &table.radianceG, &table.radianceB, &table.influenceRadiusSquared })
+	{
+		pColumn->resize(lights.size());
+	}
+	table.isDirectional.resize(lights.size());
+
+	for (size_t i{ 0 }; i < lights.size(); ++i)
+	{
+		const Light& light = lights[i];
+		const ColorRGB radiance{ light.color * light.intensity };
+
+		table.originX[i] = light.origin.x;
+		table.originY[i] = light.origin.y;
+		table.originZ[i] = light.origin.z;
+		table.directionX[i] = light.direction.x;
+		table.directionY[i] = light.direction.y;
+		table.directionZ[i] = light.direction.z;
+		table.radianceR[i] = radiance.r;
+		table.radianceG[i] = radiance.g;
+		table.radianceB[i] = radiance.b;
+		table.isDirectional[i] = light.type == LightType::Directional ? 1 : 0;
+
+		// Brightest channel / distance^2 < threshold, ShadeLight widens it by the hit material's Material::GetMaxBRDF() in Combined mode
+		table.influenceRadiusSquared[i] = light.type == LightType::Directional
+			? FLT_MAX
+			: std::max({ radiance.r, radiance.g, radiance.b }) / m_LightThreshold;
+	}
+}
+
+void Renderer::WritePixel(uint32_t pixelIndex, ColorRGB finalColor) const
+{
 	finalColor.MaxToOne();
 
-	m_pBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBuffer->format,
+	m_pBufferPixels[pixelIndex] = SDL_MapRGB(m_pBuffer->format,
 		static_cast<uint8_t>(finalColor.r * 255),
 		static_cast<uint8_t>(finalColor.g * 255),
 		static_cast<uint8_t>(finalColor.b * 255));
@@ -190,6 +748,140 @@ void Renderer::CycleLightingMode()
 	m_CurrentLightingMode = static_cast<LightingMode>((static_cast<int>(m_CurrentLightingMode) + 1) % static_cast<int>(LightingMode::TOTAL_MODES));
 }
 
+void Renderer::SetExecutionBackend(ExecutionBackend backend)
+{
+	if (IsExecutionBackendAvailable(backend))
+		m_ExecutionBackend = backend;
+}
+
+void Renderer::CycleExecutionBackend()
+{
+	// Skips the backends this build doesn't support
+	int backend{ static_cast<int>(m_ExecutionBackend) };
+	do
+	{
+		backend = (backend + 1) % static_cast<int>(ExecutionBackend::TOTAL_BACKENDS);
+	} while (!IsExecutionBackendAvailable(static_cast<ExecutionBackend>(backend)));
+
+	m_ExecutionBackend = static_cast<ExecutionBackend>(backend);
+	std::cout << "Current execution backend: " << GetExecutionDescription() << std::endl;
+}
+
+bool Renderer::IsExecutionBackendAvailable(ExecutionBackend backend)
+{
+	switch (backend)
+	{
+	case ExecutionBackend::Serial:
+	case ExecutionBackend::StdParallel:
+	case ExecutionBackend::ThreadPool:
+		return true;
+	case ExecutionBackend::OpenMP:
+#if defined(_OPENMP)
+		return true;
+#else
+		return false;
+#endif
+	default:
+		return false;
+	}
+}
+
+const char* Renderer::GetExecutionBackendName(ExecutionBackend backend)
+{
+	switch (backend)
+	{
+	case ExecutionBackend::Serial:
+		return "Serial";
+	case ExecutionBackend::StdParallel:
+		return "std::execution::par";
+	case ExecutionBackend::ThreadPool:
+		return "ThreadPool";
+	case ExecutionBackend::OpenMP:
+		return "OpenMP";
+	default:
+		return "Unknown";
+	}
+}
+
+void Renderer::CyclePixelOrder()
+{
+	m_PixelOrder = static_cast<PixelOrder>((static_cast<int>(m_PixelOrder) + 1) % static_cast<int>(PixelOrder::TOTAL_ORDERS));
+	std::cout << "Current pixel order: " << GetPixelOrderName(m_PixelOrder) << std::endl;
+}
+
+const char* Renderer::GetPixelOrderName(PixelOrder order)
+{
+	switch (order)
+	{
+	case PixelOrder::Scanline:
+		return "Scanline";
+	case PixelOrder::Morton:
+		return "Morton";
+	case PixelOrder::Hilbert:
+		return "Hilbert";
+	default:
+		return "Unknown";
+	}
+}
+
+void Renderer::SetThreadCount(uint32_t threadCount)
+{
+	threadCount = std::clamp(threadCount, 1u, MaxThreadCount);
+	if (threadCount == m_ThreadCount)
+		return;
+
+	m_ThreadCount = threadCount;
+	m_pThreadPool = std::make_unique<ThreadPool>(m_ThreadCount);
+}
+
+std::string Renderer::GetExecutionDescription() const
+{
+	std::string description{ GetExecutionBackendName(m_ExecutionBackend) };
+	if (m_ExecutionBackend == ExecutionBackend::StdParallel)
+		return description + " (implementation defined threads)";
+
+	const uint32_t threadCount{ GetActiveThreadCount() };
+	return description + " (" + std::to_string(threadCount) + (threadCount == 1 ? " thread)" : " threads)");
+}
+
+uint32_t Renderer::GetActiveThreadCount() const
+{
+	switch (m_ExecutionBackend)
+	{
+	case ExecutionBackend::Serial:
+		return 1;
+	case ExecutionBackend::StdParallel:
+		// Only a guess for the task granularity, the standard library doesn't say how many threads it uses
+		return std::max(std::thread::hardware_concurrency(), 1u);
+	default:
+		return m_ThreadCount;
+	}
+}
+
+void Renderer::TogglePacketTracing()
+{
+	m_PacketTracingEnabled = !m_PacketTracingEnabled;
+	std::cout << "Packet tracing of primary rays: " << (m_PacketTracingEnabled ? "ON" : "OFF") << std::endl;
+}
+
+void Renderer::ToggleWavefront()
+{
+	m_WavefrontEnabled = !m_WavefrontEnabled;
+	std::cout << "Wavefront shadow rays: " << (m_WavefrontEnabled ? "ON" : "OFF") << std::endl;
+}
+
+void Renderer::ToggleFrustumCulling()
+{
+	m_FrustumCullingEnabled = !m_FrustumCullingEnabled;
+	std::cout << "Frustum culling per render task: " << (m_FrustumCullingEnabled ? "ON" : "OFF") << std::endl;
+}
+
+void Renderer::ToggleVisibilityPrepass()
+{
+	m_VisibilityPrepassEnabled = !m_VisibilityPrepassEnabled;
+	std::cout << "Rasterized visibility prepass: " << (m_VisibilityPrepassEnabled ? "ON" : "OFF") << std::endl;
+}
+
 void Renderer::IncreaseMSAA()
 {
 	if(m_SampleAmount * 4 > m_MaxSampleAmount)
@@ -197,8 +889,6 @@ void Renderer::IncreaseMSAA()
 
 	m_SampleAmount *= 4;
 	CalculateSamplePositions();
-
-	CalculateSampleColorStrength();
 }
 
 void Renderer::DecreaseMSAA()
@@ -208,13 +898,6 @@ void Renderer::DecreaseMSAA()
 
 	m_SampleAmount /= 4;
 	CalculateSamplePositions();
-
-	CalculateSampleColorStrength();
-}
-
-void Renderer::CalculateSampleColorStrength()
-{
-	m_SampleColorStrength = 1.f / static_cast<float>(m_SampleAmount);
 }
 
 void Renderer::CalculateSamplePositions()
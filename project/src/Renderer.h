@@ -1,6 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "PerformanceCounters.h"
+#include "TaskScheduler.h"
+#include "ThreadPool.h"
 
 // Forwarding structs
 struct SDL_Window;
@@ -18,10 +26,35 @@ namespace dae
 	struct Matrix;
 	class Vector3;
 	class Scene;
+	struct ColorRGB;
+	struct HitRecord;
+	struct Ray;
+	struct RayPacket;
+	struct Frustum;
+	struct VisibleObjects;
 
 	class Renderer final
 	{
 	public:
+		// How Render spreads the render tasks over threads
+		enum class ExecutionBackend
+		{
+			Serial,  // Everything on the calling thread
+			StdParallel,  // std::for_each(std::execution::par), the standard library picks the thread count
+			ThreadPool,  // The renderer's own work-stealing pool
+			OpenMP,  // omp parallel for with dynamic scheduling, only available when compiled with OpenMP
+			TOTAL_BACKENDS  // Used for cycling between different backends
+		};
+
+		// Order in which a render task walks its pixels, consecutive rays on a thread share more BVH nodes along a curve
+		enum class PixelOrder
+		{
+			Scanline,  // Row by row
+			Morton,  // Z-order curve
+			Hilbert,  // Hilbert curve, consecutive pixels are always neighbours
+			TOTAL_ORDERS  // Used for cycling between different orders
+		};
+
 		Renderer(SDL_Window* pWindow);
 		~Renderer() = default;
 
@@ -30,24 +63,54 @@ namespace dae
 		Renderer& operator=(const Renderer&) = delete;
 		Renderer& operator=(Renderer&&) noexcept = delete;
 
-		void Render(Scene* pScene) const;
-		void RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Matrix cameraToWorld, const Vector3 cameraOrigin) const;
+		void Render(Scene* pScene);
 		bool SaveBufferToImage() const;
 
 		void CycleLightingMode();
 		void ToggleShadows() { m_ShadowsEnabled = !m_ShadowsEnabled; }
+		void TogglePacketTracing();
+		bool IsPacketTracingEnabled() const { return m_PacketTracingEnabled; }
+		void ToggleWavefront();
+		bool IsWavefrontEnabled() const { return m_WavefrontEnabled; }
+		void ToggleFrustumCulling();
+		bool IsFrustumCullingEnabled() const { return m_FrustumCullingEnabled; }
+		void ToggleVisibilityPrepass();
+		bool IsVisibilityPrepassEnabled() const { return m_VisibilityPrepassEnabled; }
 
 		// Anti Aliassing
 		void IncreaseMSAA();
 		void DecreaseMSAA();
-		void CalculateSampleColorStrength();
 
 		uint32_t GetSampleAmount() const { return m_SampleAmount; }
 
+		// Width and height in pixels of the square tiles handed to the worker threads
+		void SetTileSize(uint32_t tileSize) { m_TaskScheduler.SetTileSize(tileSize); }
+		uint32_t GetTileSize() const { return m_TaskScheduler.GetTileSize(); }
 
-	private:
+		// Execution backends
+		void SetExecutionBackend(ExecutionBackend backend);
+		void CycleExecutionBackend();
+		ExecutionBackend GetExecutionBackend() const { return m_ExecutionBackend; }
+		static bool IsExecutionBackendAvailable(ExecutionBackend backend);
+		static const char* GetExecutionBackendName(ExecutionBackend backend);
+
+		// Threads used by the ThreadPool and OpenMP backends, including the calling thread
+		void SetThreadCount(uint32_t threadCount);
+		uint32_t GetThreadCount() const { return m_ThreadCount; }
+
+		// Backend and the number of threads it renders with, e.g. "ThreadPool (8 threads)"
+		std::string GetExecutionDescription() const;
+
+		void CyclePixelOrder();
+		PixelOrder GetPixelOrder() const { return m_PixelOrder; }
+		static const char* GetPixelOrderName(PixelOrder order);
+
+		// Hardware counters of the last Render call's tracing, all 0 if the platform doesn't expose them
+		bool ArePerformanceCountersAvailable() const { return m_PerformanceCounters.IsAvailable(); }
+		const PerformanceCounters::Values& GetFrameCounters() const { return m_FrameCounters; }
 
-		void CalculateSamplePositions();
+
+	private:
 
 		enum class LightingMode
 		{
@@ -58,8 +121,80 @@ namespace dae
 			TOTAL_MODES  // Used for cycling between different modes
 		};
 
+		void CalculateSamplePositions();
+
+		// The pixel loops below are templated on the frame's sample count, lighting mode and shadow setting,
+		// so the per sample and per light loops don't branch on them. SelectRenderKernels picks the instantiation
+
+		// Renders pixels in the given order with the enabled tracing mode, at most WavefrontPixelCount at once
+		template<uint32_t SampleCount, LightingMode Mode, bool ShadowsEnabled>
+		void RenderPixels(Scene* pScene, const uint32_t* pixelIndices, uint32_t pixelCount, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin,
+			const VisibleObjects* pVisibleObjects) const;
+		// pVisibleObjects, when given, is the culled object list the primary rays get tested against
+		template<uint32_t SampleCount, LightingMode Mode, bool ShadowsEnabled>
+		void RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Matrix cameraToWorld, const Vector3 cameraOrigin,
+			const VisibleObjects* pVisibleObjects) const;
+		// Renders up to PrimitiveBlockWidth pixels whose primary rays get traced together as packets, one packet per sample
+		template<uint32_t SampleCount, LightingMode Mode, bool ShadowsEnabled>
+		void RenderPixelPacket(Scene* pScene, const uint32_t* pixelIndices, uint32_t pixelCount, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin,
+			const VisibleObjects* pVisibleObjects) const;
+		// Wavefront mode: first the primary hits of every pixel, then all shadow rays sorted by light and direction octant, then shading
+		template<uint32_t SampleCount, LightingMode Mode, bool ShadowsEnabled>
+		void RenderWavefront(Scene* pScene, const uint32_t* pixelIndices, uint32_t pixelCount, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin,
+			const VisibleObjects* pVisibleObjects) const;
+
+		Ray GeneratePrimaryRay(uint32_t pixelIndex, const Vector2& samplePosition, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin) const;
+		// Camera rays through one sample position of up to PrimitiveBlockWidth pixels, computed 8 at a time with AVX
+		void GeneratePrimaryRays(const uint32_t* pixelIndices, uint32_t pixelCount, const Vector2& samplePosition,
+			float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin, RayPacket& packet) const;
+		// Light of every light source reflected towards the camera at a hit
+		template<LightingMode Mode, bool ShadowsEnabled>
+		ColorRGB ShadeSample(const Scene* pScene, const HitRecord& closestHit, const Vector3& rayDirection) const;
+		// Unshadowed light of m_LightTable's light lightIndex and the shadow ray towards it.
+		// False when the light is out of range or behind the surface, it adds nothing to the hit then
+		template<LightingMode Mode>
+		bool ShadeLight(const Scene* pScene, const HitRecord& closestHit, const Vector3& rayDirection, uint32_t lightIndex,
+			ColorRGB& lightColor, Ray& lightRay) const;
+		// Whether shadowing lightColor can visibly change the hit, fainter lights stay unshadowed without a shadow ray
+		bool NeedsShadowRay(const HitRecord& closestHit, const ColorRGB& lightColor) const;
+		void WritePixel(uint32_t pixelIndex, ColorRGB finalColor) const;
+
+		// Visibility prepass mode: the task's primary hits get rasterized into a visibility buffer, only the shadow rays are traced
+		template<uint32_t SampleCount, LightingMode Mode, bool ShadowsEnabled>
+		void RenderRasterizedTask(Scene* pScene, const RenderTask& task, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin) const;
+
+		// Instantiations of the pixel loops for one sample count, lighting mode and shadow setting
+		struct RenderKernels
+		{
+			void (Renderer::*renderPixels)(Scene*, const uint32_t*, uint32_t, float, float, const Matrix&, const Vector3&, const VisibleObjects*) const;
+			void (Renderer::*renderRasterizedTask)(Scene*, const RenderTask&, float, float, const Matrix&, const Vector3&) const;
+		};
+		// Picks the kernels matching the current settings, once per frame
+		RenderKernels SelectRenderKernels() const;
+		// View frustum of every primary ray a task shoots, with a pixel of margin on each side
+		Frustum CalculateTaskFrustum(const RenderTask& task, float fov, float aspectRatio, const Matrix& cameraToWorld, const Vector3& cameraOrigin) const;
+		// Threads the current backend actually renders with
+		uint32_t GetActiveThreadCount() const;
+
+		// The scene's lights in SoA layout with their per light constants, rebuilt every frame
+		struct LightTable
+		{
+			std::vector<float> originX, originY, originZ;
+			std::vector<float> directionX, directionY, directionZ;  // Directional lights only
+			std::vector<float> radianceR, radianceG, radianceB;  // Color times intensity
+			std::vector<float> influenceRadiusSquared;  // Past it the radiance stays under m_LightThreshold, FLT_MAX for directional lights
+			std::vector<uint8_t> isDirectional;
+
+			uint32_t GetLightCount() const { return static_cast<uint32_t>(isDirectional.size()); }
+		};
+		void BuildLightTable(const Scene* pScene);
+
 		LightingMode m_CurrentLightingMode{ LightingMode::Combined };
 		bool m_ShadowsEnabled{ true };
+		bool m_PacketTracingEnabled{ true };
+		bool m_WavefrontEnabled{ false };
+		bool m_FrustumCullingEnabled{ true };
+		bool m_VisibilityPrepassEnabled{ false };
 
 		SDL_Window* m_pWindow{};
 
@@ -71,16 +206,29 @@ namespace dae
 
 		float m_AspectRatio;
 		const float m_ShadowStrength = 0.5f;
+		// Light below half a step of the 8 bit output can't be seen, see LightTable and NeedsShadowRay
+		const float m_LightThreshold = 0.5f / 255.f;
+		LightTable m_LightTable{};
 
 
-		// Samples for anti-aliasing
+		// Samples for anti-aliasing, 1, 4 or 16 per pixel
 		uint32_t m_SampleAmount = 1;
 		std::vector<Vector2> m_SamplePositions;
-		float m_SampleColorStrength;
 		
 
 		const uint32_t m_MaxSampleAmount = 16; 
 		const uint32_t m_minSampleAmount = 1;
 
+		// Opened before the thread pool so its workers inherit the counters
+		PerformanceCounters m_PerformanceCounters{};
+		PerformanceCounters::Values m_FrameCounters{};
+
+		// Tiles are rendered in render tasks, the backend only decides which threads run them
+		ExecutionBackend m_ExecutionBackend{ ExecutionBackend::ThreadPool };
+		PixelOrder m_PixelOrder{ PixelOrder::Hilbert };
+		uint32_t m_ThreadCount;
+		std::unique_ptr<ThreadPool> m_pThreadPool;
+		TaskScheduler m_TaskScheduler{};
+
 	};
 }
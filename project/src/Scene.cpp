@@ -1,6 +1,9 @@
 #include "Scene.h"
 
 #include <filesystem>
+#include <iostream>
+#include <limits>
+#include <numeric>
 
 #include "Utils.h"
 #include "Material.h"
@@ -15,6 +18,7 @@ namespace dae {
 		m_SphereGeometries.reserve(32);
 		m_PlaneGeometries.reserve(32);
 		m_TriangleMeshes.reserve(32);
+		m_SphereClouds.reserve(32);
 		m_Lights.reserve(32);
 	}
 
@@ -29,58 +33,592 @@ namespace dae {
 		m_Materials.clear();
 	}
 
-	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit) const
+	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit, const VisibleObjects* pVisibleObjects) const
 	{
-		HitRecord currentHit{};
-		for (size_t i = 0; i < m_SphereGeometries.size(); ++i)
+		const GeometryUtils::BlockRay blockRay{ ray };
+
+		// Only what it takes to find the winner is kept while tracing, the hit record gets filled in once at the end
+		PrimitiveHit primitiveHit{};
+		Ray objectRay{ ray };
+		if (closestHit.didHit)
+		{
+			objectRay.max = std::min(ray.max, closestHit.t);
+			primitiveHit.t = closestHit.t;
+		}
+
+		// Planes first, a close plane hit shortens the ray before the BVH gets traversed
+		for (size_t i{ 0 }; i < m_PlaneBlocks.size(); ++i)
+		{
+			GeometryUtils::BlockHit hit{};
+			if (!GeometryUtils::Intersect_PlaneBlock(m_PlaneBlocks[i], blockRay, objectRay.min, objectRay.max, hit))
+				continue;
+
+			primitiveHit = { hit.t, static_cast<uint32_t>(i * PrimitiveBlockWidth + hit.lane), 0, 0.f, 0.f, HitObjectType::Plane };
+			objectRay.max = hit.t;
+		}
+
+		if (pVisibleObjects)
 		{
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray, currentHit))
+			for (size_t i{ 0 }; i < pVisibleObjects->sphereBlocks.size(); ++i)
 			{
-				if (!closestHit.didHit || currentHit.t < closestHit.t)
-					closestHit = currentHit;
+				GeometryUtils::BlockHit hit{};
+				if (!GeometryUtils::Intersect_SphereBlock(pVisibleObjects->sphereBlocks[i], blockRay, objectRay.min, objectRay.max, 0, PrimitiveBlockWidth, hit))
+					continue;
+
+				primitiveHit = { hit.t, pVisibleObjects->sphereIndices[i * PrimitiveBlockWidth + hit.lane], 0, 0.f, 0.f, HitObjectType::Sphere };
+				objectRay.max = hit.t;
 			}
+
+			for (const uint32_t meshIndex : pVisibleObjects->meshIndices)
+			{
+				if (!GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshes[meshIndex], objectRay, primitiveHit))
+					continue;
+
+				primitiveHit.objectIndex = meshIndex;
+				objectRay.max = primitiveHit.t;
+			}
+
+			for (const uint32_t cloudIndex : pVisibleObjects->sphereCloudIndices)
+			{
+				if (!GeometryUtils::HitTest_SphereCloud(m_SphereClouds[cloudIndex], objectRay, primitiveHit))
+					continue;
+
+				primitiveHit.objectIndex = cloudIndex;
+				objectRay.max = primitiveHit.t;
+			}
+		}
+		else
+		{
+			const std::vector<uint32_t>& objectIndices = m_TopLevelBVH.GetPrimitiveIndices();
+			const size_t sphereCount{ m_SphereGeometries.size() };
+			const size_t meshEnd{ sphereCount + m_TriangleMeshes.size() };
+			const auto testLeaf = [&](uint32_t first, uint32_t count, Ray& currentRay)
+			{
+				bool didHit{ false };
+
+				// The spheres of the leaf a block at a time, mesh slots are empty lanes
+				const uint32_t end{ first + count };
+				for (uint32_t blockStart{ first - first % PrimitiveBlockWidth }; blockStart < end; blockStart += PrimitiveBlockWidth)
+				{
+					const uint32_t laneBegin{ first > blockStart ? first - blockStart : 0 };
+					const uint32_t laneEnd{ std::min(end - blockStart, PrimitiveBlockWidth) };
+
+					GeometryUtils::BlockHit hit{};
+					if (!GeometryUtils::Intersect_SphereBlock(m_SphereBlocks[blockStart / PrimitiveBlockWidth], blockRay,
+						currentRay.min, currentRay.max, laneBegin, laneEnd, hit))
+						continue;
+
+					primitiveHit = { hit.t, objectIndices[blockStart + hit.lane], 0, 0.f, 0.f, HitObjectType::Sphere };
+					currentRay.max = hit.t;
+					didHit = true;
+				}
+
+				for (uint32_t i{ first }; i < end; ++i)
+				{
+					const uint32_t objectIndex{ objectIndices[i] };
+					if (objectIndex < sphereCount)
+						continue;
+
+					// The hit tests already reject anything beyond currentRay.max
+					const bool objectDidHit = objectIndex < meshEnd
+						? GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshes[objectIndex - sphereCount], currentRay, primitiveHit)
+						: GeometryUtils::HitTest_SphereCloud(m_SphereClouds[objectIndex - meshEnd], currentRay, primitiveHit);
+					if (!objectDidHit)
+						continue;
+
+					primitiveHit.objectIndex = static_cast<uint32_t>(objectIndex < meshEnd ? objectIndex - sphereCount : objectIndex - meshEnd);
+					currentRay.max = primitiveHit.t;
+					didHit = true;
+				}
+
+				return didHit;
+			};
+
+			GeometryUtils::Traverse_BVHLeaves<false>(m_TopLevelBVH, objectRay, testLeaf);
 		}
 
-		for (size_t i = 0; i < m_PlaneGeometries.size(); ++i)
+		if (primitiveHit.DidHit())
+			MaterializeHit(primitiveHit, ray, closestHit);
+	}
+
+	void Scene::GetClosestHits(RayPacket& packet, uint32_t laneMask, HitRecord* closestHits, const VisibleObjects* pVisibleObjects) const
+	{
+		PrimitiveHit primitiveHits[PrimitiveBlockWidth]{};
+
+		// Planes first, per ray since there are only a handful of them
+		for (uint32_t lanes{ laneMask }; lanes != 0; lanes &= lanes - 1)
 		{
-			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray, currentHit))
+			const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+			Ray& ray = packet.rays[lane];
+			PrimitiveHit& primitiveHit = primitiveHits[lane];
+			if (closestHits[lane].didHit)
 			{
-				if (!closestHit.didHit || currentHit.t < closestHit.t)
-					closestHit = currentHit;
+				ray.max = std::min(ray.max, closestHits[lane].t);
+				primitiveHit.t = closestHits[lane].t;
+			}
+
+			const GeometryUtils::BlockRay blockRay{ ray };
+			for (size_t i{ 0 }; i < m_PlaneBlocks.size(); ++i)
+			{
+				GeometryUtils::BlockHit hit{};
+				if (!GeometryUtils::Intersect_PlaneBlock(m_PlaneBlocks[i], blockRay, ray.min, ray.max, hit))
+					continue;
+
+				primitiveHit = { hit.t, static_cast<uint32_t>(i * PrimitiveBlockWidth + hit.lane), 0, 0.f, 0.f, HitObjectType::Plane };
+				ray.max = hit.t;
+			}
+
+			if (!pVisibleObjects)
+				continue;
+
+			for (size_t i{ 0 }; i < pVisibleObjects->sphereBlocks.size(); ++i)
+			{
+				GeometryUtils::BlockHit hit{};
+				if (!GeometryUtils::Intersect_SphereBlock(pVisibleObjects->sphereBlocks[i], blockRay, ray.min, ray.max, 0, PrimitiveBlockWidth, hit))
+					continue;
+
+				primitiveHit = { hit.t, pVisibleObjects->sphereIndices[i * PrimitiveBlockWidth + hit.lane], 0, 0.f, 0.f, HitObjectType::Sphere };
+				ray.max = hit.t;
+			}
+
+			for (const uint32_t cloudIndex : pVisibleObjects->sphereCloudIndices)
+			{
+				if (!GeometryUtils::HitTest_SphereCloud(m_SphereClouds[cloudIndex], ray, primitiveHit))
+					continue;
+
+				primitiveHit.objectIndex = cloudIndex;
+				ray.max = primitiveHit.t;
 			}
 		}
 
-		for (size_t i = 0; i < m_TriangleMeshes.size(); ++i)
+		// Sets the object of the lanes a mesh or cloud test just moved to it and shortens their rays
+		const auto acceptObjectHits = [&](uint32_t objectHitMask, uint32_t objectIndex)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshes[i], ray, currentHit))
+			for (uint32_t lanes{ objectHitMask }; lanes != 0; lanes &= lanes - 1)
 			{
-				if (!closestHit.didHit || currentHit.t < closestHit.t)
-					closestHit = currentHit;
+				const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+				primitiveHits[lane].objectIndex = objectIndex;
+				packet.rays[lane].max = primitiveHits[lane].t;
 			}
+		};
+
+		if (pVisibleObjects)
+		{
+			// The meshes still trace the whole packet at once
+			for (const uint32_t meshIndex : pVisibleObjects->meshIndices)
+				acceptObjectHits(GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshes[meshIndex], packet, laneMask, primitiveHits), meshIndex);
+		}
+		else
+		{
+			const std::vector<uint32_t>& objectIndices = m_TopLevelBVH.GetPrimitiveIndices();
+			const size_t sphereCount{ m_SphereGeometries.size() };
+			const size_t meshEnd{ sphereCount + m_TriangleMeshes.size() };
+			const auto testLeaf = [&](uint32_t first, uint32_t count, uint32_t leafLanes, RayPacket& currentPacket)
+			{
+				uint32_t hitMask{ 0 };
+
+				const uint32_t end{ first + count };
+				for (uint32_t lanes{ leafLanes }; lanes != 0; lanes &= lanes - 1)
+				{
+					const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+					Ray& ray = currentPacket.rays[lane];
+					const GeometryUtils::BlockRay blockRay{ ray };
+
+					for (uint32_t blockStart{ first - first % PrimitiveBlockWidth }; blockStart < end; blockStart += PrimitiveBlockWidth)
+					{
+						const uint32_t laneBegin{ first > blockStart ? first - blockStart : 0 };
+						const uint32_t laneEnd{ std::min(end - blockStart, PrimitiveBlockWidth) };
+
+						GeometryUtils::BlockHit hit{};
+						if (!GeometryUtils::Intersect_SphereBlock(m_SphereBlocks[blockStart / PrimitiveBlockWidth], blockRay,
+							ray.min, ray.max, laneBegin, laneEnd, hit))
+							continue;
+
+						primitiveHits[lane] = { hit.t, objectIndices[blockStart + hit.lane], 0, 0.f, 0.f, HitObjectType::Sphere };
+						ray.max = hit.t;
+						hitMask |= 1u << lane;
+					}
+				}
+
+				for (uint32_t i{ first }; i < end; ++i)
+				{
+					const uint32_t objectIndex{ objectIndices[i] };
+					if (objectIndex < sphereCount)
+						continue;
+
+					// Meshes keep tracing the rays as a packet, the hit tests already reject anything beyond each ray's max
+					uint32_t objectHitMask{ 0 };
+					if (objectIndex < meshEnd)
+					{
+						objectHitMask = GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshes[objectIndex - sphereCount], currentPacket, leafLanes, primitiveHits);
+						acceptObjectHits(objectHitMask, static_cast<uint32_t>(objectIndex - sphereCount));
+					}
+					else
+					{
+						for (uint32_t lanes{ leafLanes }; lanes != 0; lanes &= lanes - 1)
+						{
+							const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+							if (GeometryUtils::HitTest_SphereCloud(m_SphereClouds[objectIndex - meshEnd], currentPacket.rays[lane], primitiveHits[lane]))
+								objectHitMask |= 1u << lane;
+						}
+						acceptObjectHits(objectHitMask, static_cast<uint32_t>(objectIndex - meshEnd));
+					}
+					hitMask |= objectHitMask;
+				}
+
+				return hitMask;
+			};
+
+			GeometryUtils::Traverse_BVHLeavesPacket(m_TopLevelBVH, packet, laneMask, testLeaf);
+		}
+
+		for (uint32_t lanes{ laneMask }; lanes != 0; lanes &= lanes - 1)
+		{
+			const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+			if (primitiveHits[lane].DidHit())
+				MaterializeHit(primitiveHits[lane], packet.rays[lane], closestHits[lane]);
+		}
+	}
+
+	void Scene::MaterializeHit(const PrimitiveHit& hit, const Ray& ray, HitRecord& hitRecord) const
+	{
+		switch (hit.type)
+		{
+		case HitObjectType::Plane:
+			GeometryUtils::FillPlaneHitRecord(m_PlaneGeometries[hit.objectIndex], ray, hit.t, hitRecord);
+			break;
+		case HitObjectType::Sphere:
+			GeometryUtils::FillSphereHitRecord(m_SphereGeometries[hit.objectIndex], ray, hit.t, hitRecord);
+			break;
+		case HitObjectType::Triangle:
+			GeometryUtils::FillTriangleMeshHitRecord(m_TriangleMeshes[hit.objectIndex], hit.primitiveIndex, ray, hit.t, hitRecord);
+			break;
+		case HitObjectType::SphereCloud:
+			GeometryUtils::FillSphereCloudHitRecord(m_SphereClouds[hit.objectIndex], hit.primitiveIndex, ray, hit.t, hitRecord);
+			break;
+		case HitObjectType::None:
+			break;
 		}
 	}
 
 	bool Scene::DoesHit(const Ray& ray) const
 	{
-		for (size_t i{ 0 }; i < m_SphereGeometries.size(); ++i)
+		PrimitiveHit occluder{};
+		return IsOccluded(ray, occluder);
+	}
+
+	bool Scene::IsOccluded(const Ray& ray, PrimitiveHit& lastOccluder) const
+	{
+		if (lastOccluder.DidHit() && TestOccluder(lastOccluder, ray))
+			return true;
+
+		PrimitiveHit occluder{};
+		bool isOccluded{ FindOccluder(ray, occluder) };
+
+		// Planes last, they mostly bound the scene and the lights sit inside of them
+		const GeometryUtils::BlockRay blockRay{ ray };
+		for (size_t i{ 0 }; i < m_OccluderPlaneBlocks.size() && !isOccluded; ++i)
 		{
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray))
-				return true;
+			GeometryUtils::BlockHit hit{};
+			if (!GeometryUtils::Intersect_PlaneBlock(m_OccluderPlaneBlocks[i], blockRay, ray.min, ray.max, hit))
+				continue;
+
+			occluder = { hit.t, m_OccluderPlanes[i * PrimitiveBlockWidth + hit.lane], 0, 0.f, 0.f, HitObjectType::Plane };
+			isOccluded = true;
 		}
 
-		for (size_t i{ 0 }; i < m_PlaneGeometries.size(); ++i)
+		// A miss keeps the old occluder, the next ray may well pass through it again
+		if (isOccluded)
+			lastOccluder = occluder;
+
+		return isOccluded;
+	}
+
+	bool Scene::TestOccluder(const PrimitiveHit& occluder, const Ray& ray) const
+	{
+		// The cache outlives scene switches, object removal and shadow flag changes, so all of them get checked
+		switch (occluder.type)
 		{
-			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray))
-				return true;
+		case HitObjectType::Plane:
+		{
+			if (occluder.objectIndex >= m_PlaneGeometries.size())
+				return false;
+
+			const Plane& plane = m_PlaneGeometries[occluder.objectIndex];
+			return plane.castsShadow && GeometryUtils::HitTest_Plane(plane, ray);
+		}
+		case HitObjectType::Sphere:
+		{
+			if (occluder.objectIndex >= m_SphereGeometries.size())
+				return false;
+
+			const Sphere& sphere = m_SphereGeometries[occluder.objectIndex];
+			return sphere.castsShadow && GeometryUtils::HitTest_Sphere(sphere, ray);
+		}
+		case HitObjectType::Triangle:
+		{
+			if (occluder.objectIndex >= m_TriangleMeshes.size())
+				return false;
+
+			const TriangleMesh& mesh = m_TriangleMeshes[occluder.objectIndex];
+			if (!mesh.castsShadow || occluder.primitiveIndex >= mesh.triangleRecords.size())
+				return false;
+
+			const Ray objectRay{ mesh.worldToObject.TransformPoint(ray.origin), mesh.worldToObject.TransformVector(ray.direction), ray.min, ray.max };
+			const TriangleRecord& triangle = mesh.triangleRecords[occluder.primitiveIndex];
+
+			GeometryUtils::TriangleHit hit{};
+			return mesh.intersector == TriangleIntersector::Watertight
+				? GeometryUtils::Intersect_Watertight(triangle, mesh.GetTriangleVertex(occluder.primitiveIndex, 0), mesh.GetTriangleVertex(occluder.primitiveIndex, 1),
+					mesh.GetTriangleVertex(occluder.primitiveIndex, 2), objectRay, GeometryUtils::WatertightRay{ objectRay }, true, hit)
+				: GeometryUtils::Intersect_MollerTrumbore(triangle, objectRay, true, hit);
+		}
+		case HitObjectType::SphereCloud:
+		{
+			if (occluder.objectIndex >= m_SphereClouds.size())
+				return false;
+
+			const SphereCloud& cloud = m_SphereClouds[occluder.objectIndex];
+			if (!cloud.castsShadow || occluder.primitiveIndex >= cloud.GetSphereCount())
+				return false;
+
+			const Vector4 sphere{ cloud.GetSphere(occluder.primitiveIndex) };
+			return GeometryUtils::HitTest_Sphere(Sphere{ { sphere.x, sphere.y, sphere.z }, sphere.w, cloud.materialIndex }, ray);
+		}
+		default:
+			return false;
+		}
+	}
+
+	bool Scene::FindOccluder(const Ray& ray, PrimitiveHit& occluder) const
+	{
+		const GeometryUtils::BlockRay blockRay{ ray };
+
+		const std::vector<uint32_t>& occluderIndices = m_OccluderBVH.GetPrimitiveIndices();
+		const size_t sphereCount{ m_SphereGeometries.size() };
+		const size_t meshEnd{ sphereCount + m_TriangleMeshes.size() };
+		const auto testLeaf = [&](uint32_t first, uint32_t count, Ray& currentRay)
+		{
+			const uint32_t end{ first + count };
+			for (uint32_t blockStart{ first - first % PrimitiveBlockWidth }; blockStart < end; blockStart += PrimitiveBlockWidth)
+			{
+				const uint32_t laneBegin{ first > blockStart ? first - blockStart : 0 };
+				const uint32_t laneEnd{ std::min(end - blockStart, PrimitiveBlockWidth) };
+
+				GeometryUtils::BlockHit hit{};
+				if (GeometryUtils::Intersect_SphereBlock(m_OccluderSphereBlocks[blockStart / PrimitiveBlockWidth], blockRay,
+					currentRay.min, currentRay.max, laneBegin, laneEnd, hit))
+				{
+					occluder = { hit.t, m_OccluderObjects[occluderIndices[blockStart + hit.lane]], 0, 0.f, 0.f, HitObjectType::Sphere };
+					return true;
+				}
+			}
+
+			for (uint32_t i{ first }; i < end; ++i)
+			{
+				const uint32_t objectIndex{ m_OccluderObjects[occluderIndices[i]] };
+				if (objectIndex < sphereCount)
+					continue;
+
+				const bool objectDidHit = objectIndex < meshEnd
+					? GeometryUtils::HitTest_TriangleMesh<true>(m_TriangleMeshes[objectIndex - sphereCount], currentRay, occluder)
+					: GeometryUtils::HitTest_SphereCloud<true>(m_SphereClouds[objectIndex - meshEnd], currentRay, occluder);
+				if (objectDidHit)
+				{
+					occluder.objectIndex = static_cast<uint32_t>(objectIndex < meshEnd ? objectIndex - sphereCount : objectIndex - meshEnd);
+					return true;
+				}
+			}
+
+			return false;
+		};
+
+		Ray shadowRay{ ray };
+		return GeometryUtils::Traverse_BVHLeaves<true>(m_OccluderBVH, shadowRay, testLeaf);
+	}
+
+	void Scene::UpdateAccelerationStructure()
+	{
+		// Objects can move every frame, rebuilding a tree over a few thousand boxes is cheap compared to a frame
+		const size_t meshEnd{ m_SphereGeometries.size() + m_TriangleMeshes.size() };
+		m_TopLevelBounds.resize(meshEnd + m_SphereClouds.size());
+
+		for (size_t i{ 0 }; i < m_SphereGeometries.size(); ++i)
+		{
+			const Sphere& sphere = m_SphereGeometries[i];
+			const Vector3 extent{ sphere.radius, sphere.radius, sphere.radius };
+			m_TopLevelBounds[i] = { sphere.origin - extent, sphere.origin + extent };
 		}
 
 		for (size_t i{ 0 }; i < m_TriangleMeshes.size(); ++i)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshes[i], ray))
-				return true;
+			const TriangleMesh& mesh = m_TriangleMeshes[i];
+			m_TopLevelBounds[m_SphereGeometries.size() + i] = { mesh.transformedMinAABB, mesh.transformedMaxAABB };
 		}
 
-		return false;
+		for (size_t i{ 0 }; i < m_SphereClouds.size(); ++i)
+			m_TopLevelBounds[meshEnd + i] = { m_SphereClouds[i].minAABB, m_SphereClouds[i].maxAABB };
+
+		m_TopLevelBVH.Build(m_TopLevelBounds, m_TopLevelBuildMode);
+
+		// Spheres in BVH leaf order, so every leaf covers a contiguous range of lanes
+		BuildSphereBlocks(m_TopLevelBVH.GetPrimitiveIndices(), m_SphereBlocks);
+
+		std::vector<uint32_t> planeIndices(m_PlaneGeometries.size());
+		std::iota(planeIndices.begin(), planeIndices.end(), 0u);
+		BuildPlaneBlocks(planeIndices, m_PlaneBlocks);
+
+		// Shadow rays outnumber the primary rays by the light count, the objects that can't block them get left out of their structure
+		const auto castsShadow = [this, sphereCount = m_SphereGeometries.size(), meshEnd](size_t objectIndex)
+		{
+			if (objectIndex < sphereCount)
+				return m_SphereGeometries[objectIndex].castsShadow;
+
+			return objectIndex < meshEnd ? m_TriangleMeshes[objectIndex - sphereCount].castsShadow : m_SphereClouds[objectIndex - meshEnd].castsShadow;
+		};
+
+		std::vector<AABB> occluderBounds{};
+		m_OccluderObjects.clear();
+		for (size_t i{ 0 }; i < m_TopLevelBounds.size(); ++i)
+		{
+			if (!castsShadow(i))
+				continue;
+
+			occluderBounds.push_back(m_TopLevelBounds[i]);
+			m_OccluderObjects.push_back(static_cast<uint32_t>(i));
+		}
+
+		m_OccluderBVH.Build(occluderBounds, m_TopLevelBuildMode);
+
+		std::vector<uint32_t> occluderSlotObjects{ m_OccluderBVH.GetPrimitiveIndices() };
+		for (uint32_t& slotObject : occluderSlotObjects)
+			slotObject = m_OccluderObjects[slotObject];
+		BuildSphereBlocks(occluderSlotObjects, m_OccluderSphereBlocks);
+
+		m_OccluderPlanes.clear();
+		for (uint32_t i{ 0 }; i < m_PlaneGeometries.size(); ++i)
+		{
+			if (m_PlaneGeometries[i].castsShadow)
+				m_OccluderPlanes.push_back(i);
+		}
+		BuildPlaneBlocks(m_OccluderPlanes, m_OccluderPlaneBlocks);
+	}
+
+	void Scene::BuildSphereBlocks(const std::vector<uint32_t>& slotObjects, std::vector<SphereBlock>& sphereBlocks) const
+	{
+		SphereBlock emptySphereBlock{};
+		std::fill(std::begin(emptySphereBlock.radiusSquared), std::end(emptySphereBlock.radiusSquared), -std::numeric_limits<float>::infinity());
+		sphereBlocks.assign((slotObjects.size() + PrimitiveBlockWidth - 1) / PrimitiveBlockWidth, emptySphereBlock);
+
+		for (size_t slot{ 0 }; slot < slotObjects.size(); ++slot)
+		{
+			if (slotObjects[slot] >= m_SphereGeometries.size())
+				continue;
+
+			const Sphere& sphere = m_SphereGeometries[slotObjects[slot]];
+			SphereBlock& block = sphereBlocks[slot / PrimitiveBlockWidth];
+			const size_t lane{ slot % PrimitiveBlockWidth };
+
+			block.center[0][lane] = sphere.origin.x;
+			block.center[1][lane] = sphere.origin.y;
+			block.center[2][lane] = sphere.origin.z;
+			block.radiusSquared[lane] = sphere.radius * sphere.radius;
+		}
+	}
+
+	void Scene::BuildPlaneBlocks(const std::vector<uint32_t>& planeIndices, std::vector<PlaneBlock>& planeBlocks) const
+	{
+		planeBlocks.assign((planeIndices.size() + PrimitiveBlockWidth - 1) / PrimitiveBlockWidth, PlaneBlock{});
+		for (size_t i{ 0 }; i < planeIndices.size(); ++i)
+		{
+			const Plane& plane = m_PlaneGeometries[planeIndices[i]];
+			PlaneBlock& block = planeBlocks[i / PrimitiveBlockWidth];
+			const size_t lane{ i % PrimitiveBlockWidth };
+
+			block.normal[0][lane] = plane.normal.x;
+			block.normal[1][lane] = plane.normal.y;
+			block.normal[2][lane] = plane.normal.z;
+			block.distance[lane] = Vector3::Dot(plane.normal, plane.origin);
+		}
+	}
+
+	void Scene::CullObjects(const Frustum& frustum, VisibleObjects& visibleObjects) const
+	{
+		visibleObjects.sphereIndices.clear();
+		visibleObjects.meshIndices.clear();
+		visibleObjects.sphereCloudIndices.clear();
+
+		const std::vector<WideBVHNode>& nodes = m_TopLevelBVH.GetWideNodes();
+		const std::vector<uint32_t>& objectIndices = m_TopLevelBVH.GetPrimitiveIndices();
+		const size_t sphereCount{ m_SphereGeometries.size() };
+		const size_t meshEnd{ sphereCount + m_TriangleMeshes.size() };
+
+		TraversalStack<uint32_t> stack{};
+		if (!nodes.empty())
+			stack.Push(0);
+
+		while (!stack.IsEmpty())
+		{
+			const WideBVHNode& node = nodes[stack.Pop()];
+			for (uint32_t slot{ 0 }; slot < WideBVHWidth; ++slot)
+			{
+				// Empty slots have inverted bounds, which the frustum test would not reject
+				if (node.bounds[0][slot] > node.bounds[3][slot])
+					continue;
+
+				if (!frustum.Overlaps({ node.bounds[0][slot], node.bounds[1][slot], node.bounds[2][slot] },
+					{ node.bounds[3][slot], node.bounds[4][slot], node.bounds[5][slot] }))
+					continue;
+
+				if (node.primitiveCounts[slot] == 0)
+				{
+					stack.Push(node.children[slot]);
+					continue;
+				}
+
+				// A leaf can hold several objects, each gets its own test
+				const uint32_t first{ node.children[slot] };
+				for (uint32_t i{ first }; i < first + node.primitiveCounts[slot]; ++i)
+				{
+					const uint32_t objectIndex{ objectIndices[i] };
+					if (objectIndex < sphereCount)
+					{
+						const Sphere& sphere = m_SphereGeometries[objectIndex];
+						if (frustum.Overlaps(sphere.origin, sphere.radius))
+							visibleObjects.sphereIndices.push_back(objectIndex);
+						continue;
+					}
+
+					const AABB& bounds = m_TopLevelBounds[objectIndex];
+					if (!frustum.Overlaps(bounds.min, bounds.max))
+						continue;
+
+					if (objectIndex < meshEnd)
+						visibleObjects.meshIndices.push_back(static_cast<uint32_t>(objectIndex - sphereCount));
+					else
+						visibleObjects.sphereCloudIndices.push_back(static_cast<uint32_t>(objectIndex - meshEnd));
+				}
+			}
+		}
+
+		const size_t sphereBlockCount{ (visibleObjects.sphereIndices.size() + PrimitiveBlockWidth - 1) / PrimitiveBlockWidth };
+		visibleObjects.sphereBlocks.resize(sphereBlockCount);
+		for (size_t slot{ 0 }; slot < sphereBlockCount * PrimitiveBlockWidth; ++slot)
+		{
+			SphereBlock& block = visibleObjects.sphereBlocks[slot / PrimitiveBlockWidth];
+			const size_t lane{ slot % PrimitiveBlockWidth };
+			if (slot >= visibleObjects.sphereIndices.size())
+			{
+				block.radiusSquared[lane] = -std::numeric_limits<float>::infinity();
+				continue;
+			}
+
+			const Sphere& sphere = m_SphereGeometries[visibleObjects.sphereIndices[slot]];
+			block.center[0][lane] = sphere.origin.x;
+			block.center[1][lane] = sphere.origin.y;
+			block.center[2][lane] = sphere.origin.z;
+			block.radiusSquared[lane] = sphere.radius * sphere.radius;
+		}
 	}
 
 #pragma region Scene Helpers
@@ -106,6 +644,14 @@ namespace dae {
 		return &m_PlaneGeometries.back();
 	}
 
+	Plane* Scene::AddRoomPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex)
+	{
+		// Every light and every receiver sits on the inside of a closed room, a wall can't come between them
+		Plane* pPlane = AddPlane(origin, normal, materialIndex);
+		pPlane->castsShadow = false;
+		return pPlane;
+	}
+
 	TriangleMesh* Scene::AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex)
 	{
 		TriangleMesh m{};
@@ -116,6 +662,12 @@ namespace dae {
 		return &m_TriangleMeshes.back();
 	}
 
+	SphereCloud* Scene::AddSphereCloud(const std::vector<Vector4>& spheres, bool quantize, unsigned char materialIndex)
+	{
+		m_SphereClouds.emplace_back(spheres, quantize, materialIndex);
+		return &m_SphereClouds.back();
+	}
+
 	Light* Scene::AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color)
 	{
 		Light l;
@@ -171,11 +723,11 @@ namespace dae {
 		AddSphere({ 2.5f, 0.f, 1.f }, 5.f, matId_Solid_Blue);
 
 		//Plane
-		AddPlane({ -7.5f, 0.f, 0.f }, { 1.f, 0.f,0.f }, matId_Solid_Green);
-		AddPlane({ 7.5f, 0.f, 0.f }, { -1.f, 0.f,0.f }, matId_Solid_Green);
-		AddPlane({ 0.f, -7.5f, 0.f }, { 0.f, 1.f,0.f }, matId_Solid_Yellow);
-		AddPlane({ 0.f, 7.5f, 0.f }, { 0.f, -1.f,0.f }, matId_Solid_Yellow);
-		AddPlane({ 0.f, 0.f, 12.5f }, { 0.f, 0.f,-1.f }, matId_Solid_Magenta);
+		AddRoomPlane({ -7.5f, 0.f, 0.f }, { 1.f, 0.f,0.f }, matId_Solid_Green);
+		AddRoomPlane({ 7.5f, 0.f, 0.f }, { -1.f, 0.f,0.f }, matId_Solid_Green);
+		AddRoomPlane({ 0.f, -7.5f, 0.f }, { 0.f, 1.f,0.f }, matId_Solid_Yellow);
+		AddRoomPlane({ 0.f, 7.5f, 0.f }, { 0.f, -1.f,0.f }, matId_Solid_Yellow);
+		AddRoomPlane({ 0.f, 0.f, 12.5f }, { 0.f, 0.f,-1.f }, matId_Solid_Magenta);
 
 		// Lights
 		AddPointLight({ 0.f, 5.f, -5.f }, 70.f, colors::White);
@@ -201,11 +753,11 @@ namespace dae {
 		const unsigned char matId_Solid_Magenta = AddMaterial(new Material_SolidColor{ colors::Magenta });
 
 		// Plane
-		AddPlane({ -5.f, 0.f, 0.f }, { 1.f, 0.f, 0.f }, matId_Solid_Green);     // Left
-		AddPlane({ 5.f, 0.f, 0.f }, { -1.f, 0.f, 0.f }, matId_Solid_Green);     // Right
-		AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matId_Solid_Yellow);     // Down
-		AddPlane({ 0.f, 10.f, 0.f }, { 0.f, -1.f, 0.f }, matId_Solid_Yellow);   // Top
-		AddPlane({ 0.f, 0.f, 10.f }, { 0.f, 0.f, -1.f }, matId_Solid_Magenta);  // Back
+		AddRoomPlane({ -5.f, 0.f, 0.f }, { 1.f, 0.f, 0.f }, matId_Solid_Green);     // Left
+		AddRoomPlane({ 5.f, 0.f, 0.f }, { -1.f, 0.f, 0.f }, matId_Solid_Green);     // Right
+		AddRoomPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matId_Solid_Yellow);     // Down
+		AddRoomPlane({ 0.f, 10.f, 0.f }, { 0.f, -1.f, 0.f }, matId_Solid_Yellow);   // Top
+		AddRoomPlane({ 0.f, 0.f, 10.f }, { 0.f, 0.f, -1.f }, matId_Solid_Magenta);  // Back
 
 		// Spheres - Bottom row
 		AddSphere({ -1.75f, 1.0f, 0.f }, 0.75f, matId_Solid_Red);
@@ -240,8 +792,8 @@ namespace dae {
 		AddSphere({ -.75f, 1.0f, 0.f }, 1.f, matLambert_Red);
 		AddSphere({ .75f, 1.0f, 0.f }, 1.f, matLambertPhong_Blue);
 
-		// Plane
-		AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matLambert_Yellow);
+		// Plane, both lights sit above it
+		AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, matLambert_Yellow)->castsShadow = false;
 
 		// Light
 		AddPointLight({ 0.f, 2.5f, 5.f }, 25.f, colors::White);
@@ -274,11 +826,11 @@ namespace dae {
 		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ .49f, .57f, .57f }, 1.f));
 
 		// Planes
-		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);  // BACK
-		AddPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);  // BOTTOM
-		AddPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);  // TOP
-		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);  // RIGHT
-		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);  // LEFT
+		AddRoomPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);  // BACK
+		AddRoomPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);  // BOTTOM
+		AddRoomPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);  // TOP
+		AddRoomPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);  // RIGHT
+		AddRoomPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);  // LEFT
 
 		// Spheres - Bottom row
 		AddSphere(Vector3{ -1.75f,1.f, 0.f }, .75f, matCT_GrayRoughMetal);
@@ -314,11 +866,11 @@ namespace dae {
 		const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
 
 		// Planes
-		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);
 
 		// Triangle mesh
 		pMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
@@ -331,6 +883,7 @@ namespace dae {
 		pMesh->Translate({ 0.f, 1.f, 0.f });
 		pMesh->UpdateAABB();
 		pMesh->UpdateTransforms();
+		pMesh->BuildBVH();
 
 		// Lights
 		AddPointLight(Vector3{ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, .61f, .45f });  // Backlight
@@ -355,6 +908,9 @@ namespace dae {
 	{
 		m_SceneName = "Week 4 - Reference Scene";
 
+		// The meshes rotate every frame, so the top level gets rebuilt every frame as well
+		m_TopLevelBuildMode = BVHBuildMode::LBVH;
+
 		// Camera Settings
 		m_Camera.origin = { 0.f, 3.f, -9.f };
 		m_Camera.SetFovAngle(45.f);
@@ -374,11 +930,11 @@ namespace dae {
 		const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
 
 		// Planes
-		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);
-		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);
+		AddRoomPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);
 
 		// Spheres - bottom row
 		AddSphere(Vector3{ -1.75f,1.f, 0.f }, .75f, matCT_GrayRoughMetal);
@@ -403,6 +959,7 @@ namespace dae {
 		m_Meshes[0]->Translate({ -1.75f, 4.5f, 0.f });
 		m_Meshes[0]->UpdateAABB();
 		m_Meshes[0]->UpdateTransforms();
+		m_Meshes[0]->BuildBVH();
 
 		// Middle Triangle
 		m_Meshes[1] = AddTriangleMesh(TriangleCullMode::FrontFaceCulling, matLambert_White);
@@ -410,6 +967,7 @@ namespace dae {
 		m_Meshes[1]->Translate({ 0.f, 4.5f, 0.f });
 		m_Meshes[1]->UpdateAABB();
 		m_Meshes[1]->UpdateTransforms();
+		m_Meshes[1]->BuildBVH();
 
 		// Right Triangle
 		m_Meshes[2] = AddTriangleMesh(TriangleCullMode::NoCulling, matLambert_White);
@@ -417,6 +975,7 @@ namespace dae {
 		m_Meshes[2]->Translate({ 1.75f, 4.5f, 0.f });
 		m_Meshes[2]->UpdateAABB();
 		m_Meshes[2]->UpdateTransforms();
+		m_Meshes[2]->BuildBVH();
 
 		// Lights
 		AddPointLight(Vector3{ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, .61f, .45f });  // Backlight
@@ -466,16 +1025,21 @@ namespace dae {
 		m_pBunny->RotateY(180.f);
 		m_pBunny->Scale({2.f, 2.f, 2.f});
 
-		// Update Transforms & AABB
+		// Update Transforms, AABB & BVH
 		m_pBunny->UpdateAABB();
 		m_pBunny->UpdateTransforms();
+		m_pBunny->BuildBVH();
+
+		const BVHBuildStats& bvhStats = m_pBunny->bvh.GetBuildStats();
+		std::cout << "Bunny BVH: " << m_pBunny->indices.size() / 3 << " triangles built in " << bvhStats.buildTimeMs << " ms, "
+			<< static_cast<float>(bvhStats.peakMemoryBytes) / (1024.f * 1024.f) << " MB peak" << std::endl;
 
 		// Planes
-		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);  // BACK
-		AddPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);  // BOTTOM
-		AddPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);  // TOP
-		AddPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);  // RIGHT
-		AddPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);  // LEFT
+		AddRoomPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);  // BACK
+		AddRoomPlane(Vector3{ 0.f, 0.f, 0.f }, Vector3{ 0.f, 1.f, 0.f }, matLambert_GrayBlue);  // BOTTOM
+		AddRoomPlane(Vector3{ 0.f, 10.f, 0.f }, Vector3{ 0.f, -1.f, 0.f }, matLambert_GrayBlue);  // TOP
+		AddRoomPlane(Vector3{ 5.f, 0.f, 0.f }, Vector3{ -1.f, 0.f, 0.f }, matLambert_GrayBlue);  // RIGHT
+		AddRoomPlane(Vector3{ -5.f, 0.f, 0.f }, Vector3{ 1.f, 0.f, 0.f }, matLambert_GrayBlue);  // LEFT
 
 
 		// Light
@@ -15,6 +15,17 @@ namespace dae
 	struct Sphere;
 	struct Light;
 
+	// Objects a frustum may see, filled by Scene::CullObjects. The visible spheres get packed into blocks of their own
+	struct VisibleObjects
+	{
+		std::vector<SphereBlock> sphereBlocks{};
+		std::vector<uint32_t> sphereIndices{};  // Sphere of every block lane, the padding lanes of the last block never hit
+		std::vector<uint32_t> meshIndices{};
+		std::vector<uint32_t> sphereCloudIndices{};
+
+		size_t GetObjectCount() const { return sphereIndices.size() + meshIndices.size() + sphereCloudIndices.size(); }
+	};
+
 	//Scene Base Class
 	class Scene
 	{
@@ -34,21 +45,47 @@ namespace dae
 		}
 
 		Camera& GetCamera() { return m_Camera; }
-		void GetClosestHit(const Ray& ray, HitRecord& closestHit) const;
+		// pVisibleObjects restricts the search to the planes and a culled object list, tested one after the other instead of through the top-level BVH
+		void GetClosestHit(const Ray& ray, HitRecord& closestHit, const VisibleObjects* pVisibleObjects = nullptr) const;
+		// Closest hits of the packet lanes in laneMask, traced together through the BVHs. closestHits holds one record per lane
+		void GetClosestHits(RayPacket& packet, uint32_t laneMask, HitRecord* closestHits, const VisibleObjects* pVisibleObjects = nullptr) const;
+		// Whether anything casting shadows blocks ray, see m_OccluderBVH
 		bool DoesHit(const Ray& ray) const;
+		// Shadow ray query that stops at the first occluder. lastOccluder caches what blocked the previous ray towards the same light:
+		// it gets tested first and is replaced by the occluder found, neighbouring shadow rays mostly share it
+		bool IsOccluded(const Ray& ray, PrimitiveHit& lastOccluder) const;
+		// Position, normal and material of a hit found while tracing ray, everything tracing itself leaves out
+		void MaterializeHit(const PrimitiveHit& hit, const Ray& ray, HitRecord& hitRecord) const;
+
+		// Rebuilds the top-level and occluder BVHs over the spheres, meshes and sphere clouds and the sphere and plane tables,
+		// call after moving objects or changing their shadow flags and before tracing
+		void UpdateAccelerationStructure();
+		// Spheres, meshes and sphere clouds whose bounds overlap the frustum, found through the top-level BVH. Planes are never culled
+		void CullObjects(const Frustum& frustum, VisibleObjects& visibleObjects) const;
 
 		const std::vector<Plane>& GetPlaneGeometries() const { return m_PlaneGeometries; }
 		const std::vector<Sphere>& GetSphereGeometries() const { return m_SphereGeometries; }
+		const std::vector<TriangleMesh>& GetTriangleMeshes() const { return m_TriangleMeshes; }
+		const std::vector<SphereCloud>& GetSphereClouds() const { return m_SphereClouds; }
 		const std::vector<Light>& GetLights() const { return m_Lights; }
-		const std::vector<Material*> GetMaterials() const { return m_Materials; }
+		const std::vector<Material*>& GetMaterials() const { return m_Materials; }
 
 		void Deinitializing()
 		{
 			m_PlaneGeometries.clear();
 			m_SphereGeometries.clear();
 			m_TriangleMeshes.clear();
+			m_SphereClouds.clear();
 			m_Lights.clear();
 			m_Materials.clear();
+			m_TopLevelBVH.Clear();
+			m_SphereBlocks.clear();
+			m_PlaneBlocks.clear();
+			m_OccluderBVH.Clear();
+			m_OccluderObjects.clear();
+			m_OccluderSphereBlocks.clear();
+			m_OccluderPlaneBlocks.clear();
+			m_OccluderPlanes.clear();
 
 			m_Camera.totalPitch = 0;
 			m_Camera.totalYaw = 0;
@@ -60,20 +97,56 @@ namespace dae
 		std::vector<Plane> m_PlaneGeometries{};
 		std::vector<Sphere> m_SphereGeometries{};
 		std::vector<TriangleMesh> m_TriangleMeshes{};
+		std::vector<SphereCloud> m_SphereClouds{};
 		std::vector<Light> m_Lights{};
 		std::vector<Material*> m_Materials{};
 
+		// Top-level acceleration structure, primitive i < m_SphereGeometries.size() is a sphere,
+		// followed by m_TriangleMeshes and then m_SphereClouds. Planes are unbounded and stay in a separate list.
+		BVH m_TopLevelBVH{};
+		BVHBuildMode m_TopLevelBuildMode{ BVHBuildMode::SAH };
+		std::vector<AABB> m_TopLevelBounds{};
+
+		// SoA copies for the SIMD kernels, rebuilt with the top-level BVH. Sphere slot i belongs to
+		// m_TopLevelBVH.GetPrimitiveIndices()[i], slots holding a mesh are left empty
+		std::vector<SphereBlock> m_SphereBlocks{};
+		std::vector<PlaneBlock> m_PlaneBlocks{};
+
+		// Occluder-only acceleration structure traversed by the shadow rays, holding just the objects that cast shadows.
+		// Its primitive i is top-level object m_OccluderObjects[i], the sphere slots follow its own leaf order
+		BVH m_OccluderBVH{};
+		std::vector<uint32_t> m_OccluderObjects{};
+		std::vector<SphereBlock> m_OccluderSphereBlocks{};
+		// Lane i of m_OccluderPlaneBlocks is plane m_OccluderPlanes[i]
+		std::vector<PlaneBlock> m_OccluderPlaneBlocks{};
+		std::vector<uint32_t> m_OccluderPlanes{};
+
 		Camera m_Camera{};
 
 		Sphere* AddSphere(const Vector3& origin, float radius, unsigned char materialIndex = 0);
 		Plane* AddPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex = 0);
+		// Wall of a room enclosing the camera and every light, it never casts a shadow so shadow rays skip it
+		Plane* AddRoomPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex = 0);
 		TriangleMesh* AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex = 0);
+		// Meant for very large sphere sets, the cloud builds its own BVH and takes a single slot in the top-level BVH
+		SphereCloud* AddSphereCloud(const std::vector<Vector4>& spheres, bool quantize = false, unsigned char materialIndex = 0);
 
 		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color);
 		Light* AddDirectionalLight(const Vector3& direction, float intensity, const ColorRGB& color);
 		unsigned char AddMaterial(Material* pMaterial);
 
 		std::string m_SceneName{};
+
+	private:
+		// Sphere slot i of the blocks holds top-level object slotObjects[i], slots holding no sphere are left empty
+		void BuildSphereBlocks(const std::vector<uint32_t>& slotObjects, std::vector<SphereBlock>& sphereBlocks) const;
+		// Lane i of the blocks holds plane planeIndices[i]
+		void BuildPlaneBlocks(const std::vector<uint32_t>& planeIndices, std::vector<PlaneBlock>& planeBlocks) const;
+
+		// Whether the single primitive occluder blocks ray, false if it no longer exists
+		bool TestOccluder(const PrimitiveHit& occluder, const Ray& ray) const;
+		// First spheres, meshes and sphere clouds occluder found through the occluder BVH
+		bool FindOccluder(const Ray& ray, PrimitiveHit& occluder) const;
 	};
 
 	//+++++++++++++++++++++++++++++++++++++++++
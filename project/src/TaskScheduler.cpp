@@ -0,0 +1,149 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#include "MathHelpers.h"
+
+using namespace dae;
+
+namespace
+{
+	// Heavy tiles never get split below this many pixels a side
+	constexpr uint32_t MinTaskSize{ 4 };
+}
+
+void TaskScheduler::SetTileSize(uint32_t tileSize)
+{
+	m_TileSize = std::max(tileSize, 1u);
+	m_TileCosts.clear();
+	m_Tasks.clear();
+}
+
+void TaskScheduler::ScheduleTasks(uint32_t width, uint32_t height, uint32_t targetTaskCount)
+{
+	const uint32_t tileCountX{ (width + m_TileSize - 1) / m_TileSize };
+	const uint32_t tileCountY{ (height + m_TileSize - 1) / m_TileSize };
+
+	// First frame, a new tile size or a new resolution, every tile starts out equally expensive
+	if (tileCountX != m_TileCountX || tileCountY != m_TileCountY || m_TileCosts.size() != tileCountX * tileCountY)
+	{
+		m_TileCountX = tileCountX;
+		m_TileCountY = tileCountY;
+		m_TileCosts.assign(tileCountX * tileCountY, 1.f);
+	}
+
+	float totalCost{ 0.f };
+	for (const float tileCost : m_TileCosts)
+		totalCost += tileCost;
+
+	const float targetCost{ totalCost / static_cast<float>(std::max(targetTaskCount, 1u)) };
+	const uint32_t curveSide{ std::bit_ceil(std::max(tileCountX, tileCountY)) };
+
+	m_Tasks.clear();
+	for (uint32_t tileY{ 0 }; tileY < tileCountY; ++tileY)
+	{
+		// Neighbouring cheap tiles in a row merge into one task until it reaches the target cost
+		RenderTask mergedTask{};
+		bool isMerging{ false };
+
+		for (uint32_t tileX{ 0 }; tileX < tileCountX; ++tileX)
+		{
+			const uint32_t x{ tileX * m_TileSize }, y{ tileY * m_TileSize };
+			const RenderTask tile{ x, y, std::min(m_TileSize, width - x), std::min(m_TileSize, height - y), m_TileCosts[tileX + tileY * tileCountX], 0.f,
+				EncodeHilbert2D(curveSide, tileX, tileY) };
+
+			if (isMerging && mergedTask.estimatedCost + tile.estimatedCost <= targetCost)
+			{
+				mergedTask.width += tile.width;
+				mergedTask.estimatedCost += tile.estimatedCost;
+				continue;
+			}
+
+			if (isMerging)
+			{
+				m_Tasks.push_back(mergedTask);
+				isMerging = false;
+			}
+
+			if (tile.estimatedCost > 2.f * targetCost)
+			{
+				SplitTask(tile, targetCost);
+				continue;
+			}
+
+			mergedTask = tile;
+			isMerging = true;
+		}
+
+		if (isMerging)
+			m_Tasks.push_back(mergedTask);
+	}
+
+	// Most expensive first, the cheap tasks fill the gaps at the end of the frame.
+	// Costs in the same power of two bucket [2^k, 2^(k+1)) count as equal and keep Hilbert order, so tasks picked up one after
+	// the other tend to be neighbours. The buckets are fixed, two costs just either side of a power of two still sort apart
+	std::sort(m_Tasks.begin(), m_Tasks.end(), [](const RenderTask& a, const RenderTask& b)
+	{
+		const int costLevelA{ std::ilogb(a.estimatedCost) }, costLevelB{ std::ilogb(b.estimatedCost) };
+		if (costLevelA != costLevelB)
+			return costLevelA > costLevelB;
+		return a.curveIndex < b.curveIndex;
+	});
+}
+
+void TaskScheduler::SplitTask(const RenderTask& task, float targetCost)
+{
+	// Halve the longer side until the pieces reach the target, assuming the cost is spread evenly over the pixels
+	const bool splitX{ task.width >= task.height };
+	const uint32_t size{ splitX ? task.width : task.height };
+
+	if (task.estimatedCost <= targetCost || size < 2 * MinTaskSize)
+	{
+		m_Tasks.push_back(task);
+		return;
+	}
+
+	RenderTask first{ task }, second{ task };
+	if (splitX)
+	{
+		first.width = task.width / 2;
+		second.x = task.x + first.width;
+		second.width = task.width - first.width;
+	}
+	else
+	{
+		first.height = task.height / 2;
+		second.y = task.y + first.height;
+		second.height = task.height - first.height;
+	}
+
+	const float firstShare{ static_cast<float>(size / 2) / static_cast<float>(size) };
+	first.estimatedCost = task.estimatedCost * firstShare;
+	second.estimatedCost = task.estimatedCost - first.estimatedCost;
+
+	SplitTask(first, targetCost);
+	SplitTask(second, targetCost);
+}
+
+void TaskScheduler::UpdateTileCosts()
+{
+	std::fill(m_TileCosts.begin(), m_TileCosts.end(), 0.f);
+
+	for (const RenderTask& task : m_Tasks)
+	{
+		const float costPerPixel{ task.measuredCost / static_cast<float>(task.width * task.height) };
+
+		// A task covers part of one tile or a run of whole tiles
+		for (uint32_t tileY{ task.y / m_TileSize }; tileY * m_TileSize < task.y + task.height; ++tileY)
+		{
+			const uint32_t overlapY{ std::min(task.y + task.height, (tileY + 1) * m_TileSize) - std::max(task.y, tileY * m_TileSize) };
+			for (uint32_t tileX{ task.x / m_TileSize }; tileX * m_TileSize < task.x + task.width; ++tileX)
+			{
+				const uint32_t overlapX{ std::min(task.x + task.width, (tileX + 1) * m_TileSize) - std::max(task.x, tileX * m_TileSize) };
+				m_TileCosts[tileX + tileY * m_TileCountX] += costPerPixel * static_cast<float>(overlapX * overlapY);
+			}
+		}
+	}
+}
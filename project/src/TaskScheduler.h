@@ -0,0 +1,56 @@
+#pragma once
+
+//Standard includes
+#include <cstdint>
+#include <vector>
+
+namespace dae
+{
+	// Rectangle of pixels rendered as one thread pool task, split from or merged out of the tile grid
+	struct RenderTask
+	{
+		uint32_t x, y, width, height;
+		float estimatedCost;  // Last frame's render time of the covered pixels, in microseconds
+		float measuredCost;
+		uint32_t curveIndex;  // Position of the task's first tile along the tile grid's Hilbert curve
+	};
+
+	/**
+	 * \brief Cuts the frame into render tasks of about equal cost.
+	 * The frame is a grid of square tiles, each remembering what it cost last frame. Cheap neighbouring tiles in a row
+	 * merge into one task and expensive tiles get split, the tasks come out most expensive first.
+	 * Once the tasks have their measuredCost filled in, UpdateTileCosts spreads it back over the tiles for the next frame.
+	 */
+	class TaskScheduler final
+	{
+	public:
+		// Forgets the tile costs and tasks, they were measured on the old grid
+		void SetTileSize(uint32_t tileSize);
+		uint32_t GetTileSize() const { return m_TileSize; }
+
+		/**
+		 * \brief Rebuilds the tasks covering every pixel of a width x height frame exactly once
+		 * \param targetTaskCount how many tasks the total cost gets spread over, the merges and splits aim for that cost per task
+		 */
+		void ScheduleTasks(uint32_t width, uint32_t height, uint32_t targetTaskCount);
+		// Spreads the measured task costs back over the tiles they covered
+		void UpdateTileCosts();
+
+		std::vector<RenderTask>& GetTasks() { return m_Tasks; }
+		const std::vector<RenderTask>& GetTasks() const { return m_Tasks; }
+		// Row major, GetTileCountX() tiles a row
+		const std::vector<float>& GetTileCosts() const { return m_TileCosts; }
+		uint32_t GetTileCountX() const { return m_TileCountX; }
+		uint32_t GetTileCountY() const { return m_TileCountY; }
+
+	private:
+		void SplitTask(const RenderTask& task, float targetCost);
+
+		uint32_t m_TileSize{ 16 };
+		uint32_t m_TileCountX{ 0 };
+		uint32_t m_TileCountY{ 0 };
+
+		std::vector<float> m_TileCosts{};
+		std::vector<RenderTask> m_Tasks{};
+	};
+}
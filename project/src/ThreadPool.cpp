@@ -0,0 +1,167 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+using namespace dae;
+
+namespace
+{
+	uint64_t PackRange(uint32_t front, uint32_t back)
+	{
+		return static_cast<uint64_t>(back) << 32 | front;
+	}
+}
+
+ThreadPool::ThreadPool(uint32_t threadCount) :
+	m_Queues(std::max(threadCount > 0 ? threadCount : std::thread::hardware_concurrency(), 1u))
+{
+	m_Threads.reserve(m_Queues.size() - 1);
+	for (uint32_t workerIndex{ 1 }; workerIndex < m_Queues.size(); ++workerIndex)
+		m_Threads.emplace_back(&ThreadPool::WorkerLoop, this, workerIndex);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard lock{ m_Mutex };
+		m_IsStopping = true;
+	}
+	m_WakeCondition.notify_all();
+
+	for (std::thread& thread : m_Threads)
+		thread.join();
+}
+
+void ThreadPool::Run(uint32_t taskCount, TaskFunction taskFunction, void* pTask, TaskDistribution distribution)
+{
+	if (taskCount == 0)
+		return;
+
+	m_TaskFunction = taskFunction;
+	m_pTask = pTask;
+	m_Distribution = distribution;
+
+	const uint64_t workerCount{ m_Queues.size() };
+	for (uint64_t workerIndex{ 0 }; workerIndex < workerCount; ++workerIndex)
+	{
+		uint64_t range{};
+		if (distribution == TaskDistribution::Contiguous)
+		{
+			range = PackRange(static_cast<uint32_t>(taskCount * workerIndex / workerCount), static_cast<uint32_t>(taskCount * (workerIndex + 1) / workerCount));
+		}
+		else
+		{
+			// Every workerCount-th task starting at workerIndex
+			range = PackRange(0, workerIndex < taskCount ? static_cast<uint32_t>((taskCount - workerIndex + workerCount - 1) / workerCount) : 0);
+		}
+
+		m_Queues[workerIndex].range.store(range, std::memory_order_relaxed);
+	}
+
+	if (!m_Threads.empty())
+	{
+		{
+			std::lock_guard lock{ m_Mutex };
+			m_BusyWorkers = static_cast<uint32_t>(m_Threads.size());
+			++m_Batch;
+		}
+		m_WakeCondition.notify_all();
+	}
+
+	RunTasks(0);
+
+	// The other workers may still be finishing stolen tasks
+	std::unique_lock lock{ m_Mutex };
+	m_DoneCondition.wait(lock, [this] { return m_BusyWorkers == 0; });
+}
+
+void ThreadPool::RunTasks(uint32_t workerIndex)
+{
+	const uint32_t workerCount{ static_cast<uint32_t>(m_Queues.size()) };
+
+	const auto runSlot = [&](uint32_t ownerIndex, uint32_t slot)
+	{
+		m_TaskFunction(m_pTask, m_Distribution == TaskDistribution::Contiguous ? slot : ownerIndex + slot * workerCount);
+	};
+
+	uint32_t slot{};
+	while (true)
+	{
+		if (PopFront(m_Queues[workerIndex], slot))
+		{
+			runSlot(workerIndex, slot);
+			continue;
+		}
+
+		// Own queue ran dry, steal from the far end of the others starting at the next worker
+		uint32_t victimIndex{ workerIndex };
+		bool didSteal{ false };
+		for (uint32_t offset{ 1 }; offset < workerCount && !didSteal; ++offset)
+		{
+			victimIndex = (workerIndex + offset) % workerCount;
+			didSteal = StealBack(m_Queues[victimIndex], slot);
+		}
+
+		// Tasks never spawn new tasks, so once every queue is empty the batch is done for this worker
+		if (!didSteal)
+			return;
+
+		runSlot(victimIndex, slot);
+	}
+}
+
+void ThreadPool::WorkerLoop(uint32_t workerIndex)
+{
+	uint64_t lastBatch{ 0 };
+	while (true)
+	{
+		{
+			std::unique_lock lock{ m_Mutex };
+			m_WakeCondition.wait(lock, [&] { return m_IsStopping || m_Batch != lastBatch; });
+			if (m_IsStopping)
+				return;
+
+			lastBatch = m_Batch;
+		}
+
+		RunTasks(workerIndex);
+
+		std::lock_guard lock{ m_Mutex };
+		if (--m_BusyWorkers == 0)
+			m_DoneCondition.notify_one();
+	}
+}
+
+bool ThreadPool::PopFront(WorkerQueue& queue, uint32_t& slot)
+{
+	uint64_t range{ queue.range.load(std::memory_order_relaxed) };
+	while (true)
+	{
+		const uint32_t front{ static_cast<uint32_t>(range) }, back{ static_cast<uint32_t>(range >> 32) };
+		if (front >= back)
+			return false;
+
+		if (queue.range.compare_exchange_weak(range, PackRange(front + 1, back), std::memory_order_acq_rel))
+		{
+			slot = front;
+			return true;
+		}
+	}
+}
+
+bool ThreadPool::StealBack(WorkerQueue& queue, uint32_t& slot)
+{
+	uint64_t range{ queue.range.load(std::memory_order_relaxed) };
+	while (true)
+	{
+		const uint32_t front{ static_cast<uint32_t>(range) }, back{ static_cast<uint32_t>(range >> 32) };
+		if (front >= back)
+			return false;
+
+		if (queue.range.compare_exchange_weak(range, PackRange(front, back - 1), std::memory_order_acq_rel))
+		{
+			slot = back - 1;
+			return true;
+		}
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+//Standard includes
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace dae
+{
+	enum class TaskDistribution
+	{
+		Contiguous,  // Worker w starts with one contiguous range of task indices, keeps neighbouring tasks on one thread
+		Interleaved  // Worker w starts with tasks w, w + workerCount, ..., spreads a list sorted by cost evenly over the workers
+	};
+
+	/**
+	 * \brief Persistent pool of worker threads that runs batches of indexed tasks.
+	 * Every batch gets dealt out over one queue per worker. A worker pops from the front of its own queue
+	 * and steals from the back of the others once it runs dry. The calling thread joins in as worker 0.
+	 * Nothing gets allocated per batch.
+	 */
+	class ThreadPool final
+	{
+	public:
+		// threadCount includes the calling thread, 0 uses every hardware thread
+		explicit ThreadPool(uint32_t threadCount = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		uint32_t GetThreadCount() const { return static_cast<uint32_t>(m_Threads.size()) + 1; }
+
+		/**
+		 * \brief Runs task(taskIndex) for every index in [0, taskCount) and returns once all of them are done
+		 * \param task void(uint32_t taskIndex), called concurrently from every worker
+		 * \param distribution how the indices are dealt out over the worker queues before any stealing happens
+		 */
+		template<typename Task>
+		void ParallelFor(uint32_t taskCount, Task&& task, TaskDistribution distribution = TaskDistribution::Contiguous)
+		{
+			using TaskType = std::remove_reference_t<Task>;
+			Run(taskCount, [](void* pTask, uint32_t taskIndex) { (*static_cast<TaskType*>(pTask))(taskIndex); },
+				const_cast<void*>(static_cast<const void*>(&task)), distribution);
+		}
+
+	private:
+		using TaskFunction = void(*)(void* pTask, uint32_t taskIndex);
+
+		// Remaining slot range [front, back) of one worker, packed so popping and stealing are a single compare and swap.
+		// Slots are task indices for contiguous batches and the position in the worker's share for interleaved ones
+		struct alignas(64) WorkerQueue
+		{
+			std::atomic<uint64_t> range{ 0 };
+		};
+
+		void Run(uint32_t taskCount, TaskFunction taskFunction, void* pTask, TaskDistribution distribution);
+		void RunTasks(uint32_t workerIndex);
+		void WorkerLoop(uint32_t workerIndex);
+
+		static bool PopFront(WorkerQueue& queue, uint32_t& slot);
+		static bool StealBack(WorkerQueue& queue, uint32_t& slot);
+
+		std::vector<std::thread> m_Threads{};
+		std::vector<WorkerQueue> m_Queues;
+
+		TaskFunction m_TaskFunction{ nullptr };
+		void* m_pTask{ nullptr };
+		TaskDistribution m_Distribution{ TaskDistribution::Contiguous };
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_WakeCondition{};
+		std::condition_variable m_DoneCondition{};
+		uint64_t m_Batch{ 0 };
+		uint32_t m_BusyWorkers{ 0 };
+		bool m_IsStopping{ false };
+	};
+}
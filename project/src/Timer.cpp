@@ -41,7 +41,7 @@ void Timer::Start()
 	}
 }
 
-void Timer::StartBenchmark(int numFrames)
+void Timer::StartBenchmark(int numFrames, const std::string& description)
 {
 	if (m_BenchmarkActive)
 	{
@@ -60,8 +60,11 @@ void Timer::StartBenchmark(int numFrames)
 
 	m_Benchmarks.clear();
 	m_Benchmarks.resize(m_BenchmarkFrames);
+	m_BenchmarkDescription = description;
 
 	std::cout << "**BENCHMARK STARTED**\n";
+	if (!m_BenchmarkDescription.empty())
+		std::cout << ">> " << m_BenchmarkDescription << std::endl;
 }
 
 void Timer::Update()
@@ -115,12 +118,16 @@ void Timer::Update()
 
 				//print
 				std::cout << "**BENCHMARK FINISHED**\n";
+				if (!m_BenchmarkDescription.empty())
+					std::cout << ">> " << m_BenchmarkDescription << std::endl;
 				std::cout << ">> HIGH = " << m_BenchmarkHigh << std::endl;
 				std::cout << ">> LOW = " << m_BenchmarkLow << std::endl;
 				std::cout << ">> AVG = " << m_BenchmarkAvg << std::endl;
 
 				//file save
 				std::ofstream fileStream("benchmark.txt");
+				if (!m_BenchmarkDescription.empty())
+					fileStream << "BACKEND = " << m_BenchmarkDescription << std::endl;
 				fileStream << "FRAMES = " << m_BenchmarkCurrFrame << std::endl;
 				fileStream << "HIGH = " << m_BenchmarkHigh << std::endl;
 				fileStream << "LOW = " << m_BenchmarkLow << std::endl;
@@ -2,6 +2,7 @@
 
 //Standard includes
 #include <cstdint>
+#include <string>
 #include <vector>
 
 namespace dae
@@ -17,7 +18,8 @@ namespace dae
 		Timer& operator=(const Timer&) = delete;
 		Timer& operator=(Timer&&) noexcept = delete;
 
-		void StartBenchmark(int numFrames = 10);
+		// description ends up next to the results, e.g. the renderer's execution backend
+		void StartBenchmark(int numFrames = 10, const std::string& description = {});
 
 		void Reset();
 		void Start();
@@ -57,5 +59,6 @@ namespace dae
 		int m_BenchmarkFrames{ 0 };
 		int m_BenchmarkCurrFrame{ 0 };
 		std::vector<float> m_Benchmarks{};
+		std::string m_BenchmarkDescription{};
 	};
 }
@@ -1,6 +1,9 @@
 #pragma once
+#include <bit>
+#include <cassert>
 #include <complex.h>
 #include <fstream>
+#include <immintrin.h>
 #include "Maths.h"
 #include "DataTypes.h"
 
@@ -8,30 +11,487 @@ namespace dae
 {
 	namespace GeometryUtils
 	{
-		inline bool SlabTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
+		// Ray data shared by every node test during one traversal
+		struct TraversalRay
 		{
-			float tx1 = (mesh.transformedMinAABB.x - ray.origin.x) / ray.direction.x;
-			float tx2 = (mesh.transformedMaxAABB.x - ray.origin.x) / ray.direction.x;
+			float originX, originY, originZ;
+			float inverseX, inverseY, inverseZ;
 
-			float tmin = std::min(tx1, tx2);
-			float tmax = std::max(tx1, tx2);
+			// Row in WideBVHNode::bounds of the near and far plane per axis, based on the direction sign
+			int nearX, nearY, nearZ;
+			int farX, farY, farZ;
 
-			float ty1 = (mesh.transformedMinAABB.y - ray.origin.y) / ray.direction.y;
-			float ty2 = (mesh.transformedMaxAABB.y - ray.origin.y) / ray.direction.y;
+			explicit TraversalRay(const Ray& ray) :
+				originX{ ray.origin.x }, originY{ ray.origin.y }, originZ{ ray.origin.z },
+				inverseX{ 1.f / ray.direction.x }, inverseY{ 1.f / ray.direction.y }, inverseZ{ 1.f / ray.direction.z },
+				nearX{ inverseX < 0.f ? 3 : 0 }, nearY{ inverseY < 0.f ? 4 : 1 }, nearZ{ inverseZ < 0.f ? 5 : 2 },
+				farX{ inverseX < 0.f ? 0 : 3 }, farY{ inverseY < 0.f ? 1 : 4 }, farZ{ inverseZ < 0.f ? 2 : 5 }
+			{
+			}
+		};
+
+		/**
+		 * \brief Slab test of one ray against every child of a wide BVH node at once
+		 * \param entryDistances receives the entry distance of every child
+		 * \return bitmask with a bit set for every child the ray overlaps within [ray.min, ray.max]
+		 */
+		inline uint32_t SlabTest_WideBVHNode(const WideBVHNode& node, const TraversalRay& traversalRay, float rayMin, float rayMax, float* entryDistances)
+		{
+#if defined(__AVX__)
+			const __m256 inverseX = _mm256_set1_ps(traversalRay.inverseX);
+			const __m256 inverseY = _mm256_set1_ps(traversalRay.inverseY);
+			const __m256 inverseZ = _mm256_set1_ps(traversalRay.inverseZ);
+			const __m256 originX = _mm256_set1_ps(traversalRay.originX);
+			const __m256 originY = _mm256_set1_ps(traversalRay.originY);
+			const __m256 originZ = _mm256_set1_ps(traversalRay.originZ);
+
+			const __m256 nearX = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[traversalRay.nearX]), originX), inverseX);
+			const __m256 nearY = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[traversalRay.nearY]), originY), inverseY);
+			const __m256 nearZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[traversalRay.nearZ]), originZ), inverseZ);
+			const __m256 farX = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[traversalRay.farX]), originX), inverseX);
+			const __m256 farY = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[traversalRay.farY]), originY), inverseY);
+			const __m256 farZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[traversalRay.farZ]), originZ), inverseZ);
+
+			const __m256 entry = _mm256_max_ps(_mm256_max_ps(nearX, nearY), _mm256_max_ps(nearZ, _mm256_set1_ps(rayMin)));
+			const __m256 exit = _mm256_min_ps(_mm256_min_ps(farX, farY), _mm256_min_ps(farZ, _mm256_set1_ps(rayMax)));
+
+			_mm256_storeu_ps(entryDistances, entry);
+			return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ)));
+#else
+			const __m128 inverseX = _mm_set1_ps(traversalRay.inverseX);
+			const __m128 inverseY = _mm_set1_ps(traversalRay.inverseY);
+			const __m128 inverseZ = _mm_set1_ps(traversalRay.inverseZ);
+			const __m128 originX = _mm_set1_ps(traversalRay.originX);
+			const __m128 originY = _mm_set1_ps(traversalRay.originY);
+			const __m128 originZ = _mm_set1_ps(traversalRay.originZ);
+
+			const __m128 nearX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[traversalRay.nearX]), originX), inverseX);
+			const __m128 nearY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[traversalRay.nearY]), originY), inverseY);
+			const __m128 nearZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[traversalRay.nearZ]), originZ), inverseZ);
+			const __m128 farX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[traversalRay.farX]), originX), inverseX);
+			const __m128 farY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[traversalRay.farY]), originY), inverseY);
+			const __m128 farZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[traversalRay.farZ]), originZ), inverseZ);
+
+			const __m128 entry = _mm_max_ps(_mm_max_ps(nearX, nearY), _mm_max_ps(nearZ, _mm_set1_ps(rayMin)));
+			const __m128 exit = _mm_min_ps(_mm_min_ps(farX, farY), _mm_min_ps(farZ, _mm_set1_ps(rayMax)));
+
+			_mm_storeu_ps(entryDistances, entry);
+			return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(entry, exit)));
+#endif
+		}
+
+		inline void Prefetch_WideBVHNode(const WideBVHNode& node)
+		{
+			const char* pNode = reinterpret_cast<const char*>(&node);
+			for (size_t offset{ 0 }; offset < sizeof(WideBVHNode); offset += 64)
+				_mm_prefetch(pNode + offset, _MM_HINT_T0);
+		}
+
+		/**
+		 * \brief Walks a BVH front to back and calls leafTest for every leaf the ray passes through
+		 * \param ray ray to traverse with, leafTest is expected to shrink ray.max on a closer hit
+		 * \param leafTest bool(uint32_t first, uint32_t count, Ray& ray) over the range [first, first + count) of
+		 * BVH::GetPrimitiveIndices(), returns true on a hit
+		 * \tparam AnyHit stop at the first hit, used for shadow rays
+		 * \param rootIndex wide node to start at, packet traversal hands single rays a subtree
+		 * \return true if any leaf reported a hit
+		 */
+		template<bool AnyHit, typename LeafTest>
+		bool Traverse_BVHLeaves(const BVH& bvh, Ray& ray, LeafTest&& leafTest, uint32_t rootIndex = 0)
+		{
+			const std::vector<WideBVHNode>& nodes = bvh.GetWideNodes();
+
+			if (nodes.empty())
+				return false;
+
+			const TraversalRay traversalRay{ ray };
+
+			struct StackEntry
+			{
+				uint32_t index;  // Wide node index, or first primitive for leaves
+				uint32_t primitiveCount;  // 0 for inner nodes
+				float entryDistance;
+			};
+
+			TraversalStack<StackEntry> stack{};
+			stack.Push({ rootIndex, 0, ray.min });
+
+			bool didHit{ false };
+			while (!stack.IsEmpty())
+			{
+				const StackEntry entry = stack.Pop();
+
+				// A closer hit was found after this entry got pushed
+				if (entry.entryDistance > ray.max)
+					continue;
+
+				if (entry.primitiveCount > 0)
+				{
+					if (leafTest(entry.index, entry.primitiveCount, ray))
+					{
+						didHit = true;
+						if constexpr (AnyHit)
+							return true;
+					}
+					continue;
+				}
+
+				const WideBVHNode& node = nodes[entry.index];
+
+				alignas(32) float entryDistances[WideBVHWidth];
+				uint32_t hitMask = SlabTest_WideBVHNode(node, traversalRay, ray.min, ray.max, entryDistances);
+				if (hitMask == 0)
+					continue;
+
+				// Sort the hit children far to near (insertion sort, at most WideBVHWidth elements),
+				// pushing them in that order pops the nearest child first.
+				// Any hit queries stop at the first occluder wherever it lies, they visit the child most likely to hold one first instead:
+				// the one with the largest bounds, as the chance a ray hits a box grows with its surface area
+				float sortKeys[WideBVHWidth];
+				uint32_t sortedSlots[WideBVHWidth];
+				uint32_t hitCount{ 0 };
+				while (hitMask != 0)
+				{
+					const auto slot = static_cast<uint32_t>(std::countr_zero(hitMask));
+					hitMask &= hitMask - 1;
+
+					if constexpr (AnyHit)
+					{
+						const float extentX{ node.bounds[3][slot] - node.bounds[0][slot] };
+						const float extentY{ node.bounds[4][slot] - node.bounds[1][slot] };
+						const float extentZ{ node.bounds[5][slot] - node.bounds[2][slot] };
+						sortKeys[slot] = -(extentX * extentY + extentY * extentZ + extentZ * extentX);
+					}
+					else
+					{
+						sortKeys[slot] = entryDistances[slot];
+					}
+
+					uint32_t position{ hitCount++ };
+					while (position > 0 && sortKeys[sortedSlots[position - 1]] < sortKeys[slot])
+					{
+						sortedSlots[position] = sortedSlots[position - 1];
+						--position;
+					}
+					sortedSlots[position] = slot;
+				}
+
+				for (uint32_t i{ 0 }; i < hitCount; ++i)
+				{
+					const uint32_t slot = sortedSlots[i];
+					stack.Push({ node.children[slot], node.primitiveCounts[slot], entryDistances[slot] });
+				}
+
+				// The top child gets popped right away, too soon for a prefetch to land. The next inner child below it
+				// only gets visited once the top child's leaf or whole subtree is done, start loading that one
+				for (uint32_t i{ stack.GetSize() - 1 }; i > stack.GetSize() - hitCount; --i)
+				{
+					const StackEntry& later = stack[i - 1];
+					if (later.primitiveCount == 0)
+					{
+						Prefetch_WideBVHNode(nodes[later.index]);
+						break;
+					}
+				}
+			}
+
+			return didHit;
+		}
+		/**
+		 * \brief Walks a BVH front to back and calls primitiveTest for every primitive in the leaves the ray passes through
+		 * \param primitiveTest bool(uint32_t primitiveIndex, Ray& ray), returns true on a hit and shrinks ray.max
+		 * \tparam AnyHit stop at the first hit, used for shadow rays
+		 * \return true if any primitive was hit
+		 */
+		template<bool AnyHit, typename PrimitiveTest>
+		bool Traverse_BVH(const BVH& bvh, Ray& ray, PrimitiveTest&& primitiveTest)
+		{
+			const std::vector<uint32_t>& primitiveIndices = bvh.GetPrimitiveIndices();
+
+			return Traverse_BVHLeaves<AnyHit>(bvh, ray, [&](uint32_t first, uint32_t count, Ray& currentRay)
+			{
+				bool didHit{ false };
+				for (uint32_t i{ first }; i < first + count; ++i)
+				{
+					if (primitiveTest(primitiveIndices[i], currentRay))
+					{
+						didHit = true;
+						if constexpr (AnyHit)
+							return true;
+					}
+				}
+
+				return didHit;
+			});
+		}
+
+#pragma region Primitive Blocks
+		struct BlockHit
+		{
+			uint32_t lane;
+			float t;
+		};
+
+#if defined(__AVX__)
+		// Ray broadcast to every lane once per query
+		struct BlockRay
+		{
+			__m256 originX, originY, originZ;
+			__m256 directionX, directionY, directionZ;
+			__m256 directionSqrMagnitude;
+
+			explicit BlockRay(const Ray& ray) :
+				originX{ _mm256_set1_ps(ray.origin.x) }, originY{ _mm256_set1_ps(ray.origin.y) }, originZ{ _mm256_set1_ps(ray.origin.z) },
+				directionX{ _mm256_set1_ps(ray.direction.x) }, directionY{ _mm256_set1_ps(ray.direction.y) }, directionZ{ _mm256_set1_ps(ray.direction.z) },
+				directionSqrMagnitude{ _mm256_set1_ps(ray.direction.SqrMagnitude()) }
+			{
+			}
+		};
+
+		inline __m256 LaneRangeMask(uint32_t laneBegin, uint32_t laneEnd)
+		{
+			const __m256 laneIndex = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+			return _mm256_and_ps(
+				_mm256_cmp_ps(laneIndex, _mm256_set1_ps(static_cast<float>(laneBegin)), _CMP_GE_OQ),
+				_mm256_cmp_ps(laneIndex, _mm256_set1_ps(static_cast<float>(laneEnd)), _CMP_LT_OQ));
+		}
+
+		// First lane holding the smallest t among the valid lanes, at least one lane has to be valid
+		inline uint32_t SelectNearestLane(__m256 t, __m256 valid)
+		{
+			const __m256 hitDistances = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t, valid);
+			__m256 nearest = _mm256_min_ps(hitDistances, _mm256_permute2f128_ps(hitDistances, hitDistances, 1));
+			nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+			nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+
+			const int nearestMask = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(hitDistances, nearest, _CMP_EQ_OQ), valid));
+			return static_cast<uint32_t>(std::countr_zero(static_cast<uint32_t>(nearestMask)));
+		}
+
+		inline float GetLane(__m256 values, uint32_t lane)
+		{
+			alignas(32) float lanes[PrimitiveBlockWidth];
+			_mm256_store_ps(lanes, values);
+			return lanes[lane];
+		}
+#else
+		struct BlockRay
+		{
+			const Ray& ray;
+
+			explicit BlockRay(const Ray& _ray) : ray{ _ray } {}
+		};
+#endif
+#pragma endregion
+#pragma region Ray Packets
+		// SoA copy of a packet's rays, so one child box gets tested against every ray of the packet at once
+		struct PacketTraversalRays
+		{
+			alignas(32) float originX[PrimitiveBlockWidth], originY[PrimitiveBlockWidth], originZ[PrimitiveBlockWidth];
+			alignas(32) float inverseX[PrimitiveBlockWidth], inverseY[PrimitiveBlockWidth], inverseZ[PrimitiveBlockWidth];
+			alignas(32) float rayMin[PrimitiveBlockWidth], rayMax[PrimitiveBlockWidth];
+
+			PacketTraversalRays(const RayPacket& packet, uint32_t laneMask)
+			{
+				for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
+				{
+					const Ray& ray = packet.rays[lane];
+					originX[lane] = ray.origin.x;
+					originY[lane] = ray.origin.y;
+					originZ[lane] = ray.origin.z;
+					inverseX[lane] = 1.f / ray.direction.x;
+					inverseY[lane] = 1.f / ray.direction.y;
+					inverseZ[lane] = 1.f / ray.direction.z;
+					rayMin[lane] = ray.min;
+
+					// Unused lanes get an empty interval and never hit anything
+					rayMax[lane] = (laneMask >> lane & 1) != 0 ? ray.max : -FLT_MAX;
+				}
+			}
+		};
+
+		/**
+		 * \brief Slab test of every ray of a packet against one child box of a wide BVH node
+		 * \param nearestEntry receives the smallest entry distance of the rays that hit
+		 * \return bitmask with a bit set for every lane in laneMask that overlaps the box within [rayMin, rayMax]
+		 */
+		inline uint32_t SlabTest_Packet(const WideBVHNode& node, uint32_t slot, const PacketTraversalRays& rays, uint32_t laneMask, float& nearestEntry)
+		{
+			alignas(32) float entryDistances[PrimitiveBlockWidth];
+			uint32_t hitMask{ 0 };
+
+#if defined(__AVX__)
+			// The rays may point in different directions, so near and far plane are picked per lane
+			__m256 entry = _mm256_load_ps(rays.rayMin);
+			__m256 exit = _mm256_load_ps(rays.rayMax);
+			const auto slab = [&](int axis, const float* origin, const float* inverse)
+			{
+				const __m256 originLanes = _mm256_load_ps(origin);
+				const __m256 inverseLanes = _mm256_load_ps(inverse);
+				const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds[axis][slot]), originLanes), inverseLanes);
+				const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bounds[axis + 3][slot]), originLanes), inverseLanes);
+				entry = _mm256_max_ps(entry, _mm256_min_ps(t0, t1));
+				exit = _mm256_min_ps(exit, _mm256_max_ps(t0, t1));
+			};
+
+			slab(0, rays.originX, rays.inverseX);
+			slab(1, rays.originY, rays.inverseY);
+			slab(2, rays.originZ, rays.inverseZ);
 
-			tmin = std::max(tmin, std::min(ty1, ty2));
-			tmax = std::min(tmax, std::max(ty1, ty2));
+			_mm256_store_ps(entryDistances, entry);
+			hitMask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ))) & laneMask;
+#else
+			const float* origins[3]{ rays.originX, rays.originY, rays.originZ };
+			const float* inverses[3]{ rays.inverseX, rays.inverseY, rays.inverseZ };
+			for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
+			{
+				float entry{ rays.rayMin[lane] }, exit{ rays.rayMax[lane] };
+				for (int axis{ 0 }; axis < 3; ++axis)
+				{
+					const float t0{ (node.bounds[axis][slot] - origins[axis][lane]) * inverses[axis][lane] };
+					const float t1{ (node.bounds[axis + 3][slot] - origins[axis][lane]) * inverses[axis][lane] };
+					entry = std::max(entry, std::min(t0, t1));
+					exit = std::min(exit, std::max(t0, t1));
+				}
+
+				entryDistances[lane] = entry;
+				if (entry <= exit)
+					hitMask |= 1u << lane;
+			}
+			hitMask &= laneMask;
+#endif
+
+			nearestEntry = FLT_MAX;
+			for (uint32_t lanes{ hitMask }; lanes != 0; lanes &= lanes - 1)
+				nearestEntry = std::min(nearestEntry, entryDistances[std::countr_zero(lanes)]);
+
+			return hitMask;
+		}
+
+		/**
+		 * \brief Walks a BVH front to back with a whole packet of rays. Every node gets fetched once and tested against
+		 * all rays that reached it. A subtree only one ray reaches is finished by that ray alone with Traverse_BVHLeaves.
+		 * \param laneMask rays of the packet to trace, bit i for packet.rays[i]
+		 * \param leafTest uint32_t(uint32_t first, uint32_t count, uint32_t laneMask, RayPacket& packet), tests the lanes
+		 * in laneMask against the leaf, shrinks the max of every ray that hit and returns those lanes
+		 * \return bitmask of the lanes that hit anything
+		 */
+		template<typename LeafTest>
+		uint32_t Traverse_BVHLeavesPacket(const BVH& bvh, RayPacket& packet, uint32_t laneMask, LeafTest&& leafTest)
+		{
+			const std::vector<WideBVHNode>& nodes = bvh.GetWideNodes();
+
+			if (nodes.empty() || laneMask == 0)
+				return 0;
+
+			PacketTraversalRays traversalRays{ packet, laneMask };
+
+			struct StackEntry
+			{
+				uint32_t index;  // Wide node index, or first primitive for leaves
+				uint32_t primitiveCount;  // 0 for inner nodes
+				uint32_t laneMask;  // Rays that hit the node's box
+				float entryDistance;  // Nearest entry over those rays
+			};
+
+			TraversalStack<StackEntry> stack{};
+			stack.Push({ 0, 0, laneMask, -FLT_MAX });
+
+			uint32_t hitMask{ 0 };
+			while (!stack.IsEmpty())
+			{
+				const StackEntry entry = stack.Pop();
+
+				// Drop the rays that found a closer hit after this entry got pushed
+				uint32_t activeMask{ 0 };
+				for (uint32_t lanes{ entry.laneMask }; lanes != 0; lanes &= lanes - 1)
+				{
+					const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+					if (entry.entryDistance <= traversalRays.rayMax[lane])
+						activeMask |= 1u << lane;
+				}
+
+				if (activeMask == 0)
+					continue;
+
+				if (entry.primitiveCount > 0)
+				{
+					hitMask |= leafTest(entry.index, entry.primitiveCount, activeMask, packet);
+
+					for (uint32_t lanes{ activeMask }; lanes != 0; lanes &= lanes - 1)
+					{
+						const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+						traversalRays.rayMax[lane] = packet.rays[lane].max;
+					}
+					continue;
+				}
+
+				// The packet diverged, a lone ray is faster with the single ray traversal
+				if (std::has_single_bit(activeMask))
+				{
+					const auto lane = static_cast<uint32_t>(std::countr_zero(activeMask));
+					const auto singleLeafTest = [&](uint32_t first, uint32_t count, Ray&)
+					{
+						return leafTest(first, count, activeMask, packet) != 0;
+					};
+
+					if (Traverse_BVHLeaves<false>(bvh, packet.rays[lane], singleLeafTest, entry.index))
+						hitMask |= activeMask;
+
+					traversalRays.rayMax[lane] = packet.rays[lane].max;
+					continue;
+				}
+
+				const WideBVHNode& node = nodes[entry.index];
+
+				float entryDistances[WideBVHWidth];
+				uint32_t childMasks[WideBVHWidth];
+				uint32_t sortedSlots[WideBVHWidth];
+				uint32_t hitCount{ 0 };
+				for (uint32_t slot{ 0 }; slot < WideBVHWidth; ++slot)
+				{
+					// Empty slots have inverted bounds, which picking the planes per lane would turn into a valid interval
+					if (node.bounds[0][slot] > node.bounds[3][slot])
+						continue;
 
-			float tz1 = (mesh.transformedMinAABB.z - ray.origin.z) / ray.direction.z;
-			float tz2 = (mesh.transformedMaxAABB.z - ray.origin.z) / ray.direction.z;
+					childMasks[slot] = SlabTest_Packet(node, slot, traversalRays, activeMask, entryDistances[slot]);
+					if (childMasks[slot] == 0)
+						continue;
 
-			tmin = std::max(tmin, std::min(tz1, tz2));
-			tmax = std::min(tmax, std::max(tz1, tz2));
-			
-			return tmax > 0 && tmax >= tmin;
+					// Far to near, pushing them in that order pops the nearest child first
+					uint32_t position{ hitCount++ };
+					while (position > 0 && entryDistances[sortedSlots[position - 1]] < entryDistances[slot])
+					{
+						sortedSlots[position] = sortedSlots[position - 1];
+						--position;
+					}
+					sortedSlots[position] = slot;
+				}
+
+				for (uint32_t i{ 0 }; i < hitCount; ++i)
+				{
+					const uint32_t slot = sortedSlots[i];
+					stack.Push({ node.children[slot], node.primitiveCounts[slot], childMasks[slot], entryDistances[slot] });
+				}
+			}
+
+			return hitMask;
 		}
+#pragma endregion
 #pragma region Sphere HitTest
 		//SPHERE HIT-TESTS
+		inline void FillSphereHitRecord(const Sphere& sphere, const Ray& ray, float t, HitRecord& hitRecord)
+		{
+			const Vector3 hitLocation{ ray.origin + (ray.direction * t) };
+
+			hitRecord.didHit = true;
+			hitRecord.origin = hitLocation;
+			hitRecord.materialIndex = sphere.materialIndex;
+			hitRecord.receivesShadow = sphere.receivesShadow;
+			hitRecord.t = t;
+			hitRecord.normal = (hitLocation - sphere.origin).Normalized();
+		}
+
 		inline bool HitTest_Sphere(const Sphere& sphere, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
 		{
 			// Implemented the simplified sphere hit test calculation from raytracing in a weekend
@@ -40,9 +500,11 @@ namespace dae
 
 			const float a = ray.direction.SqrMagnitude();
 			const float b = Vector3::Dot(ray.direction, SphereRayVec);
-			const float c = SphereRayVec.SqrMagnitude() - (sphere.radius * sphere.radius);
 
-			const float discriminant = Square(b) - (a * c);
+			// b^2 - ac cancels out for small spheres far along the ray, a * (r^2 - |l|^2) is the same value without the cancellation,
+			// l being the offset of the center from the ray's closest point to it (Ray Tracing Gems, chapter 7)
+			const Vector3 closestOffset{ SphereRayVec - ray.direction * (b / a) };
+			const float discriminant = a * ((sphere.radius * sphere.radius) - closestOffset.SqrMagnitude());
 
 			if (discriminant <= 0)
 				return false;
@@ -59,17 +521,96 @@ namespace dae
 			}
 
 			if(!ignoreHitRecord)
+				FillSphereHitRecord(sphere, ray, t, hitRecord);
+
+			return true;
+		}
+
+		/**
+		 * \brief Tests one ray against the lanes [laneBegin, laneEnd) of a sphere block at once, with the same math as HitTest_Sphere.
+		 * 8-wide with AVX, a scalar loop over the lanes otherwise
+		 * \param hit receives the nearest hit lane
+		 * \return true if any of the lanes got hit within [rayMin, rayMax]
+		 */
+		inline bool Intersect_SphereBlock(const SphereBlock& block, const BlockRay& blockRay, float rayMin, float rayMax,
+			uint32_t laneBegin, uint32_t laneEnd, BlockHit& hit)
+		{
+#if defined(__AVX__)
+			const __m256 sphereRayX = _mm256_sub_ps(_mm256_load_ps(block.center[0]), blockRay.originX);
+			const __m256 sphereRayY = _mm256_sub_ps(_mm256_load_ps(block.center[1]), blockRay.originY);
+			const __m256 sphereRayZ = _mm256_sub_ps(_mm256_load_ps(block.center[2]), blockRay.originZ);
+
+			const __m256 a = blockRay.directionSqrMagnitude;
+			const __m256 b = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(blockRay.directionX, sphereRayX), _mm256_mul_ps(blockRay.directionY, sphereRayY)), _mm256_mul_ps(blockRay.directionZ, sphereRayZ));
+
+			// Cancellation free discriminant, see HitTest_Sphere
+			const __m256 bOverA = _mm256_div_ps(b, a);
+			const __m256 closestOffsetX = _mm256_sub_ps(sphereRayX, _mm256_mul_ps(blockRay.directionX, bOverA));
+			const __m256 closestOffsetY = _mm256_sub_ps(sphereRayY, _mm256_mul_ps(blockRay.directionY, bOverA));
+			const __m256 closestOffsetZ = _mm256_sub_ps(sphereRayZ, _mm256_mul_ps(blockRay.directionZ, bOverA));
+			const __m256 closestOffsetSqr = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(closestOffsetX, closestOffsetX), _mm256_mul_ps(closestOffsetY, closestOffsetY)), _mm256_mul_ps(closestOffsetZ, closestOffsetZ));
+
+			const __m256 discriminant = _mm256_mul_ps(a, _mm256_sub_ps(_mm256_load_ps(block.radiusSquared), closestOffsetSqr));
+			__m256 valid = _mm256_and_ps(LaneRangeMask(laneBegin, laneEnd), _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+			if (_mm256_movemask_ps(valid) == 0)
+				return false;
+
+			// Near root unless it lies outside the ray, then the far one
+			const __m256 minimum = _mm256_set1_ps(rayMin);
+			const __m256 maximum = _mm256_set1_ps(rayMax);
+			const __m256 squareD = _mm256_sqrt_ps(discriminant);
+			const __m256 tNear = _mm256_div_ps(_mm256_sub_ps(b, squareD), a);
+			const __m256 tFar = _mm256_div_ps(_mm256_add_ps(b, squareD), a);
+			const __m256 nearInRange = _mm256_and_ps(_mm256_cmp_ps(tNear, minimum, _CMP_GE_OQ), _mm256_cmp_ps(tNear, maximum, _CMP_LE_OQ));
+			const __m256 t = _mm256_blendv_ps(tFar, tNear, nearInRange);
+
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, minimum, _CMP_GE_OQ), _mm256_cmp_ps(t, maximum, _CMP_LE_OQ)));
+			if (_mm256_movemask_ps(valid) == 0)
+				return false;
+
+			hit.lane = SelectNearestLane(t, valid);
+			hit.t = GetLane(t, hit.lane);
+			return true;
+#else
+			const Ray& ray = blockRay.ray;
+
+			bool didHit{ false };
+			for (uint32_t lane{ laneBegin }; lane < laneEnd; ++lane)
 			{
-				const Vector3 hitLocation{ ray.origin + (ray.direction * t) };
+				const Vector3 sphereRayVec{ block.center[0][lane] - ray.origin.x, block.center[1][lane] - ray.origin.y, block.center[2][lane] - ray.origin.z };
+
+				const float a = ray.direction.SqrMagnitude();
+				const float b = Vector3::Dot(ray.direction, sphereRayVec);
 
-				hitRecord.didHit = true;
-				hitRecord.origin = hitLocation;
-				hitRecord.materialIndex = sphere.materialIndex;
-				hitRecord.t = t;
-				hitRecord.normal = (hitLocation - sphere.origin).Normalized();
+				// Cancellation free discriminant, see HitTest_Sphere. Empty lanes end up with a negative infinite one
+				const Vector3 closestOffset{ sphereRayVec - ray.direction * (b / a) };
+				const float discriminant = a * (block.radiusSquared[lane] - closestOffset.SqrMagnitude());
+				if (!(discriminant > 0.f))
+					continue;
+
+				const float squareD = sqrt(discriminant);
+				float t = (b - squareD) / a;
+				if (t < rayMin || t > rayMax)
+				{
+					t = (b + squareD) / a;
+					if (t < rayMin || t > rayMax)
+						continue;
+				}
+
+				// Ties keep the first lane, like the SIMD path
+				if (didHit && t >= hit.t)
+					continue;
+
+				hit = { lane, t };
+				rayMax = t;
+				didHit = true;
 			}
 
-			return true;
+			return didHit;
+#endif
 		}
 
 		inline bool HitTest_Sphere(const Sphere& sphere, const Ray& ray)
@@ -80,6 +621,16 @@ namespace dae
 #pragma endregion
 #pragma region Plane HitTest
 		//PLANE HIT-TESTS
+		inline void FillPlaneHitRecord(const Plane& plane, const Ray& ray, float t, HitRecord& hitRecord)
+		{
+			hitRecord.t = t;
+			hitRecord.materialIndex = plane.materialIndex;
+			hitRecord.receivesShadow = plane.receivesShadow;
+			hitRecord.didHit = true;
+			hitRecord.origin = ray.origin + ray.direction * t;
+			hitRecord.normal = plane.normal;
+		}
+
 		inline bool HitTest_Plane(const Plane& plane, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
 		{
 			const Vector3 rayToPlane{ plane.origin - ray.origin };
@@ -90,15 +641,57 @@ namespace dae
 				return false;
 
 			if (!ignoreHitRecord)
+				FillPlaneHitRecord(plane, ray, t, hitRecord);
+
+			return true;
+		}
+
+		/**
+		 * \brief Tests one ray against every lane of a plane block at once. Rays parallel to a plane and empty lanes
+		 * give an infinite or NaN distance and never hit. 8-wide with AVX, a scalar loop over the lanes otherwise
+		 * \param hit receives the nearest hit lane
+		 * \return true if any of the lanes got hit within [rayMin, rayMax]
+		 */
+		inline bool Intersect_PlaneBlock(const PlaneBlock& block, const BlockRay& blockRay, float rayMin, float rayMax, BlockHit& hit)
+		{
+#if defined(__AVX__)
+			const __m256 normalX = _mm256_load_ps(block.normal[0]);
+			const __m256 normalY = _mm256_load_ps(block.normal[1]);
+			const __m256 normalZ = _mm256_load_ps(block.normal[2]);
+
+			const __m256 originDistance = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(normalX, blockRay.originX), _mm256_mul_ps(normalY, blockRay.originY)), _mm256_mul_ps(normalZ, blockRay.originZ));
+			const __m256 normDotDirect = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(normalX, blockRay.directionX), _mm256_mul_ps(normalY, blockRay.directionY)), _mm256_mul_ps(normalZ, blockRay.directionZ));
+			const __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_load_ps(block.distance), originDistance), normDotDirect);
+
+			const __m256 valid = _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(rayMin), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(rayMax), _CMP_LE_OQ));
+			if (_mm256_movemask_ps(valid) == 0)
+				return false;
+
+			hit.lane = SelectNearestLane(t, valid);
+			hit.t = GetLane(t, hit.lane);
+			return true;
+#else
+			const Ray& ray = blockRay.ray;
+
+			bool didHit{ false };
+			for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
 			{
-				hitRecord.t = t;
-				hitRecord.materialIndex = plane.materialIndex;
-				hitRecord.didHit = true;
-				hitRecord.origin = ray.origin + ray.direction * t;
-				hitRecord.normal = plane.normal;
+				const Vector3 normal{ block.normal[0][lane], block.normal[1][lane], block.normal[2][lane] };
+				const float t{ (block.distance[lane] - Vector3::Dot(normal, ray.origin)) / Vector3::Dot(normal, ray.direction) };
+
+				// Written so NaN fails as well, ties keep the first lane like the SIMD path
+				if (!(t >= rayMin && t <= rayMax) || (didHit && t >= hit.t))
+					continue;
+
+				hit = { lane, t };
+				rayMax = t;
+				didHit = true;
 			}
 
-			return true;
+			return didHit;
+#endif
 		}
 
 		inline bool HitTest_Plane(const Plane& plane, const Ray& ray)
@@ -108,82 +701,346 @@ namespace dae
 		}
 #pragma endregion
 #pragma region Triangle HitTest
-		//TRIANGLE HIT-TESTS
-		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		// Cull rules shared by every kernel, any hit queries are shadow rays and cull the opposite side
+		template<TriangleCullMode CullMode, bool AnyHit>
+		bool IsTriangleCulled(float normDotDirect)
 		{
-			const float normDotDirect = Vector3::Dot(triangle.normal, ray.direction);
+			if constexpr (CullMode == TriangleCullMode::BackFaceCulling)
+				return AnyHit ? normDotDirect < 0.f : normDotDirect > 0.f;
+			else if constexpr (CullMode == TriangleCullMode::FrontFaceCulling)
+				return AnyHit ? normDotDirect > 0.f : normDotDirect <= 0.f;
+			else
+				return false;
+		}
 
-			if(AreEqual(normDotDirect, 0.f))
+		inline bool IsTriangleCulled(TriangleCullMode cullMode, float normDotDirect, bool isShadowRay)
+		{
+			switch (cullMode)
+			{
+			case TriangleCullMode::BackFaceCulling:
+				return isShadowRay ? normDotDirect < 0.f : normDotDirect > 0.f;
+			case TriangleCullMode::FrontFaceCulling:
+				return isShadowRay ? normDotDirect > 0.f : normDotDirect <= 0.f;
+			default:
 				return false;
+			}
+		}
 
-			// Inverse if ignoreHitRecord is true,
-			// ignoreHitRecord is mostly used for shadows
-			if(ignoreHitRecord)
+		/**
+		 * \brief Turns a cull mode and query type known at runtime into template arguments, once per mesh instead of once per triangle
+		 * \param kernel generic lambda taking <TriangleCullMode CullMode, bool AnyHit> as template parameters
+		 */
+		template<typename Kernel>
+		decltype(auto) DispatchTriangleKernel(TriangleCullMode cullMode, bool anyHit, Kernel&& kernel)
+		{
+			const auto withCullMode = [&]<bool AnyHit>() -> decltype(auto)
 			{
-				switch (triangle.cullMode)
+				switch (cullMode)
 				{
 				case TriangleCullMode::BackFaceCulling:
-					if (normDotDirect < 0.f)
-						return false;
-					break;
+					return kernel.template operator()<TriangleCullMode::BackFaceCulling, AnyHit>();
 				case TriangleCullMode::FrontFaceCulling:
-					if (normDotDirect > 0.f)
-						return false;
-					break;
+					return kernel.template operator()<TriangleCullMode::FrontFaceCulling, AnyHit>();
+				default:
+					return kernel.template operator()<TriangleCullMode::NoCulling, AnyHit>();
 				}
+			};
+
+			return anyHit ? withCullMode.template operator()<true>() : withCullMode.template operator()<false>();
+		}
+
+		// Distance, facing and barycentric weights of v1 (u) and v2 (v) of a ray/triangle hit
+		struct TriangleHit
+		{
+			float t;
+			float normDotDirect;
+			float u, v;
+		};
+
+		/**
+		 * \brief Moller-Trumbore ray/triangle test on a precomputed record, culling with CullMode instead of the record's cull mode
+		 * \param hit receives the distance, the facing (its sign tells the side that got hit) and the barycentrics
+		 */
+		template<TriangleCullMode CullMode, bool AnyHit>
+		bool Intersect_MollerTrumbore(const TriangleRecord& triangle, const Ray& ray, TriangleHit& hit)
+		{
+			const float normDotDirect = Vector3::Dot(triangle.normal, ray.direction);
+			if (AreEqual(normDotDirect, 0.f) || IsTriangleCulled<CullMode, AnyHit>(normDotDirect))
+				return false;
+
+			const Vector3 pVector = Vector3::Cross(ray.direction, triangle.edge2);
+			const float determinant = Vector3::Dot(triangle.edge1, pVector);
+			if (determinant == 0.f)
+				return false;
+
+			const float inverseDeterminant = 1.f / determinant;
+			const Vector3 tVector = ray.origin - triangle.v0;
+
+			const float u = Vector3::Dot(tVector, pVector) * inverseDeterminant;
+			if (u < 0.f || u > 1.f)
+				return false;
+
+			const Vector3 qVector = Vector3::Cross(tVector, triangle.edge1);
+			const float v = Vector3::Dot(ray.direction, qVector) * inverseDeterminant;
+			if (v < 0.f || u + v > 1.f)
+				return false;
+
+			const float t = Vector3::Dot(triangle.edge2, qVector) * inverseDeterminant;
+			if (t < ray.min || t > ray.max)
+				return false;
+
+			hit = { t, normDotDirect, u, v };
+			return true;
+		}
+
+		inline bool Intersect_MollerTrumbore(const TriangleRecord& triangle, const Ray& ray, bool isShadowRay, TriangleHit& hit)
+		{
+			return DispatchTriangleKernel(triangle.cullMode, isShadowRay, [&]<TriangleCullMode CullMode, bool AnyHit>()
+			{
+				return Intersect_MollerTrumbore<CullMode, AnyHit>(triangle, ray, hit);
+			});
+		}
+
+		// Per ray setup of the watertight test, the ray gets sheared so it points down the +z axis
+		struct WatertightRay
+		{
+			int axisX, axisY, axisZ;
+			float shearX, shearY, shearZ;
+
+			explicit WatertightRay(const Ray& ray)
+			{
+				const float absX{ std::abs(ray.direction.x) }, absY{ std::abs(ray.direction.y) }, absZ{ std::abs(ray.direction.z) };
+				axisZ = absX > absY ? (absX > absZ ? 0 : 2) : (absY > absZ ? 1 : 2);
+				axisX = (axisZ + 1) % 3;
+				axisY = (axisX + 1) % 3;
+
+				// Keep the winding of the triangle intact
+				if (GetAxis(ray.direction, axisZ) < 0.f)
+					std::swap(axisX, axisY);
+
+				shearZ = 1.f / GetAxis(ray.direction, axisZ);
+				shearX = GetAxis(ray.direction, axisX) * shearZ;
+				shearY = GetAxis(ray.direction, axisY) * shearZ;
 			}
-			else
+
+			static float GetAxis(const Vector3& v, int axis)
 			{
-				switch (triangle.cullMode)
-				{
-				case TriangleCullMode::BackFaceCulling:
-					if (normDotDirect > 0.f)
-						return false;
-					break;
-				case TriangleCullMode::FrontFaceCulling:
-					if (normDotDirect <=0.f)
-						return false;
-					break;
-				}
+				return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
 			}
+		};
 
-			const Vector3 rayToTriangle = triangle.v0 - ray.origin;
+		/**
+		 * \brief Watertight ray/triangle test (Woop, Benthin, Wald 2013). The record only provides the normal and cull mode:
+		 * the vertices have to be the mesh's own (TriangleMesh::GetTriangleVertex), neighbouring triangles then transform
+		 * their shared vertices to the exact same values and no ray slips through between them
+		 */
+		template<TriangleCullMode CullMode, bool AnyHit>
+		bool Intersect_Watertight(const TriangleRecord& triangle, const Vector3& v0, const Vector3& v1, const Vector3& v2,
+			const Ray& ray, const WatertightRay& watertightRay, TriangleHit& hit)
+		{
+			// No epsilon on the facing here, grazing rays still hit and the edge tests alone decide
+			const float normDotDirect = Vector3::Dot(triangle.normal, ray.direction);
+			if (IsTriangleCulled<CullMode, AnyHit>(normDotDirect))
+				return false;
 
-			float t = Vector3::Dot(rayToTriangle, triangle.normal) / normDotDirect;
+			const Vector3 a = v0 - ray.origin;
+			const Vector3 b = v1 - ray.origin;
+			const Vector3 c = v2 - ray.origin;
 
-			if (t < ray.min || t > ray.max)
+			const auto getAxis = &WatertightRay::GetAxis;
+			const float aZ = getAxis(a, watertightRay.axisZ), bZ = getAxis(b, watertightRay.axisZ), cZ = getAxis(c, watertightRay.axisZ);
+			const float aX = getAxis(a, watertightRay.axisX) - watertightRay.shearX * aZ;
+			const float aY = getAxis(a, watertightRay.axisY) - watertightRay.shearY * aZ;
+			const float bX = getAxis(b, watertightRay.axisX) - watertightRay.shearX * bZ;
+			const float bY = getAxis(b, watertightRay.axisY) - watertightRay.shearY * bZ;
+			const float cX = getAxis(c, watertightRay.axisX) - watertightRay.shearX * cZ;
+			const float cY = getAxis(c, watertightRay.axisY) - watertightRay.shearY * cZ;
+
+			// Edge functions in double: the float products are exact there, so an FMA the compiler contracts them into
+			// rounds the same way, and a shared edge gives its two triangles exactly opposite values
+			const float u = static_cast<float>(static_cast<double>(cX) * bY - static_cast<double>(cY) * bX);
+			const float v = static_cast<float>(static_cast<double>(aX) * cY - static_cast<double>(aY) * cX);
+			const float w = static_cast<float>(static_cast<double>(bX) * aY - static_cast<double>(bY) * aX);
+
+			if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+				return false;
+
+			const float determinant = u + v + w;
+			if (determinant == 0.f)
 				return false;
 
-			const Vector3 hitPoint = ray.origin + (ray.direction * t);
+			const float scaledDistance = (u * aZ + v * bZ + w * cZ) * watertightRay.shearZ;
+			const float t = scaledDistance / determinant;
+			if (t < ray.min || t > ray.max)
+				return false;
 
-			// Placing the vertices inside an array, easier to loop over
-			const Vector3 vertices[]{triangle.v0, triangle.v1, triangle.v2};
+			// u weights v0, v and w the other two vertices
+			hit = { t, normDotDirect, v / determinant, w / determinant };
+			return true;
+		}
 
-			// Looping over the vertices to check if the ray is outside the triangle
-			for (size_t i{0}; i < std::size(vertices); i++)
+		inline bool Intersect_Watertight(const TriangleRecord& triangle, const Vector3& v0, const Vector3& v1, const Vector3& v2,
+			const Ray& ray, const WatertightRay& watertightRay, bool isShadowRay, TriangleHit& hit)
+		{
+			return DispatchTriangleKernel(triangle.cullMode, isShadowRay, [&]<TriangleCullMode CullMode, bool AnyHit>()
 			{
-				// Calculating the next index
-				const uint32_t nextIdx = (i + 1) % std::size(vertices);
+				return Intersect_Watertight<CullMode, AnyHit>(triangle, v0, v1, v2, ray, watertightRay, hit);
+			});
+		}
 
-				const Vector3 e = vertices[nextIdx] - vertices[i];
-				const Vector3 pVector = hitPoint - vertices[i];
+		inline void FillTriangleHitRecord(const TriangleRecord& triangle, const Ray& ray, float t, float normDotDirect, HitRecord& hitRecord)
+		{
+			hitRecord.t = t;
+			hitRecord.materialIndex = triangle.materialIndex;
+			hitRecord.didHit = true;
+			hitRecord.origin = ray.origin + ray.direction * t;
 
-				if (Vector3::Dot(Vector3::Cross(e, pVector), triangle.normal) < 0.f)
-					return false;
+			// If the ray hits the backface of the triangle, the normal of the hitrecord is inverted. This
+			// will cast the right lights on the backface of the triangle.
+			hitRecord.normal = (normDotDirect > 0.f) ? -triangle.normal : triangle.normal;
+		}
+
+		struct TriangleBlockHit
+		{
+			uint32_t lane;
+			float t;
+			float normDotDirect;
+			float u, v;
+		};
+
+		/**
+		 * \brief Moller-Trumbore test of one ray against the lanes [laneBegin, laneEnd) of a triangle block at once,
+		 * with the same cull rules as the single triangle kernels. 8-wide with AVX, a scalar loop over the lanes otherwise
+		 * \param hit receives the nearest hit lane
+		 * \return true if any of the lanes got hit within [rayMin, rayMax]
+		 */
+		template<TriangleCullMode CullMode, bool AnyHit>
+		bool Intersect_TriangleBlock(const TriangleBlock& block, const BlockRay& blockRay, float rayMin, float rayMax,
+			uint32_t laneBegin, uint32_t laneEnd, TriangleBlockHit& hit)
+		{
+#if defined(__AVX__)
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 one = _mm256_set1_ps(1.f);
+
+			const __m256 normalX = _mm256_load_ps(block.normal[0]);
+			const __m256 normalY = _mm256_load_ps(block.normal[1]);
+			const __m256 normalZ = _mm256_load_ps(block.normal[2]);
+			const __m256 normDotDirect = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(normalX, blockRay.directionX), _mm256_mul_ps(normalY, blockRay.directionY)), _mm256_mul_ps(normalZ, blockRay.directionZ));
+
+			// Lane range and AreEqual(normDotDirect, 0.f) first
+			__m256 valid = LaneRangeMask(laneBegin, laneEnd);
+			const __m256 absNormDotDirect = _mm256_andnot_ps(_mm256_set1_ps(-0.f), normDotDirect);
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(absNormDotDirect, _mm256_set1_ps(FLT_EPSILON), _CMP_GE_OQ));
+
+			// normDotDirect is never 0 here, so each cull rule keeps either the negative or the positive side
+			if constexpr (CullMode != TriangleCullMode::NoCulling)
+			{
+				constexpr bool keepNegative{ (CullMode == TriangleCullMode::BackFaceCulling) != AnyHit };
+				valid = _mm256_and_ps(valid, _mm256_cmp_ps(normDotDirect, zero, keepNegative ? _CMP_LT_OQ : _CMP_GT_OQ));
 			}
 
-			if(!ignoreHitRecord)
+			if (_mm256_movemask_ps(valid) == 0)
+				return false;
+
+			const __m256 edge1X = _mm256_load_ps(block.edge1[0]);
+			const __m256 edge1Y = _mm256_load_ps(block.edge1[1]);
+			const __m256 edge1Z = _mm256_load_ps(block.edge1[2]);
+			const __m256 edge2X = _mm256_load_ps(block.edge2[0]);
+			const __m256 edge2Y = _mm256_load_ps(block.edge2[1]);
+			const __m256 edge2Z = _mm256_load_ps(block.edge2[2]);
+
+			// pVector = direction x edge2
+			const __m256 pX = _mm256_sub_ps(_mm256_mul_ps(blockRay.directionY, edge2Z), _mm256_mul_ps(edge2Y, blockRay.directionZ));
+			const __m256 pY = _mm256_sub_ps(_mm256_mul_ps(edge2X, blockRay.directionZ), _mm256_mul_ps(blockRay.directionX, edge2Z));
+			const __m256 pZ = _mm256_sub_ps(_mm256_mul_ps(blockRay.directionX, edge2Y), _mm256_mul_ps(edge2X, blockRay.directionY));
+
+			const __m256 determinant = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(edge1X, pX), _mm256_mul_ps(edge1Y, pY)), _mm256_mul_ps(edge1Z, pZ));
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ));
+			const __m256 inverseDeterminant = _mm256_div_ps(one, determinant);
+
+			const __m256 tX = _mm256_sub_ps(blockRay.originX, _mm256_load_ps(block.v0[0]));
+			const __m256 tY = _mm256_sub_ps(blockRay.originY, _mm256_load_ps(block.v0[1]));
+			const __m256 tZ = _mm256_sub_ps(blockRay.originZ, _mm256_load_ps(block.v0[2]));
+
+			const __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(tX, pX), _mm256_mul_ps(tY, pY)), _mm256_mul_ps(tZ, pZ)), inverseDeterminant);
+
+			// qVector = tVector x edge1
+			const __m256 qX = _mm256_sub_ps(_mm256_mul_ps(tY, edge1Z), _mm256_mul_ps(edge1Y, tZ));
+			const __m256 qY = _mm256_sub_ps(_mm256_mul_ps(edge1X, tZ), _mm256_mul_ps(tX, edge1Z));
+			const __m256 qZ = _mm256_sub_ps(_mm256_mul_ps(tX, edge1Y), _mm256_mul_ps(edge1X, tY));
+
+			const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(blockRay.directionX, qX), _mm256_mul_ps(blockRay.directionY, qY)), _mm256_mul_ps(blockRay.directionZ, qZ)), inverseDeterminant);
+			const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(edge2X, qX), _mm256_mul_ps(edge2Y, qY)), _mm256_mul_ps(edge2Z, qZ)), inverseDeterminant);
+
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(rayMin), _CMP_GE_OQ));
+			valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(rayMax), _CMP_LE_OQ));
+
+			if (_mm256_movemask_ps(valid) == 0)
+				return false;
+
+			hit.lane = SelectNearestLane(t, valid);
+			hit.t = GetLane(t, hit.lane);
+			hit.normDotDirect = GetLane(normDotDirect, hit.lane);
+			hit.u = GetLane(u, hit.lane);
+			hit.v = GetLane(v, hit.lane);
+			return true;
+#else
+			const Ray& ray = blockRay.ray;
+
+			bool didHit{ false };
+			for (uint32_t lane{ laneBegin }; lane < laneEnd; ++lane)
 			{
-				hitRecord.t = t;
-				hitRecord.materialIndex = triangle.materialIndex;
-				hitRecord.didHit = true;
-				hitRecord.origin = hitPoint;
+				TriangleRecord triangle{};
+				triangle.v0 = { block.v0[0][lane], block.v0[1][lane], block.v0[2][lane] };
+				triangle.edge1 = { block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane] };
+				triangle.edge2 = { block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane] };
+				triangle.normal = { block.normal[0][lane], block.normal[1][lane], block.normal[2][lane] };
+
+				const Ray laneRay{ ray.origin, ray.direction, rayMin, rayMax };
 
-				// If the ray hits the backface of the triangle, the normal of the hitrecord is inverted. This
-				// will cast the right lights on the backface of the triangle.
-				hitRecord.normal = (normDotDirect > 0.f) ? -triangle.normal : triangle.normal;
+				TriangleHit laneHit{};
+				// Ties keep the first lane, like the SIMD path
+				if (!Intersect_MollerTrumbore<CullMode, AnyHit>(triangle, laneRay, laneHit) || (didHit && laneHit.t >= hit.t))
+					continue;
+
+				hit = { lane, laneHit.t, laneHit.normDotDirect, laneHit.u, laneHit.v };
+				rayMax = laneHit.t;
+				didHit = true;
 			}
 
+			return didHit;
+#endif
+		}
+
+		inline bool Intersect_TriangleBlock(const TriangleBlock& block, const BlockRay& blockRay, float rayMin, float rayMax,
+			TriangleCullMode cullMode, bool isShadowRay, uint32_t laneBegin, uint32_t laneEnd, TriangleBlockHit& hit)
+		{
+			return DispatchTriangleKernel(cullMode, isShadowRay, [&]<TriangleCullMode CullMode, bool AnyHit>()
+			{
+				return Intersect_TriangleBlock<CullMode, AnyHit>(block, blockRay, rayMin, rayMax, laneBegin, laneEnd, hit);
+			});
+		}
+
+		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			const TriangleRecord record{ triangle };
+
+			TriangleHit hit{};
+			if (!Intersect_MollerTrumbore(record, ray, ignoreHitRecord, hit))
+				return false;
+
+			// ignoreHitRecord is mostly used for shadows
+			if (!ignoreHitRecord)
+				FillTriangleHitRecord(record, ray, hit.t, hit.normDotDirect, hitRecord);
+
 			return true;
 		}
 
@@ -194,62 +1051,185 @@ namespace dae
 		}
 #pragma endregion
 #pragma region TriangeMesh HitTest
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		/**
+		 * \brief Closest or any hit against the triangles in the leaf slots [first, first + count) of a mesh, with the ray already in object space.
+		 * Moller-Trumbore meshes test whole blocks of triangles stored in BVH leaf order
+		 * \param closestHit receives the triangle, distance and barycentrics of closer hits, or of the first hit for any hit queries
+		 * \return true on a hit
+		 */
+		template<TriangleIntersector Intersector, TriangleCullMode CullMode, bool AnyHit>
+		bool HitTest_TriangleLeaf(const TriangleMesh& mesh, uint32_t first, uint32_t count, Ray& objectRay,
+			const BlockRay& blockRay, const WatertightRay& watertightRay, PrimitiveHit& closestHit)
 		{
-			// Slabtest first, check if ray is inside
-			// the AABB box of the current mesh
-			if(!SlabTest_TriangleMesh(mesh, ray))
+			const std::vector<TriangleRecord>& triangleRecords = mesh.triangleRecords;
+			const std::vector<uint32_t>& primitiveIndices = mesh.bvh.GetPrimitiveIndices();
+
+			bool didHit{ false };
+			const uint32_t end{ first + count };
+
+			if constexpr (Intersector == TriangleIntersector::MollerTrumbore)
 			{
-				return false;
+				const std::vector<TriangleBlock>& triangleBlocks = mesh.triangleBlocks;
+				for (uint32_t blockStart{ first - first % PrimitiveBlockWidth }; blockStart < end; blockStart += PrimitiveBlockWidth)
+				{
+					const uint32_t laneBegin{ first > blockStart ? first - blockStart : 0 };
+					const uint32_t laneEnd{ std::min(end - blockStart, PrimitiveBlockWidth) };
+
+					TriangleBlockHit hit{};
+					if (!Intersect_TriangleBlock<CullMode, AnyHit>(triangleBlocks[blockStart / PrimitiveBlockWidth], blockRay,
+						objectRay.min, objectRay.max, laneBegin, laneEnd, hit))
+						continue;
+
+					// Without a BVH the blocks are in plain triangle order
+					const uint32_t slot{ blockStart + hit.lane };
+					const uint32_t triangleIndex{ primitiveIndices.empty() ? slot : primitiveIndices[slot] };
+
+					// For shadows, it isn't necessary to keep track of the closest hit
+					closestHit = { hit.t, closestHit.objectIndex, triangleIndex, hit.u, hit.v, HitObjectType::Triangle };
+					didHit = true;
+					if constexpr (AnyHit)
+						return true;
+
+					objectRay.max = hit.t;
+				}
 			}
+			else
+			{
+				for (uint32_t slot{ first }; slot < end; ++slot)
+				{
+					const uint32_t triangleIndex{ primitiveIndices.empty() ? slot : primitiveIndices[slot] };
+
+					TriangleHit hit{};
+					if (!Intersect_Watertight<CullMode, AnyHit>(triangleRecords[triangleIndex], mesh.GetTriangleVertex(triangleIndex, 0),
+						mesh.GetTriangleVertex(triangleIndex, 1), mesh.GetTriangleVertex(triangleIndex, 2), objectRay, watertightRay, hit))
+						continue;
+
+					closestHit = { hit.t, closestHit.objectIndex, triangleIndex, hit.u, hit.v, HitObjectType::Triangle };
+					didHit = true;
+					if constexpr (AnyHit)
+						return true;
 
-			const std::vector<int>& indices = mesh.indices;
+					objectRay.max = hit.t;
+				}
+			}
 
-			// Creating the triangle once, for performance reasons
-			Triangle temp{};
+			return didHit;
+		}
 
-			// Applying the default settings for each triangle before looping over them,
-			// better performance
-			temp.cullMode = mesh.cullMode;
-			temp.materialIndex = mesh.materialIndex;
+		/**
+		 * \brief Closest or any hit against the triangle records of a mesh, with the ray already in object space
+		 * \return true on a hit, closestHit receives the closest hit or for any hit queries the first one found
+		 */
+		template<TriangleIntersector Intersector, TriangleCullMode CullMode, bool AnyHit>
+		bool HitTest_TriangleRecords(const TriangleMesh& mesh, Ray& objectRay, PrimitiveHit& closestHit)
+		{
+			assert(mesh.triangleRecords.size() == mesh.indices.size() / 3 && "Call UpdateTriangleRecords() or BuildBVH() after editing a mesh");
 
-			HitRecord closestHit{};
+			const BlockRay blockRay{ objectRay };
+			const WatertightRay watertightRay{ objectRay };
 
-			for (size_t i{}; i < mesh.indices.size(); i += 3)
+			const auto testLeaf = [&](uint32_t first, uint32_t count, Ray& currentRay)
 			{
-				// Calculating the which indices we have to pick for each vertex
-				const int v0Index = indices[i];
-				const int v1Index = indices[i + 1];
-				const int v2Index = indices[i + 2];
-
-				// 
-				temp.v0 = mesh.transformedPositions[v0Index];
-				temp.v1 = mesh.transformedPositions[v1Index];
-				temp.v2 = mesh.transformedPositions[v2Index];
+				return HitTest_TriangleLeaf<Intersector, CullMode, AnyHit>(mesh, first, count, currentRay, blockRay, watertightRay, closestHit);
+			};
 
-				if(i != 0)
-					temp.normal = mesh.transformedNormals[i / 3];
-				else
-					temp.normal = mesh.transformedNormals[i];
+			if (!mesh.bvh.IsEmpty())
+				return Traverse_BVHLeaves<AnyHit>(mesh.bvh, objectRay, testLeaf);
 
+			// Linear fallback for meshes without a BVH
+			return testLeaf(0, static_cast<uint32_t>(mesh.triangleRecords.size()), objectRay);
+		}
 
+		// Packet version of HitTest_TriangleRecords for closest hits, returns the lanes that hit
+		template<TriangleIntersector Intersector, TriangleCullMode CullMode>
+		uint32_t HitTest_TriangleRecords(const TriangleMesh& mesh, RayPacket& objectPacket, uint32_t laneMask, PrimitiveHit* closestHits)
+		{
+			assert(mesh.triangleRecords.size() == mesh.indices.size() / 3 && "Call UpdateTriangleRecords() or BuildBVH() after editing a mesh");
 
-				if(HitTest_Triangle(temp, ray, closestHit, ignoreHitRecord))
+			const auto testLeaf = [&](uint32_t first, uint32_t count, uint32_t leafLanes, RayPacket& packet)
+			{
+				uint32_t hitMask{ 0 };
+				for (uint32_t lanes{ leafLanes }; lanes != 0; lanes &= lanes - 1)
 				{
-					if(!ignoreHitRecord)  // Retrieve the closest hit
-					{
-						if(closestHit.t < hitRecord.t)
-							hitRecord = closestHit;
-					}
-					else  // For shadows, it isn't necessary to keep track of the closes hit
-					{
-						return true;
-					}
+					const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+					Ray& ray = packet.rays[lane];
+
+					const BlockRay blockRay{ ray };
+					const WatertightRay watertightRay{ ray };
+					if (HitTest_TriangleLeaf<Intersector, CullMode, false>(mesh, first, count, ray, blockRay, watertightRay, closestHits[lane]))
+						hitMask |= 1u << lane;
 				}
+				return hitMask;
+			};
+
+			if (!mesh.bvh.IsEmpty())
+				return Traverse_BVHLeavesPacket(mesh.bvh, objectPacket, laneMask, testLeaf);
+
+			return testLeaf(0, static_cast<uint32_t>(mesh.triangleRecords.size()), laneMask, objectPacket);
+		}
+
+		// DispatchTriangleKernel for the triangles of a mesh, kernel takes <TriangleIntersector, TriangleCullMode, bool AnyHit>
+		template<typename Kernel>
+		decltype(auto) DispatchTriangleMeshKernel(const TriangleMesh& mesh, bool anyHit, Kernel&& kernel)
+		{
+			return DispatchTriangleKernel(mesh.cullMode, anyHit, [&]<TriangleCullMode CullMode, bool AnyHit>() -> decltype(auto)
+			{
+				if (mesh.intersector == TriangleIntersector::Watertight)
+					return kernel.template operator()<TriangleIntersector::Watertight, CullMode, AnyHit>();
+				return kernel.template operator()<TriangleIntersector::MollerTrumbore, CullMode, AnyHit>();
+			});
+		}
+
+		// World space hit record of one triangle of a mesh, ray is the world space ray that hit it at t
+		inline void FillTriangleMeshHitRecord(const TriangleMesh& mesh, uint32_t triangleIndex, const Ray& ray, float t, HitRecord& hitRecord)
+		{
+			// The object space normal faces the ray the same way as the world space one
+			const TriangleRecord& triangle = mesh.triangleRecords[triangleIndex];
+			const float normDotDirect{ Vector3::Dot(triangle.normal, mesh.worldToObject.TransformVector(ray.direction)) };
+
+			FillTriangleHitRecord(triangle, ray, t, normDotDirect, hitRecord);
+			hitRecord.normal = mesh.normalToWorld.TransformVector(hitRecord.normal).Normalized();
+			hitRecord.receivesShadow = mesh.receivesShadow;
+		}
+
+		/**
+		 * \brief Closest or any hit against a mesh, only hits closer than closestHit.t are accepted
+		 * \param closestHit receives the triangle index, distance and barycentrics, objectIndex is left to the caller
+		 */
+		template<bool AnyHit = false>
+		bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, PrimitiveHit& closestHit)
+		{
+			// Intersect in object space, the direction is left unnormalized so t means the same in both spaces
+			Ray objectRay{
+				mesh.worldToObject.TransformPoint(ray.origin),
+				mesh.worldToObject.TransformVector(ray.direction),
+				ray.min,
+				std::min(ray.max, closestHit.t)
+			};
+
+			return DispatchTriangleMeshKernel(mesh, AnyHit, [&]<TriangleIntersector Intersector, TriangleCullMode CullMode, bool IsAnyHit>()
+			{
+				return HitTest_TriangleRecords<Intersector, CullMode, IsAnyHit>(mesh, objectRay, closestHit);
+			});
+		}
+
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			if (ignoreHitRecord)
+			{
+				PrimitiveHit unused{};
+				return HitTest_TriangleMesh<true>(mesh, ray, unused);
 			}
 
+			// Only hits closer than the one already stored in the hitrecord are accepted
+			PrimitiveHit closestHit{};
+			closestHit.t = hitRecord.t;
+			if (!HitTest_TriangleMesh(mesh, ray, closestHit))
+				return hitRecord.didHit;
 
-			return hitRecord.didHit;
+			// Only the winning hit is brought back to world space
+			FillTriangleMeshHitRecord(mesh, closestHit.primitiveIndex, ray, closestHit.t, hitRecord);
+			return true;
 		}
 
 		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
@@ -257,6 +1237,101 @@ namespace dae
 			HitRecord temp{};
 			return HitTest_TriangleMesh(mesh, ray, temp, true);
 		}
+
+		/**
+		 * \brief Closest hits of the lanes in laneMask against a mesh, traversing its BVH with the whole packet
+		 * \param closestHits one per lane, only hits closer than the stored ones are accepted
+		 * \return bitmask of the lanes whose hit got replaced
+		 */
+		inline uint32_t HitTest_TriangleMesh(const TriangleMesh& mesh, const RayPacket& packet, uint32_t laneMask, PrimitiveHit* closestHits)
+		{
+			RayPacket objectPacket{};
+			for (uint32_t lanes{ laneMask }; lanes != 0; lanes &= lanes - 1)
+			{
+				const auto lane = static_cast<uint32_t>(std::countr_zero(lanes));
+				const Ray& ray = packet.rays[lane];
+				objectPacket.rays[lane] = {
+					mesh.worldToObject.TransformPoint(ray.origin),
+					mesh.worldToObject.TransformVector(ray.direction),
+					ray.min,
+					std::min(ray.max, closestHits[lane].t)
+				};
+			}
+
+			return DispatchTriangleMeshKernel(mesh, false, [&]<TriangleIntersector Intersector, TriangleCullMode CullMode, bool AnyHit>()
+			{
+				return HitTest_TriangleRecords<Intersector, CullMode>(mesh, objectPacket, laneMask, closestHits);
+			});
+		}
+#pragma endregion
+#pragma region SphereCloud HitTest
+		inline void FillSphereCloudHitRecord(const SphereCloud& cloud, uint32_t sphereIndex, const Ray& ray, float t, HitRecord& hitRecord)
+		{
+			const Vector4 sphere{ cloud.GetSphere(sphereIndex) };
+			FillSphereHitRecord(Sphere{ { sphere.x, sphere.y, sphere.z }, sphere.w, cloud.materialIndex, cloud.castsShadow, cloud.receivesShadow }, ray, t, hitRecord);
+		}
+
+		/**
+		 * \brief Closest or any hit against a sphere cloud, every leaf gets decoded into sphere blocks for the SIMD kernel
+		 * \param closestHit receives the sphere index and distance of closer hits or of the first hit for any hit queries,
+		 * objectIndex is left to the caller
+		 * \return true on a hit
+		 */
+		template<bool AnyHit = false>
+		bool HitTest_SphereCloud(const SphereCloud& cloud, const Ray& ray, PrimitiveHit& closestHit)
+		{
+			const BlockRay blockRay{ ray };
+
+			const auto testLeaf = [&](uint32_t first, uint32_t count, Ray& currentRay)
+			{
+				bool didHit{ false };
+
+				const uint32_t end{ first + count };
+				for (uint32_t blockStart{ first }; blockStart < end; blockStart += PrimitiveBlockWidth)
+				{
+					const uint32_t laneCount{ std::min(end - blockStart, PrimitiveBlockWidth) };
+
+					SphereBlock block{};
+					cloud.LoadSphereBlock(blockStart, laneCount, block);
+
+					BlockHit hit{};
+					if (!Intersect_SphereBlock(block, blockRay, currentRay.min, currentRay.max, 0, laneCount, hit))
+						continue;
+
+					closestHit = { hit.t, closestHit.objectIndex, blockStart + hit.lane, 0.f, 0.f, HitObjectType::SphereCloud };
+					didHit = true;
+					if constexpr (AnyHit)
+						return true;
+
+					currentRay.max = hit.t;
+				}
+
+				return didHit;
+			};
+
+			Ray cloudRay{ ray };
+			cloudRay.max = std::min(ray.max, closestHit.t);
+			return Traverse_BVHLeaves<AnyHit>(cloud.bvh, cloudRay, testLeaf);
+		}
+
+		inline bool HitTest_SphereCloud(const SphereCloud& cloud, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			PrimitiveHit closestHit{};
+			if (ignoreHitRecord)
+				return HitTest_SphereCloud<true>(cloud, ray, closestHit);
+
+			if (!HitTest_SphereCloud(cloud, ray, closestHit))
+				return false;
+
+			FillSphereCloudHitRecord(cloud, closestHit.primitiveIndex, ray, closestHit.t, hitRecord);
+			return true;
+		}
+
+		inline bool HitTest_SphereCloud(const SphereCloud& cloud, const Ray& ray)
+		{
+			HitRecord temp{};
+			return HitTest_SphereCloud(cloud, ray, temp, true);
+		}
 #pragma endregion
 	}
 
@@ -0,0 +1,302 @@
+#include "VisibilityBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Scene.h"
+#include "Utils.h"
+
+using namespace dae;
+
+template<typename SampleTest>
+void VisibilityBuffer::ForEachSample(const PixelRect& rect, SampleTest&& test) const
+{
+	for (uint32_t py{ rect.minY }; py < rect.maxY; ++py)
+	{
+		const size_t rowStart{ (static_cast<size_t>(py - m_Y) * m_Width + (rect.minX - m_X)) * m_SampleCount };
+		const size_t rowEnd{ rowStart + static_cast<size_t>(rect.maxX - rect.minX) * m_SampleCount };
+		for (size_t sampleIndex{ rowStart }; sampleIndex < rowEnd; ++sampleIndex)
+			test(sampleIndex);
+	}
+}
+
+void VisibilityBuffer::Rasterize(const Scene& scene, const View& view, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+	uint32_t sampleCount, const Vector3* rayDirections)
+{
+	m_View = view;
+	m_X = x;
+	m_Y = y;
+	m_Width = width;
+	m_Height = height;
+	m_SampleCount = sampleCount;
+	m_Samples.assign(static_cast<size_t>(width) * height * sampleCount, PrimitiveHit{});
+
+	const Matrix worldToCamera{ Matrix::Inverse(view.cameraToWorld) };
+	const float rayMin{ Ray{}.min };
+
+	// Same mapping and margin as Renderer::CalculateTaskFrustum, each mesh moves it into object space to cull its BVH
+	const auto cornerDirection = [&](float rx, float ry)
+	{
+		const float cx{ (2 * (rx / float(view.screenWidth)) - 1) * view.aspectRatio * view.fov };
+		const float cy{ (1 - (2 * (ry / float(view.screenHeight)))) * view.fov };
+		return view.cameraToWorld.TransformVector(cx, cy, 1);
+	};
+
+	const float left{ static_cast<float>(x) - 1.f }, right{ static_cast<float>(x + width) + 1.f };
+	const float top{ static_cast<float>(y) - 1.f }, bottom{ static_cast<float>(y + height) + 1.f };
+	m_FrustumCorners[0] = cornerDirection(left, top);
+	m_FrustumCorners[1] = cornerDirection(right, top);
+	m_FrustumCorners[2] = cornerDirection(right, bottom);
+	m_FrustumCorners[3] = cornerDirection(left, bottom);
+
+	// Planes are unbounded and cover every sample
+	const std::vector<Plane>& planes = scene.GetPlaneGeometries();
+	for (uint32_t planeIndex{ 0 }; planeIndex < planes.size(); ++planeIndex)
+	{
+		const Plane& plane = planes[planeIndex];
+		const float distance{ Vector3::Dot(plane.origin - view.origin, plane.normal) };
+
+		ForEachSample({ x, y, x + width, y + height }, [&](size_t sampleIndex)
+		{
+			// Same math as HitTest_Plane, rays parallel to the plane give NaN or infinity and fail the range test
+			const float t{ distance / Vector3::Dot(rayDirections[sampleIndex], plane.normal) };
+
+			PrimitiveHit& sample = m_Samples[sampleIndex];
+			if (t >= rayMin && t < sample.t)
+				sample = { t, planeIndex, 0, 0.f, 0.f, HitObjectType::Plane };
+		});
+	}
+
+	const std::vector<Sphere>& spheres = scene.GetSphereGeometries();
+	for (uint32_t sphereIndex{ 0 }; sphereIndex < spheres.size(); ++sphereIndex)
+	{
+		const Sphere& sphere = spheres[sphereIndex];
+		const Vector3 extent{ sphere.radius, sphere.radius, sphere.radius };
+		const PixelRect rect{ ProjectBox(worldToCamera, sphere.origin - extent, sphere.origin + extent) };
+		if (rect.IsEmpty())
+			continue;
+
+		const Vector3 sphereRayVec{ sphere.origin - view.origin };
+		const float radiusSquared{ sphere.radius * sphere.radius };
+
+		ForEachSample(rect, [&](size_t sampleIndex)
+		{
+			// Same math as HitTest_Sphere, the far root only counts when the camera is inside the sphere
+			const Vector3& direction = rayDirections[sampleIndex];
+			const float a{ direction.SqrMagnitude() };
+			const float b{ Vector3::Dot(direction, sphereRayVec) };
+			const Vector3 closestOffset{ sphereRayVec - direction * (b / a) };
+			const float discriminant{ a * (radiusSquared - closestOffset.SqrMagnitude()) };
+			if (discriminant <= 0.f)
+				return;
+
+			const float squareD{ std::sqrt(discriminant) };
+			float t{ (b - squareD) / a };
+			if (t < rayMin)
+				t = (b + squareD) / a;
+
+			PrimitiveHit& sample = m_Samples[sampleIndex];
+			if (t >= rayMin && t < sample.t)
+				sample = { t, sphereIndex, 0, 0.f, 0.f, HitObjectType::Sphere };
+		});
+	}
+
+	for (uint32_t meshIndex{ 0 }; meshIndex < scene.GetTriangleMeshes().size(); ++meshIndex)
+		RasterizeMesh(scene, meshIndex, worldToCamera, rayDirections);
+
+	// A cloud can hold far more spheres than it covers samples, so its samples trace the cloud's own BVH instead
+	const std::vector<SphereCloud>& sphereClouds = scene.GetSphereClouds();
+	for (uint32_t cloudIndex{ 0 }; cloudIndex < sphereClouds.size(); ++cloudIndex)
+	{
+		const SphereCloud& cloud = sphereClouds[cloudIndex];
+		const PixelRect rect{ ProjectBox(worldToCamera, cloud.minAABB, cloud.maxAABB) };
+		if (rect.IsEmpty())
+			continue;
+
+		ForEachSample(rect, [&](size_t sampleIndex)
+		{
+			PrimitiveHit& sample = m_Samples[sampleIndex];
+			if (GeometryUtils::HitTest_SphereCloud(cloud, Ray{ view.origin, rayDirections[sampleIndex], rayMin, sample.t }, sample))
+				sample.objectIndex = cloudIndex;
+		});
+	}
+}
+
+bool VisibilityBuffer::Resolve(const Scene& scene, size_t sampleIndex, const Ray& ray, HitRecord& hitRecord) const
+{
+	const PrimitiveHit& sample = m_Samples[sampleIndex];
+	if (!sample.DidHit())
+		return false;
+
+	scene.MaterializeHit(sample, ray, hitRecord);
+	return true;
+}
+
+VisibilityBuffer::PixelRect VisibilityBuffer::ProjectPoints(const Vector3* cameraPoints, size_t pointCount) const
+{
+	float minX{ FLT_MAX }, minY{ FLT_MAX }, maxX{ -FLT_MAX }, maxY{ -FLT_MAX };
+	size_t behindCount{ 0 };
+	for (size_t i{ 0 }; i < pointCount; ++i)
+	{
+		const Vector3& point = cameraPoints[i];
+		if (point.z <= 0.f)
+		{
+			++behindCount;
+			continue;
+		}
+
+		// Inverse of the screen to camera mapping of the primary rays
+		const float screenX{ (point.x / point.z / (m_View.aspectRatio * m_View.fov) + 1.f) * .5f * static_cast<float>(m_View.screenWidth) };
+		const float screenY{ (1.f - point.y / point.z / m_View.fov) * .5f * static_cast<float>(m_View.screenHeight) };
+		minX = std::min(minX, screenX);
+		minY = std::min(minY, screenY);
+		maxX = std::max(maxX, screenX);
+		maxY = std::max(maxY, screenY);
+	}
+
+	// Every ray points away from the camera, nothing behind it can be hit
+	if (behindCount == pointCount)
+		return { 0, 0, 0, 0 };
+
+	// Part of the primitive reaches around the camera, its projection is unbounded
+	if (behindCount > 0)
+		return { m_X, m_Y, m_X + m_Width, m_Y + m_Height };
+
+	// A pixel of margin covers every sample position inside the border pixels and the rounding of both mappings
+	const auto clampX = [this](float value) { return static_cast<uint32_t>(std::clamp(value, static_cast<float>(m_X), static_cast<float>(m_X + m_Width))); };
+	const auto clampY = [this](float value) { return static_cast<uint32_t>(std::clamp(value, static_cast<float>(m_Y), static_cast<float>(m_Y + m_Height))); };
+	return { clampX(std::floor(minX) - 1.f), clampY(std::floor(minY) - 1.f), clampX(std::ceil(maxX) + 1.f), clampY(std::ceil(maxY) + 1.f) };
+}
+
+VisibilityBuffer::PixelRect VisibilityBuffer::ProjectBox(const Matrix& worldToCamera, const Vector3& minAABB, const Vector3& maxAABB) const
+{
+	Vector3 corners[8];
+	for (int i{ 0 }; i < 8; ++i)
+	{
+		corners[i] = worldToCamera.TransformPoint(
+			(i & 1) != 0 ? maxAABB.x : minAABB.x,
+			(i & 2) != 0 ? maxAABB.y : minAABB.y,
+			(i & 4) != 0 ? maxAABB.z : minAABB.z);
+	}
+
+	return ProjectPoints(corners, 8);
+}
+
+void VisibilityBuffer::RasterizeMesh(const Scene& scene, uint32_t meshIndex, const Matrix& worldToCamera, const Vector3* rayDirections)
+{
+	const TriangleMesh& mesh = scene.GetTriangleMeshes()[meshIndex];
+	const PixelRect meshRect{ ProjectBox(worldToCamera, mesh.transformedMinAABB, mesh.transformedMaxAABB) };
+	if (meshRect.IsEmpty())
+		return;
+
+	// The triangles stay in object space like for the ray tracer, the camera, the frustum and the rays get transformed instead
+	const Vector3 objectOrigin{ mesh.worldToObject.TransformPoint(m_View.origin) };
+	Vector3 objectCorners[4];
+	for (int i{ 0 }; i < 4; ++i)
+		objectCorners[i] = mesh.worldToObject.TransformVector(m_FrustumCorners[i]);
+
+	CullTriangles(mesh, Frustum::FromCorners(objectOrigin, objectCorners));
+	if (m_VisibleTriangles.empty())
+		return;
+
+	m_ObjectDirections.resize(m_Samples.size());
+	ForEachSample(meshRect, [&](size_t sampleIndex)
+	{
+		m_ObjectDirections[sampleIndex] = mesh.worldToObject.TransformVector(rayDirections[sampleIndex]);
+	});
+
+	const Matrix objectToCamera{ Matrix::Inverse(mesh.worldToObject) * worldToCamera };
+	const float rayMin{ Ray{}.min };
+	for (const uint32_t triangleIndex : m_VisibleTriangles)
+	{
+		const Vector3& v0 = mesh.GetTriangleVertex(triangleIndex, 0);
+		const Vector3& v1 = mesh.GetTriangleVertex(triangleIndex, 1);
+		const Vector3& v2 = mesh.GetTriangleVertex(triangleIndex, 2);
+		const Vector3 cameraPoints[3]{ objectToCamera.TransformPoint(v0), objectToCamera.TransformPoint(v1), objectToCamera.TransformPoint(v2) };
+
+		// Only the mesh's rectangle has object space directions
+		PixelRect rect{ ProjectPoints(cameraPoints, 3) };
+		rect.minX = std::max(rect.minX, meshRect.minX);
+		rect.minY = std::max(rect.minY, meshRect.minY);
+		rect.maxX = std::min(rect.maxX, meshRect.maxX);
+		rect.maxY = std::min(rect.maxY, meshRect.maxY);
+		if (rect.IsEmpty())
+			continue;
+
+		// Edge functions through the camera: a ray hits the triangle when it lies on the same side of the three planes
+		// spanned by the camera and each edge. The weights are the unnormalized barycentrics of the hit
+		const TriangleRecord& triangle = mesh.triangleRecords[triangleIndex];
+		const Vector3 a{ v0 - objectOrigin };
+		const Vector3 b{ v1 - objectOrigin };
+		const Vector3 c{ v2 - objectOrigin };
+		const Vector3 edgeBC{ Vector3::Cross(b, c) }, edgeCA{ Vector3::Cross(c, a) }, edgeAB{ Vector3::Cross(a, b) };
+		const float scaledDistance{ Vector3::Dot(a, edgeBC) };
+
+		ForEachSample(rect, [&](size_t sampleIndex)
+		{
+			const Vector3& direction = m_ObjectDirections[sampleIndex];
+
+			// Same cull rules as the ray tracer's triangle tests
+			const float normDotDirect{ Vector3::Dot(triangle.normal, direction) };
+			if (AreEqual(normDotDirect, 0.f) || GeometryUtils::IsTriangleCulled(triangle.cullMode, normDotDirect, false))
+				return;
+
+			const float weightA{ Vector3::Dot(direction, edgeBC) };
+			const float weightB{ Vector3::Dot(direction, edgeCA) };
+			const float weightC{ Vector3::Dot(direction, edgeAB) };
+			if ((weightA < 0.f || weightB < 0.f || weightC < 0.f) && (weightA > 0.f || weightB > 0.f || weightC > 0.f))
+				return;
+
+			const float determinant{ weightA + weightB + weightC };
+			if (determinant == 0.f)
+				return;
+
+			const float t{ scaledDistance / determinant };
+			PrimitiveHit& sample = m_Samples[sampleIndex];
+			if (t >= rayMin && t < sample.t)
+				sample = { t, meshIndex, triangleIndex, weightB / determinant, weightC / determinant, HitObjectType::Triangle };
+		});
+	}
+}
+
+void VisibilityBuffer::CullTriangles(const TriangleMesh& mesh, const Frustum& objectFrustum)
+{
+	m_VisibleTriangles.clear();
+	if (mesh.bvh.IsEmpty())
+	{
+		for (uint32_t triangleIndex{ 0 }; triangleIndex < mesh.triangleRecords.size(); ++triangleIndex)
+			m_VisibleTriangles.push_back(triangleIndex);
+		return;
+	}
+
+	const std::vector<WideBVHNode>& nodes = mesh.bvh.GetWideNodes();
+	const std::vector<uint32_t>& primitiveIndices = mesh.bvh.GetPrimitiveIndices();
+
+	TraversalStack<uint32_t> stack{};
+	stack.Push(0);
+	while (!stack.IsEmpty())
+	{
+		const WideBVHNode& node = nodes[stack.Pop()];
+		for (uint32_t slot{ 0 }; slot < WideBVHWidth; ++slot)
+		{
+			// Empty slots have inverted bounds, which the frustum test would not reject
+			if (node.bounds[0][slot] > node.bounds[3][slot])
+				continue;
+
+			if (!objectFrustum.Overlaps({ node.bounds[0][slot], node.bounds[1][slot], node.bounds[2][slot] },
+				{ node.bounds[3][slot], node.bounds[4][slot], node.bounds[5][slot] }))
+				continue;
+
+			if (node.primitiveCounts[slot] == 0)
+			{
+				stack.Push(node.children[slot]);
+				continue;
+			}
+
+			// Spatial splits can list a triangle in several leaves, rasterizing it twice can't change a sample
+			const uint32_t first{ node.children[slot] };
+			for (uint32_t i{ first }; i < first + node.primitiveCounts[slot]; ++i)
+				m_VisibleTriangles.push_back(primitiveIndices[i]);
+		}
+	}
+}
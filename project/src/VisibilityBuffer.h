@@ -0,0 +1,83 @@
+#pragma once
+
+//Standard includes
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+//Project includes
+#include "Maths.h"
+#include "DataTypes.h"
+
+namespace dae
+{
+	class Scene;
+
+	/**
+	 * \brief Primary visibility of a rectangle of the screen, found by rasterizing the scene instead of tracing it.
+	 * Every triangle, sphere and sphere cloud gets projected to a screen rectangle and only the samples inside it run
+	 * the primitive's test: edge functions for triangles, the analytic intersection for spheres. Planes cover every sample.
+	 * Only the triangles in the leaves of a mesh's BVH the rectangle's frustum overlaps get projected,
+	 * Resolve turns a sample into the hit record tracing its ray would give.
+	 */
+	class VisibilityBuffer final
+	{
+	public:
+		// Pinhole camera the primary rays leave from, mapped to the screen like Renderer::GeneratePrimaryRay does
+		struct View
+		{
+			Matrix cameraToWorld;
+			Vector3 origin;
+			float fov;
+			float aspectRatio;
+			uint32_t screenWidth, screenHeight;
+		};
+
+		/**
+		 * \brief Rasterizes the scene into the screen rectangle (x, y, width, height)
+		 * \param rayDirections normalized primary ray direction of every sample, sample s of pixel (px, py)
+		 * at ((py - y) * width + (px - x)) * sampleCount + s. The same index addresses the visibility samples
+		 */
+		void Rasterize(const Scene& scene, const View& view, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+			uint32_t sampleCount, const Vector3* rayDirections);
+
+		// What the primary ray of one sample sees, nothing derived from the hit is stored
+		const PrimitiveHit& GetSample(size_t sampleIndex) const { return m_Samples[sampleIndex]; }
+
+		// Position, normal and material of what a sample sees, ray is the sample's primary ray. False if it sees nothing
+		bool Resolve(const Scene& scene, size_t sampleIndex, const Ray& ray, HitRecord& hitRecord) const;
+
+	private:
+		// Pixel rectangle [minX, maxX) x [minY, maxY) a primitive may cover, clipped to the rasterized rectangle
+		struct PixelRect
+		{
+			uint32_t minX, minY, maxX, maxY;
+
+			bool IsEmpty() const { return minX >= maxX || minY >= maxY; }
+		};
+
+		// Screen rectangle of camera space points, the whole rasterized rectangle if any of them lies behind the camera
+		PixelRect ProjectPoints(const Vector3* cameraPoints, size_t pointCount) const;
+		PixelRect ProjectBox(const Matrix& worldToCamera, const Vector3& minAABB, const Vector3& maxAABB) const;
+
+		// Calls test(sampleIndex) for every sample of the pixels in rect
+		template<typename SampleTest>
+		void ForEachSample(const PixelRect& rect, SampleTest&& test) const;
+
+		void RasterizeMesh(const Scene& scene, uint32_t meshIndex, const Matrix& worldToCamera, const Vector3* rayDirections);
+		// Triangles of the mesh in the BVH leaves the frustum overlaps, every triangle for meshes without a BVH
+		void CullTriangles(const TriangleMesh& mesh, const Frustum& objectFrustum);
+
+		std::vector<PrimitiveHit> m_Samples{};
+
+		// Reused between meshes and calls so they stop allocating
+		std::vector<uint32_t> m_VisibleTriangles{};
+		std::vector<Vector3> m_ObjectDirections{};
+
+		// World space directions of the rasterized rectangle's frustum edges
+		Vector3 m_FrustumCorners[4]{};
+
+		View m_View{};
+		uint32_t m_X{}, m_Y{}, m_Width{}, m_Height{}, m_SampleCount{};
+	};
+}
@@ -111,7 +111,7 @@ int main(int argc, char* args[])
 	pTimer->Start();
 
 	// Start Benchmark
-	// pTimer->StartBenchmark();
+	// pTimer->StartBenchmark(10, pRenderer->GetExecutionDescription());
 
 	float printTimer = 0.f;
 	bool isLooping = true;
@@ -137,6 +137,39 @@ int main(int argc, char* args[])
 				if (e.key.keysym.scancode == SDL_SCANCODE_F3)
 					pRenderer->CycleLightingMode();
 
+				if (e.key.keysym.scancode == SDL_SCANCODE_F4)
+					pRenderer->CycleExecutionBackend();
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F5)
+					pTimer->StartBenchmark(10, pRenderer->GetExecutionDescription());
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F6)
+					pRenderer->CyclePixelOrder();
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F7)
+					pRenderer->TogglePacketTracing();
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F8)
+					pRenderer->ToggleWavefront();
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F9)
+					pRenderer->ToggleFrustumCulling();
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F10)
+					pRenderer->ToggleVisibilityPrepass();
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_PAGEUP)
+				{
+					pRenderer->SetThreadCount(pRenderer->GetThreadCount() * 2);
+					std::cout << "Current execution backend: " << pRenderer->GetExecutionDescription() << std::endl;
+				}
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_PAGEDOWN)
+				{
+					pRenderer->SetThreadCount(pRenderer->GetThreadCount() / 2);
+					std::cout << "Current execution backend: " << pRenderer->GetExecutionDescription() << std::endl;
+				}
+
 				if(e.key.keysym.scancode == SDL_SCANCODE_LEFT)
 					ShowFollowingScene(FollowingSceneType::Previous);
 
@@ -172,6 +205,17 @@ int main(int argc, char* args[])
 		{
 			printTimer = 0.f;
 			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+
+			if (pRenderer->ArePerformanceCountersAvailable())
+			{
+				// Misses per pixel make the pixel orders comparable regardless of the frame rate
+				using Event = PerformanceCounters::Event;
+				const PerformanceCounters::Values& counters{ pRenderer->GetFrameCounters() };
+				const float pixelCount{ static_cast<float>(width * height) };
+				std::cout << "Cache misses/pixel: LLC " << counters[Event::CacheMisses] / pixelCount
+					<< " (of " << counters[Event::CacheReferences] / pixelCount << " references), L1D "
+					<< counters[Event::L1DataMisses] / pixelCount << std::endl;
+			}
 		}
 
 		//Save screenshot after full render
@@ -1,7 +1,21 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+
 #include "../src/Vector3.h"
 #include "../src/Vector4.h"
 #include "../src/Matrix.h"
+#include "../src/Utils.h"
+#include "../src/Material.h"
+#include "../src/Scene.h"
+#include "../src/TaskScheduler.h"
+#include "../src/ThreadPool.h"
+#include "../src/VisibilityBuffer.h"
 
 namespace dae
 {
@@ -37,6 +51,1032 @@ namespace dae
 
 	// W1
 
+	TEST(Matrix, Inverse) {
+		const Matrix transform{ Matrix::CreateScale(.7f, 2.f, 1.5f) * Matrix::CreateRotationY(1.2f) * Matrix::CreateTranslation(1.f, -3.f, 4.f) };
+		const Matrix identity{ transform * Matrix::Inverse(transform) };
+
+		for (int r{ 0 }; r < 4; ++r)
+		{
+			for (int c{ 0 }; c < 4; ++c)
+			{
+				EXPECT_NEAR(r == c ? 1.f : 0.f, identity[r][c], 1e-5f);
+			}
+		}
+
+		const Vector3 point{ 3.f, -1.f, 2.f };
+		const Vector3 roundTrip{ Matrix::Inverse(transform).TransformPoint(transform.TransformPoint(point)) };
+		EXPECT_NEAR(point.x, roundTrip.x, 1e-5f);
+		EXPECT_NEAR(point.y, roundTrip.y, 1e-5f);
+		EXPECT_NEAR(point.z, roundTrip.z, 1e-5f);
+	}
+
+	// Acceleration structures
+	static TriangleMesh CreateRandomTriangleMesh(size_t triangleCount, TriangleCullMode cullMode)
+	{
+		std::mt19937 generator{ 1337 };
+		std::uniform_real_distribution<float> position{ -5.f, 5.f };
+		std::uniform_real_distribution<float> offset{ -.5f, .5f };
+
+		TriangleMesh mesh{};
+		for (size_t i{ 0 }; i < triangleCount; ++i)
+		{
+			const Vector3 center{ position(generator), position(generator), position(generator) };
+			mesh.AppendTriangle({
+				center + Vector3{ offset(generator), offset(generator), offset(generator) },
+				center + Vector3{ offset(generator), offset(generator), offset(generator) },
+				center + Vector3{ offset(generator), offset(generator), offset(generator) } }, true);
+		}
+
+		mesh.cullMode = cullMode;
+		mesh.UpdateTriangleRecords();
+		mesh.UpdateAABB();
+		mesh.UpdateTransforms();
+		return mesh;
+	}
+
+	// Ray from behind CreateRandomTriangleMesh's meshes, leaning at most half a unit sideways per unit forward
+	static Ray CreateRandomMeshRay(std::mt19937& generator)
+	{
+		std::uniform_real_distribution<float> direction{ -1.f, 1.f };
+		return { { 0.f, 0.f, -12.f }, Vector3{ direction(generator) * .5f, direction(generator) * .5f, 1.f }.Normalized() };
+	}
+
+	// Fires rayCount random rays from behind the meshes and expects the BVH to report the same closest and any hits as the linear search
+	static void ExpectMatchesLinear(const TriangleMesh& linearMesh, const TriangleMesh& bvhMesh, uint32_t seed, int rayCount)
+	{
+		std::mt19937 generator{ seed };
+
+		for (int i{ 0 }; i < rayCount; ++i)
+		{
+			const Ray ray{ CreateRandomMeshRay(generator) };
+
+			HitRecord linearHit{}, bvhHit{};
+			ASSERT_EQ(GeometryUtils::HitTest_TriangleMesh(linearMesh, ray, linearHit), GeometryUtils::HitTest_TriangleMesh(bvhMesh, ray, bvhHit));
+			if (linearHit.didHit)
+			{
+				EXPECT_FLOAT_EQ(linearHit.t, bvhHit.t);
+			}
+
+			EXPECT_EQ(GeometryUtils::HitTest_TriangleMesh(linearMesh, ray), GeometryUtils::HitTest_TriangleMesh(bvhMesh, ray));
+		}
+	}
+
+	TEST(BVH, MatchesLinearMeshIntersection) {
+		const TriangleMesh linearMesh{ CreateRandomTriangleMesh(500, TriangleCullMode::NoCulling) };
+		TriangleMesh bvhMesh{ linearMesh };
+		bvhMesh.BuildBVH();
+		ASSERT_FALSE(bvhMesh.bvh.IsEmpty());
+
+		ExpectMatchesLinear(linearMesh, bvhMesh, 42, 1000);
+	}
+
+	TEST(BVH, RefitMatchesLinearMeshIntersection) {
+		TriangleMesh linearMesh{ CreateRandomTriangleMesh(500, TriangleCullMode::NoCulling) };
+		TriangleMesh bvhMesh{ linearMesh };
+		bvhMesh.BuildBVH();
+
+		// Deform both meshes the same way
+		for (TriangleMesh* pMesh : { &linearMesh, &bvhMesh })
+		{
+			for (Vector3& position : pMesh->positions)
+				position.y += std::sin(position.x) * 2.f;
+
+			pMesh->UpdateDeformation();
+		}
+
+		ExpectMatchesLinear(linearMesh, bvhMesh, 7, 1000);
+	}
+
+	TEST(BVH, ParallelBuildMatchesLinearMeshIntersection) {
+		// Large enough for the top level splits to bin and partition in parallel
+		const TriangleMesh linearMesh{ CreateRandomTriangleMesh(200000, TriangleCullMode::NoCulling) };
+		TriangleMesh bvhMesh{ linearMesh };
+		bvhMesh.BuildBVH();
+
+		// Every triangle ends up in exactly one leaf
+		std::vector<uint32_t> primitiveIndices{ bvhMesh.bvh.GetPrimitiveIndices() };
+		std::sort(primitiveIndices.begin(), primitiveIndices.end());
+		ASSERT_EQ(primitiveIndices.size(), 200000u);
+		for (uint32_t i{ 0 }; i < primitiveIndices.size(); ++i)
+			ASSERT_EQ(primitiveIndices[i], i);
+
+		EXPECT_GT(bvhMesh.bvh.GetBuildStats().peakMemoryBytes, 0u);
+
+		ExpectMatchesLinear(linearMesh, bvhMesh, 3, 200);
+	}
+
+	TEST(BVH, ParallelBuildMatchesSerialBuild) {
+		// Large enough for the top level splits to bin and partition in parallel
+		std::mt19937 generator{ 19 };
+		std::uniform_real_distribution<float> position{ -50.f, 50.f };
+		std::uniform_real_distribution<float> extent{ 0.f, 1.f };
+
+		std::vector<AABB> primitiveBounds(200000);
+		for (AABB& bounds : primitiveBounds)
+		{
+			bounds.min = { position(generator), position(generator), position(generator) };
+			bounds.max = bounds.min + Vector3{ extent(generator), extent(generator), extent(generator) };
+		}
+
+		for (const BVHBuildMode buildMode : { BVHBuildMode::SAH, BVHBuildMode::LBVH })
+		{
+			BVH serialBVH{}, parallelBVH{};
+			serialBVH.SetParallelBuild(false);
+			serialBVH.Build(primitiveBounds, buildMode);
+			parallelBVH.Build(primitiveBounds, buildMode);
+
+			ASSERT_EQ(serialBVH.GetPrimitiveIndices(), parallelBVH.GetPrimitiveIndices());
+			ASSERT_EQ(serialBVH.GetNodes().size(), parallelBVH.GetNodes().size());
+			for (size_t i{ 0 }; i < serialBVH.GetNodes().size(); ++i)
+			{
+				const BVHNode& serialNode = serialBVH.GetNodes()[i];
+				const BVHNode& parallelNode = parallelBVH.GetNodes()[i];
+				ASSERT_EQ(serialNode.leftFirst, parallelNode.leftFirst);
+				ASSERT_EQ(serialNode.primitiveCount, parallelNode.primitiveCount);
+				ASSERT_EQ(serialNode.minAABB, parallelNode.minAABB);
+				ASSERT_EQ(serialNode.maxAABB, parallelNode.maxAABB);
+			}
+		}
+	}
+
+	TEST(BVH, LBVHMatchesLinearMeshIntersection) {
+		// The large mesh switches to 63-bit Morton codes
+		for (const size_t triangleCount : { 500u, 300000u })
+		{
+			const TriangleMesh linearMesh{ CreateRandomTriangleMesh(triangleCount, TriangleCullMode::NoCulling) };
+			TriangleMesh bvhMesh{ linearMesh };
+			bvhMesh.bvhBuildMode = BVHBuildMode::LBVH;
+			bvhMesh.BuildBVH();
+
+			std::vector<uint32_t> primitiveIndices{ bvhMesh.bvh.GetPrimitiveIndices() };
+			std::sort(primitiveIndices.begin(), primitiveIndices.end());
+			ASSERT_EQ(primitiveIndices.size(), triangleCount);
+			for (uint32_t i{ 0 }; i < primitiveIndices.size(); ++i)
+				ASSERT_EQ(primitiveIndices[i], i);
+
+			ExpectMatchesLinear(linearMesh, bvhMesh, 11, 200);
+		}
+	}
+
+	TEST(BVH, SBVHMatchesLinearMeshIntersection) {
+		// Long diagonal slivers, their bounds overlap badly and leave object splits little to work with
+		std::mt19937 generator{ 5 };
+		std::uniform_real_distribution<float> position{ -5.f, 5.f };
+		std::uniform_real_distribution<float> offset{ -.05f, .05f };
+
+		TriangleMesh linearMesh{};
+		for (int i{ 0 }; i < 500; ++i)
+		{
+			const Vector3 start{ position(generator), position(generator), position(generator) };
+			const Vector3 end{ position(generator), position(generator), position(generator) };
+			linearMesh.AppendTriangle({ start, end, end + Vector3{ offset(generator), offset(generator), offset(generator) } }, true);
+		}
+
+		linearMesh.cullMode = TriangleCullMode::NoCulling;
+		linearMesh.UpdateTriangleRecords();
+		linearMesh.UpdateAABB();
+		linearMesh.UpdateTransforms();
+
+		TriangleMesh sahMesh{ linearMesh };
+		sahMesh.BuildBVH();
+
+		TriangleMesh bvhMesh{ linearMesh };
+		bvhMesh.bvhBuildMode = BVHBuildMode::SBVH;
+		bvhMesh.BuildBVH();
+
+		// Spatial splits stay within the reference budget and pay off on this kind of geometry
+		const size_t referenceCount{ bvhMesh.bvh.GetPrimitiveIndices().size() };
+		EXPECT_GT(referenceCount, 500u);
+		EXPECT_LE(referenceCount, static_cast<size_t>(500 * (1.f + bvhMesh.bvh.GetSpatialSplitBudget())));
+		EXPECT_LT(bvhMesh.bvh.GetSAHCost(), sahMesh.bvh.GetSAHCost());
+
+		ExpectMatchesLinear(linearMesh, bvhMesh, 5, 1000);
+	}
+
+	TEST(BVH, TraversalStackSpillsToTheHeap) {
+		// Far deeper than the inline entries reach, as a degenerate mesh's tree could get
+		TraversalStack<uint32_t> stack{};
+		constexpr uint32_t entryCount{ 64 * WideBVHWidth * 5 + 3 };
+		for (uint32_t i{ 0 }; i < entryCount; ++i)
+			stack.Push(i);
+
+		ASSERT_EQ(stack.GetSize(), entryCount);
+		EXPECT_EQ(stack[0], 0u);
+		EXPECT_EQ(stack[entryCount - 1], entryCount - 1);
+
+		for (uint32_t i{ entryCount }; i > 0; --i)
+			ASSERT_EQ(stack.Pop(), i - 1);
+		EXPECT_TRUE(stack.IsEmpty());
+	}
+
+	TEST(BVH, PacketTraversalMatchesSingleRays) {
+		TriangleMesh mesh{ CreateRandomTriangleMesh(2000, TriangleCullMode::NoCulling) };
+		mesh.BuildBVH();
+		ASSERT_FALSE(mesh.bvh.IsEmpty());
+
+		std::mt19937 generator{ 17 };
+		std::uniform_real_distribution<float> direction{ -1.f, 1.f };
+		std::uniform_real_distribution<float> jitter{ -.01f, .01f };
+
+		for (const TriangleIntersector intersector : { TriangleIntersector::MollerTrumbore, TriangleIntersector::Watertight })
+		{
+			mesh.intersector = intersector;
+
+			for (int i{ 0 }; i < 300; ++i)
+			{
+				// Alternate coherent packets with diverging ones, which fall back to single rays, and leave some lanes unused
+				const bool isCoherent{ i % 2 == 0 };
+				const Vector3 center{ direction(generator) * .5f, direction(generator) * .5f, 1.f };
+				const uint32_t laneMask{ i % 3 == 0 ? 0b10110101u : 0xFFu };
+
+				RayPacket packet{};
+				for (Ray& ray : packet.rays)
+				{
+					const Vector3 rayDirection{ isCoherent
+						? center + Vector3{ jitter(generator), jitter(generator), 0.f }
+						: Vector3{ direction(generator) * .5f, direction(generator) * .5f, 1.f } };
+					ray = { { 0.f, 0.f, -12.f }, rayDirection.Normalized() };
+				}
+
+				PrimitiveHit packetHits[PrimitiveBlockWidth]{};
+				const uint32_t hitMask{ GeometryUtils::HitTest_TriangleMesh(mesh, packet, laneMask, packetHits) };
+				EXPECT_EQ(hitMask & ~laneMask, 0u);
+
+				for (uint32_t lane{ 0 }; lane < PrimitiveBlockWidth; ++lane)
+				{
+					if ((laneMask >> lane & 1) == 0)
+						continue;
+
+					HitRecord singleHit{};
+					const bool didHit = GeometryUtils::HitTest_TriangleMesh(mesh, packet.rays[lane], singleHit);
+					ASSERT_EQ((hitMask >> lane & 1) != 0, didHit);
+					EXPECT_EQ(packetHits[lane].DidHit(), didHit);
+					if (didHit)
+					{
+						EXPECT_FLOAT_EQ(packetHits[lane].t, singleHit.t);
+					}
+				}
+			}
+		}
+	}
+
+	TEST(Triangle, WatertightMatchesMollerTrumbore) {
+		TriangleMesh mollerTrumboreMesh{ CreateRandomTriangleMesh(500, TriangleCullMode::BackFaceCulling) };
+		mollerTrumboreMesh.BuildBVH();
+
+		TriangleMesh watertightMesh{ mollerTrumboreMesh };
+		watertightMesh.intersector = TriangleIntersector::Watertight;
+
+		std::mt19937 generator{ 9 };
+
+		for (int i{ 0 }; i < 1000; ++i)
+		{
+			const Ray ray{ CreateRandomMeshRay(generator) };
+
+			HitRecord mollerTrumboreHit{}, watertightHit{};
+			ASSERT_EQ(GeometryUtils::HitTest_TriangleMesh(mollerTrumboreMesh, ray, mollerTrumboreHit),
+				GeometryUtils::HitTest_TriangleMesh(watertightMesh, ray, watertightHit));
+			EXPECT_NEAR(mollerTrumboreHit.t, watertightHit.t, 1e-4f);
+
+			EXPECT_EQ(GeometryUtils::HitTest_TriangleMesh(mollerTrumboreMesh, ray), GeometryUtils::HitTest_TriangleMesh(watertightMesh, ray));
+		}
+
+		// A fan of triangles around a shared center, rays straight at the shared edges and vertex may never slip through
+		TriangleMesh fanMesh{};
+		const Vector3 center{ .3f, .7f, 0.f };
+		constexpr int fanSegments{ 7 };
+		for (int i{ 0 }; i < fanSegments; ++i)
+		{
+			const float angle0{ static_cast<float>(i) / fanSegments * PI_2 };
+			const float angle1{ static_cast<float>(i + 1) / fanSegments * PI_2 };
+			fanMesh.AppendTriangle({ center,
+				center + Vector3{ std::cos(angle1), std::sin(angle1), 0.f },
+				center + Vector3{ std::cos(angle0), std::sin(angle0), 0.f } }, true);
+		}
+
+		fanMesh.cullMode = TriangleCullMode::NoCulling;
+		fanMesh.intersector = TriangleIntersector::Watertight;
+		fanMesh.UpdateAABB();
+		fanMesh.UpdateTransforms();
+		fanMesh.BuildBVH();
+
+		for (int i{ 0 }; i < fanSegments; ++i)
+		{
+			const float angle{ static_cast<float>(i) / fanSegments * PI_2 };
+			for (const float distance : { 0.f, .25f, .5f, .75f })
+			{
+				const Vector3 target{ center + Vector3{ std::cos(angle), std::sin(angle), 0.f } * distance };
+				const Ray ray{ { 0.f, 0.f, -5.f }, (target - Vector3{ 0.f, 0.f, -5.f }).Normalized() };
+				EXPECT_TRUE(GeometryUtils::HitTest_TriangleMesh(fanMesh, ray));
+			}
+		}
+	}
+
+	TEST(Triangle, WatertightClosedMeshHasNoGaps) {
+		// Subdivided octahedron with jittered vertices shared through the indices, every ray from inside has to hit it
+		std::vector<Vector3> positions{ Vector3::UnitX, -Vector3::UnitX, Vector3::UnitY, -Vector3::UnitY, Vector3::UnitZ, -Vector3::UnitZ };
+		std::vector<int> indices{ 0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4, 2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5 };
+		for (int level{ 0 }; level < 4; ++level)
+		{
+			std::map<std::pair<int, int>, int> midpoints{};
+			const auto getMidpoint = [&](int a, int b)
+			{
+				const auto [iterator, isNew] = midpoints.try_emplace({ std::min(a, b), std::max(a, b) }, static_cast<int>(positions.size()));
+				if (isNew)
+					positions.push_back((positions[a] + positions[b]) * .5f);
+				return iterator->second;
+			};
+
+			std::vector<int> subdividedIndices{};
+			for (size_t i{ 0 }; i < indices.size(); i += 3)
+			{
+				const int a{ indices[i] }, b{ indices[i + 1] }, c{ indices[i + 2] };
+				const int ab{ getMidpoint(a, b) }, bc{ getMidpoint(b, c) }, ca{ getMidpoint(c, a) };
+				subdividedIndices.insert(subdividedIndices.end(), { a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca });
+			}
+			indices = std::move(subdividedIndices);
+		}
+
+		std::mt19937 generator{ 31 };
+		std::uniform_real_distribution<float> jitter{ .6f, 1.7f };
+		for (Vector3& position : positions)
+			position = position.Normalized() * jitter(generator);
+
+		TriangleMesh mesh{ positions, indices, TriangleCullMode::NoCulling };
+		mesh.intersector = TriangleIntersector::Watertight;
+		mesh.UpdateAABB();
+		mesh.UpdateTransforms();
+		mesh.BuildBVH();
+
+		// Rays from around the center straight at points on the shared edges
+		std::uniform_real_distribution<float> along{ 0.f, 1.f };
+		std::uniform_real_distribution<float> originOffset{ -.1f, .1f };
+		std::uniform_int_distribution<size_t> triangle{ 0, indices.size() / 3 - 1 };
+		int missCount{ 0 };
+		for (int i{ 0 }; i < 20000; ++i)
+		{
+			const size_t first{ triangle(generator) * 3 };
+			const int corner{ i % 3 };
+			const Vector3& edgeStart = positions[indices[first + corner]];
+			const Vector3& edgeEnd = positions[indices[first + (corner + 1) % 3]];
+			const Vector3 target{ edgeStart + (edgeEnd - edgeStart) * along(generator) };
+
+			const Vector3 origin{ originOffset(generator), originOffset(generator), originOffset(generator) };
+			if (!GeometryUtils::HitTest_TriangleMesh(mesh, Ray{ origin, (target - origin).Normalized() }))
+				++missCount;
+		}
+
+		EXPECT_EQ(missCount, 0);
+	}
+
+	TEST(Triangle, PrimitiveHitMaterializesToHitRecord) {
+		TriangleMesh mesh{ CreateRandomTriangleMesh(500, TriangleCullMode::NoCulling) };
+		mesh.RotateY(.6f);
+		mesh.Scale({ 1.5f, .75f, 1.f });
+		mesh.UpdateTransforms();
+		mesh.BuildBVH();
+
+		std::mt19937 generator{ 23 };
+
+		for (const TriangleIntersector intersector : { TriangleIntersector::MollerTrumbore, TriangleIntersector::Watertight })
+		{
+			mesh.intersector = intersector;
+
+			for (int i{ 0 }; i < 500; ++i)
+			{
+				const Ray ray{ CreateRandomMeshRay(generator) };
+
+				HitRecord tracedHit{};
+				PrimitiveHit primitiveHit{};
+				ASSERT_EQ(GeometryUtils::HitTest_TriangleMesh(mesh, ray, tracedHit), GeometryUtils::HitTest_TriangleMesh(mesh, ray, primitiveHit));
+				if (!tracedHit.didHit)
+					continue;
+
+				// The barycentrics alone lead back to the hit point
+				const TriangleRecord& triangle = mesh.triangleRecords[primitiveHit.primitiveIndex];
+				const Vector3 objectPoint{ triangle.v0 + triangle.edge1 * primitiveHit.barycentricU + triangle.edge2 * primitiveHit.barycentricV };
+				const Vector3 objectHitPoint{ mesh.worldToObject.TransformPoint(tracedHit.origin) };
+				EXPECT_NEAR(objectPoint.x, objectHitPoint.x, 1e-3f);
+				EXPECT_NEAR(objectPoint.y, objectHitPoint.y, 1e-3f);
+				EXPECT_NEAR(objectPoint.z, objectHitPoint.z, 1e-3f);
+
+				HitRecord materializedHit{};
+				GeometryUtils::FillTriangleMeshHitRecord(mesh, primitiveHit.primitiveIndex, ray, primitiveHit.t, materializedHit);
+				EXPECT_FLOAT_EQ(materializedHit.t, tracedHit.t);
+				EXPECT_FLOAT_EQ(Vector3::Dot(materializedHit.normal, tracedHit.normal), 1.f);
+			}
+		}
+	}
+
+	TEST(Triangle, BlockKernelMatchesMollerTrumbore) {
+		// 13 triangles leave a partially filled second block
+		TriangleMesh mesh{ CreateRandomTriangleMesh(13, TriangleCullMode::BackFaceCulling) };
+
+		std::mt19937 generator{ 10 };
+
+		for (const TriangleCullMode cullMode : { TriangleCullMode::BackFaceCulling, TriangleCullMode::FrontFaceCulling, TriangleCullMode::NoCulling })
+		{
+			mesh.cullMode = cullMode;
+			mesh.UpdateTriangleRecords();
+
+			for (int i{ 0 }; i < 2000; ++i)
+			{
+				const Ray ray{ CreateRandomMeshRay(generator) };
+				const GeometryUtils::BlockRay blockRay{ ray };
+
+				for (const bool isShadowRay : { false, true })
+				{
+					for (size_t blockIndex{ 0 }; blockIndex < mesh.triangleBlocks.size(); ++blockIndex)
+					{
+						const uint32_t laneEnd{ std::min(static_cast<uint32_t>(mesh.triangleRecords.size() - blockIndex * PrimitiveBlockWidth), PrimitiveBlockWidth) };
+
+						bool expectedHit{ false };
+						float expectedT{ ray.max };
+						for (uint32_t lane{ 0 }; lane < laneEnd; ++lane)
+						{
+							GeometryUtils::TriangleHit laneHit{};
+							if (GeometryUtils::Intersect_MollerTrumbore(mesh.triangleRecords[blockIndex * PrimitiveBlockWidth + lane], ray, isShadowRay, laneHit)
+								&& laneHit.t < expectedT)
+							{
+								expectedHit = true;
+								expectedT = laneHit.t;
+							}
+						}
+
+						GeometryUtils::TriangleBlockHit hit{};
+						ASSERT_EQ(GeometryUtils::Intersect_TriangleBlock(mesh.triangleBlocks[blockIndex], blockRay, ray.min, ray.max,
+							cullMode, isShadowRay, 0, laneEnd, hit), expectedHit);
+						if (expectedHit)
+						{
+							EXPECT_NEAR(hit.t, expectedT, 1e-4f);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	TEST(Sphere, BlockKernelMatchesHitTest) {
+		std::mt19937 generator{ 11 };
+		std::uniform_real_distribution<float> position{ -5.f, 5.f };
+		std::uniform_real_distribution<float> radius{ .2f, 2.f };
+		std::uniform_real_distribution<float> direction{ -1.f, 1.f };
+
+		// Lanes 5..7 stay empty
+		std::vector<Sphere> spheres(5);
+		SphereBlock block{};
+		std::fill(std::begin(block.radiusSquared), std::end(block.radiusSquared), -std::numeric_limits<float>::infinity());
+		for (size_t lane{ 0 }; lane < spheres.size(); ++lane)
+		{
+			spheres[lane].origin = { position(generator), position(generator), position(generator) };
+			spheres[lane].radius = radius(generator);
+
+			block.center[0][lane] = spheres[lane].origin.x;
+			block.center[1][lane] = spheres[lane].origin.y;
+			block.center[2][lane] = spheres[lane].origin.z;
+			block.radiusSquared[lane] = spheres[lane].radius * spheres[lane].radius;
+		}
+
+		for (int i{ 0 }; i < 2000; ++i)
+		{
+			// Some rays start inside a sphere and have to take the far root
+			const Ray ray{ { position(generator), position(generator), position(generator) },
+				Vector3{ direction(generator), direction(generator), direction(generator) }.Normalized() };
+
+			bool expectedHit{ false };
+			float expectedT{ ray.max };
+			for (const Sphere& sphere : spheres)
+			{
+				HitRecord hitRecord{};
+				if (GeometryUtils::HitTest_Sphere(sphere, ray, hitRecord) && hitRecord.t < expectedT)
+				{
+					expectedHit = true;
+					expectedT = hitRecord.t;
+				}
+			}
+
+			GeometryUtils::BlockHit hit{};
+			ASSERT_EQ(GeometryUtils::Intersect_SphereBlock(block, GeometryUtils::BlockRay{ ray }, ray.min, ray.max, 0, PrimitiveBlockWidth, hit), expectedHit);
+			if (expectedHit)
+			{
+				EXPECT_NEAR(hit.t, expectedT, 1e-4f);
+			}
+
+			// Excluding the lanes of the first two spheres
+			GeometryUtils::BlockHit rangeHit{};
+			if (GeometryUtils::Intersect_SphereBlock(block, GeometryUtils::BlockRay{ ray }, ray.min, ray.max, 2, PrimitiveBlockWidth, rangeHit))
+			{
+				EXPECT_GE(rangeHit.lane, 2u);
+			}
+		}
+	}
+
+	TEST(Plane, BlockKernelMatchesHitTest) {
+		std::mt19937 generator{ 12 };
+		std::uniform_real_distribution<float> position{ -5.f, 5.f };
+		std::uniform_real_distribution<float> direction{ -1.f, 1.f };
+
+		// Lanes 6 and 7 stay empty
+		std::vector<Plane> planes(6);
+		PlaneBlock block{};
+		for (size_t lane{ 0 }; lane < planes.size(); ++lane)
+		{
+			planes[lane].origin = { position(generator), position(generator), position(generator) };
+			planes[lane].normal = Vector3{ direction(generator), direction(generator), direction(generator) }.Normalized();
+
+			block.normal[0][lane] = planes[lane].normal.x;
+			block.normal[1][lane] = planes[lane].normal.y;
+			block.normal[2][lane] = planes[lane].normal.z;
+			block.distance[lane] = Vector3::Dot(planes[lane].normal, planes[lane].origin);
+		}
+
+		for (int i{ 0 }; i < 2000; ++i)
+		{
+			const Ray ray{ { position(generator), position(generator), position(generator) },
+				Vector3{ direction(generator), direction(generator), direction(generator) }.Normalized() };
+
+			bool expectedHit{ false };
+			float expectedT{ ray.max };
+			for (const Plane& plane : planes)
+			{
+				HitRecord hitRecord{};
+				if (GeometryUtils::HitTest_Plane(plane, ray, hitRecord) && hitRecord.t < expectedT)
+				{
+					expectedHit = true;
+					expectedT = hitRecord.t;
+				}
+			}
+
+			GeometryUtils::BlockHit hit{};
+			ASSERT_EQ(GeometryUtils::Intersect_PlaneBlock(block, GeometryUtils::BlockRay{ ray }, ray.min, ray.max, hit), expectedHit);
+			if (expectedHit)
+			{
+				EXPECT_NEAR(hit.t, expectedT, 1e-3f);
+			}
+		}
+	}
+
+	TEST(SphereCloud, MatchesLinearSphereIntersection) {
+		std::mt19937 generator{ 13 };
+		std::uniform_real_distribution<float> position{ -5.f, 5.f };
+		std::uniform_real_distribution<float> radius{ .01f, .2f };
+		std::uniform_real_distribution<float> direction{ -1.f, 1.f };
+
+		std::vector<Vector4> spheres(20000);
+		for (Vector4& sphere : spheres)
+			sphere = { position(generator), position(generator), position(generator), radius(generator) };
+
+		for (const bool quantize : { false, true })
+		{
+			const SphereCloud cloud{ spheres, quantize, 3 };
+			ASSERT_EQ(cloud.GetSphereCount(), spheres.size());
+			ASSERT_FALSE(cloud.bvh.IsEmpty());
+
+			// The cloud intersects its own (possibly quantized) spheres
+			std::vector<Sphere> decodedSpheres(cloud.GetSphereCount());
+			for (size_t i{ 0 }; i < decodedSpheres.size(); ++i)
+			{
+				const Vector4 sphere{ cloud.GetSphere(i) };
+				decodedSpheres[i] = { { sphere.x, sphere.y, sphere.z }, sphere.w, 3 };
+				if (quantize)
+				{
+					EXPECT_NEAR(sphere.w, spheres[cloud.bvh.GetPrimitiveIndices()[i]].w, 1e-4f);
+				}
+			}
+
+			for (int i{ 0 }; i < 200; ++i)
+			{
+				const Ray ray{ { 0.f, 0.f, -12.f }, Vector3{ direction(generator) * .4f, direction(generator) * .4f, 1.f }.Normalized() };
+
+				HitRecord linearHit{};
+				for (const Sphere& sphere : decodedSpheres)
+				{
+					HitRecord sphereHit{};
+					if (GeometryUtils::HitTest_Sphere(sphere, ray, sphereHit) && (!linearHit.didHit || sphereHit.t < linearHit.t))
+						linearHit = sphereHit;
+				}
+
+				HitRecord cloudHit{};
+				ASSERT_EQ(GeometryUtils::HitTest_SphereCloud(cloud, ray, cloudHit), linearHit.didHit);
+				EXPECT_EQ(GeometryUtils::HitTest_SphereCloud(cloud, ray), linearHit.didHit);
+				if (linearHit.didHit)
+				{
+					EXPECT_NEAR(cloudHit.t, linearHit.t, 1e-4f);
+					EXPECT_EQ(cloudHit.materialIndex, 3);
+				}
+			}
+		}
+	}
+
+	TEST(ThreadPool, RunsEveryTaskOnce) {
+		ThreadPool threadPool{ 4 };
+		ASSERT_EQ(threadPool.GetThreadCount(), 4u);
+
+		for (const TaskDistribution distribution : { TaskDistribution::Contiguous, TaskDistribution::Interleaved })
+		{
+			// Uneven task costs make the workers steal from each other
+			std::vector<std::atomic<uint32_t>> runCounts(1001);
+			for (int batch{ 0 }; batch < 20; ++batch)
+			{
+				threadPool.ParallelFor(static_cast<uint32_t>(runCounts.size()), [&](uint32_t taskIndex)
+				{
+					if (taskIndex < 50)
+						std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+					runCounts[taskIndex].fetch_add(1);
+				}, distribution);
+			}
+
+			for (const std::atomic<uint32_t>& runCount : runCounts)
+				EXPECT_EQ(runCount.load(), 20u);
+
+			// Fewer tasks than workers
+			std::atomic<uint32_t> smallBatchCount{ 0 };
+			threadPool.ParallelFor(2, [&](uint32_t) { smallBatchCount.fetch_add(1); }, distribution);
+			EXPECT_EQ(smallBatchCount.load(), 2u);
+		}
+
+		threadPool.ParallelFor(0, [](uint32_t) { FAIL(); });
+	}
+
+	TEST(TaskScheduler, CoversEveryPixelOnceAndConservesCost) {
+		// Neither side is a multiple of the tile size, the last tile column and row are partial
+		constexpr uint32_t width{ 100 }, height{ 37 }, tileSize{ 16 };
+		constexpr uint32_t heavyTileX{ 2 }, heavyTileY{ 1 };
+
+		TaskScheduler scheduler{};
+		scheduler.SetTileSize(tileSize);
+
+		// One tile renders a thousand times slower than the rest, after the first frame it has to get split
+		const auto pixelCost = [](uint32_t x, uint32_t y)
+		{
+			return x / tileSize == heavyTileX && y / tileSize == heavyTileY ? 1000.f : 1.f;
+		};
+
+		bool hasSplit{ false };
+		for (int frame{ 0 }; frame < 4; ++frame)
+		{
+			scheduler.ScheduleTasks(width, height, 8);
+			std::vector<RenderTask>& tasks{ scheduler.GetTasks() };
+			ASSERT_EQ(scheduler.GetTileCountX(), 7u);
+			ASSERT_EQ(scheduler.GetTileCountY(), 3u);
+
+			std::vector<int> coverage(width * height, 0);
+			double estimatedCost{ 0.0 };
+			for (RenderTask& task : tasks)
+			{
+				ASSERT_LE(task.x + task.width, width);
+				ASSERT_LE(task.y + task.height, height);
+				hasSplit = hasSplit || task.width < std::min(tileSize, width - task.x) || task.height < std::min(tileSize, height - task.y);
+
+				task.measuredCost = 0.f;
+				for (uint32_t y{ task.y }; y < task.y + task.height; ++y)
+				{
+					for (uint32_t x{ task.x }; x < task.x + task.width; ++x)
+					{
+						++coverage[x + y * width];
+						task.measuredCost += frame == 0 ? 1.f : pixelCost(x, y);
+					}
+				}
+				estimatedCost += task.estimatedCost;
+			}
+
+			for (const int pixelCoverage : coverage)
+				ASSERT_EQ(pixelCoverage, 1);
+
+			// Merging and splitting only moves last frame's cost around
+			double tileCost{ 0.0 };
+			for (const float cost : scheduler.GetTileCosts())
+				tileCost += cost;
+			EXPECT_NEAR(estimatedCost, tileCost, tileCost * 1e-5);
+
+			// Every task spreads its measured cost evenly over its pixels, each tile gets the share of the pixels it holds
+			std::vector<double> expectedTileCosts(scheduler.GetTileCosts().size(), 0.0);
+			for (const RenderTask& task : tasks)
+			{
+				const double costPerPixel{ task.measuredCost / static_cast<double>(task.width * task.height) };
+				for (uint32_t y{ task.y }; y < task.y + task.height; ++y)
+				{
+					for (uint32_t x{ task.x }; x < task.x + task.width; ++x)
+						expectedTileCosts[x / tileSize + y / tileSize * scheduler.GetTileCountX()] += costPerPixel;
+				}
+			}
+
+			scheduler.UpdateTileCosts();
+			for (size_t tileIndex{ 0 }; tileIndex < expectedTileCosts.size(); ++tileIndex)
+				EXPECT_NEAR(scheduler.GetTileCosts()[tileIndex], expectedTileCosts[tileIndex], expectedTileCosts[tileIndex] * 1e-4);
+
+			// With one microsecond a pixel the tile costs are their pixel counts, edge tiles included
+			if (frame == 0)
+			{
+				for (uint32_t tileY{ 0 }; tileY < scheduler.GetTileCountY(); ++tileY)
+				{
+					for (uint32_t tileX{ 0 }; tileX < scheduler.GetTileCountX(); ++tileX)
+					{
+						const float pixelCount{ static_cast<float>(std::min(tileSize, width - tileX * tileSize) * std::min(tileSize, height - tileY * tileSize)) };
+						EXPECT_FLOAT_EQ(scheduler.GetTileCosts()[tileX + tileY * scheduler.GetTileCountX()], pixelCount);
+					}
+				}
+			}
+		}
+
+		EXPECT_TRUE(hasSplit);
+
+		// A new tile size throws the old costs away
+		scheduler.SetTileSize(8);
+		scheduler.ScheduleTasks(width, height, 8);
+		for (const float cost : scheduler.GetTileCosts())
+			EXPECT_EQ(cost, 1.f);
+	}
+
+	TEST(SpaceFillingCurve, VisitsEveryCellOnce) {
+		constexpr uint32_t side{ 16 };
+
+		std::vector<int> mortonVisits(side * side, 0), hilbertVisits(side * side, 0);
+		uint32_t previousX{}, previousY{};
+		for (uint32_t index{ 0 }; index < side * side; ++index)
+		{
+			uint32_t x{}, y{};
+			DecodeMorton2D(index, x, y);
+			ASSERT_LT(x, side);
+			ASSERT_LT(y, side);
+			++mortonVisits[x + y * side];
+			EXPECT_EQ(EncodeMorton2D(x, y), index);
+
+			DecodeHilbert2D(side, index, x, y);
+			ASSERT_LT(x, side);
+			ASSERT_LT(y, side);
+			++hilbertVisits[x + y * side];
+			EXPECT_EQ(EncodeHilbert2D(side, x, y), index);
+
+			// Consecutive cells along a Hilbert curve always share an edge
+			if (index > 0)
+			{
+				EXPECT_EQ(std::abs(int(x) - int(previousX)) + std::abs(int(y) - int(previousY)), 1);
+			}
+			previousX = x;
+			previousY = y;
+		}
+
+		for (uint32_t cell{ 0 }; cell < side * side; ++cell)
+		{
+			EXPECT_EQ(mortonVisits[cell], 1);
+			EXPECT_EQ(hilbertVisits[cell], 1);
+		}
+	}
+
+	TEST(Frustum, KeepsEverythingItsRaysHit) {
+		std::mt19937 generator{ 19 };
+		std::uniform_real_distribution<float> position{ -10.f, 10.f };
+		std::uniform_real_distribution<float> radius{ .1f, 2.f };
+		std::uniform_real_distribution<float> weight{ 0.f, 1.f };
+
+		// Narrow pyramid looking down +z, corners given clockwise
+		const Vector3 origin{ 1.f, -2.f, -12.f };
+		const Vector3 corners[4]{ { -.2f, .1f, 1.f }, { .1f, .1f, 1.f }, { .1f, -.15f, 1.f }, { -.2f, -.15f, 1.f } };
+		const Frustum frustum{ Frustum::FromCorners(origin, corners) };
+
+		int culledCount{ 0 };
+		for (int i{ 0 }; i < 2000; ++i)
+		{
+			const Sphere sphere{ { position(generator), position(generator), position(generator) }, radius(generator) };
+			const Vector3 extent{ sphere.radius, sphere.radius, sphere.radius };
+			const Vector3 minAABB{ sphere.origin - extent }, maxAABB{ sphere.origin + extent };
+
+			const bool sphereOverlaps{ frustum.Overlaps(sphere.origin, sphere.radius) };
+			const bool boxOverlaps{ frustum.Overlaps(minAABB, maxAABB) };
+			culledCount += sphereOverlaps ? 0 : 1;
+
+			// Rays through the inside of the pyramid never hit a culled object
+			for (int j{ 0 }; j < 20; ++j)
+			{
+				Vector3 direction{};
+				for (const Vector3& corner : corners)
+					direction += corner * weight(generator);
+
+				const Ray ray{ origin, direction.Normalized() };
+				HitRecord hitRecord{};
+				if (!GeometryUtils::HitTest_Sphere(sphere, ray, hitRecord))
+					continue;
+
+				// The hit point also lies inside the sphere's bounding box
+				EXPECT_TRUE(sphereOverlaps);
+				EXPECT_TRUE(boxOverlaps);
+			}
+		}
+
+		// Most of the random objects lie outside such a narrow pyramid
+		EXPECT_GT(culledCount, 1000);
+
+		// Nothing behind the origin is visible
+		EXPECT_FALSE(frustum.Overlaps(origin - Vector3{ 0.f, 0.f, 5.f }, .1f));
+	}
+
+	// Small scene with every kind of object, the base class leaves the Add functions to its scenes
+	class VisibilityTestScene final : public Scene
+	{
+	public:
+		void Initialize() override
+		{
+			AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f });
+			AddPlane({ 0.f, 0.f, 12.f }, { 0.f, 0.f, -1.f });
+			AddSphere({ -2.f, 1.f, 2.f }, 1.f);
+			AddSphere({ 1.5f, .5f, 0.f }, .75f);
+
+			TriangleMesh* pMesh = AddTriangleMesh(TriangleCullMode::BackFaceCulling);
+			pMesh->AppendTriangle({ { -1.f, 0.f, 0.f }, { 0.f, 2.f, 0.f }, { 1.f, 0.f, 0.f } }, true);
+			pMesh->AppendTriangle({ { 1.f, 0.f, 0.f }, { 0.f, 2.f, 0.f }, { 1.f, 2.f, 1.f } }, true);
+			pMesh->RotateY(.6f);
+			pMesh->Translate({ .5f, .2f, 4.f });
+			pMesh->UpdateAABB();
+			pMesh->UpdateTransforms();
+			pMesh->BuildBVH();
+
+			AddSphereCloud({ { 3.f, 2.f, 6.f, .5f }, { 3.5f, 2.5f, 6.5f, .4f }, { 2.5f, 1.5f, 7.f, .6f } });
+
+			UpdateAccelerationStructure();
+		}
+	};
+
+	TEST(VisibilityBuffer, MatchesTracedPrimaryHits) {
+		VisibilityTestScene scene{};
+		scene.Initialize();
+
+		constexpr uint32_t width{ 64 }, height{ 48 };
+		const VisibilityBuffer::View view{
+			Matrix{ Vector3::UnitX, Vector3::UnitY, Vector3::UnitZ, { 0.f, 1.5f, -6.f } },
+			{ 0.f, 1.5f, -6.f }, .6f, float(width) / height, width, height };
+
+		// One sample in the middle of every pixel, rasterized in tiles like render tasks so each mesh culls its BVH per tile
+		constexpr uint32_t tileSize{ 16 };
+		int mismatchCount{ 0 };
+		for (uint32_t y{ 0 }; y < height; y += tileSize)
+		{
+			for (uint32_t x{ 0 }; x < width; x += tileSize)
+			{
+				std::vector<Vector3> directions;
+				for (uint32_t py{ y }; py < y + tileSize; ++py)
+				{
+					for (uint32_t px{ x }; px < x + tileSize; ++px)
+					{
+						const float cx{ (2 * ((px + .5f) / float(width)) - 1) * view.aspectRatio * view.fov };
+						const float cy{ (1 - (2 * ((py + .5f) / float(height)))) * view.fov };
+						directions.push_back(view.cameraToWorld.TransformVector(cx, cy, 1).Normalized());
+					}
+				}
+
+				VisibilityBuffer visibilityBuffer{};
+				visibilityBuffer.Rasterize(scene, view, x, y, tileSize, tileSize, 1, directions.data());
+
+				for (uint32_t i{ 0 }; i < tileSize * tileSize; ++i)
+				{
+					const Ray ray{ view.origin, directions[i] };
+					HitRecord tracedHit{}, rasterizedHit{};
+					scene.GetClosestHit(ray, tracedHit);
+
+					const bool didHit{ visibilityBuffer.Resolve(scene, i, ray, rasterizedHit) };
+					ASSERT_EQ(didHit, tracedHit.didHit);
+					if (!didHit)
+						continue;
+
+					// Edge functions and Moller-Trumbore may disagree on a sample right on a triangle's edge
+					if (std::abs(rasterizedHit.t - tracedHit.t) > 1e-3f)
+					{
+						++mismatchCount;
+						continue;
+					}
+
+					EXPECT_NEAR(Vector3::Dot(rasterizedHit.normal, tracedHit.normal), 1.f, 1e-4f);
+					EXPECT_EQ(rasterizedHit.materialIndex, tracedHit.materialIndex);
+				}
+			}
+		}
+
+		EXPECT_LE(mismatchCount, 2);
+	}
+
+	TEST(Scene, OccluderCacheMatchesDoesHit) {
+		VisibilityTestScene scene{};
+		scene.Initialize();
+
+		std::mt19937 generator{ 23 };
+		std::uniform_real_distribution<float> position{ -4.f, 8.f };
+
+		// One cache carried over all rays like a render thread does, and one pointing at objects that don't exist
+		PrimitiveHit lastOccluder{};
+		const PrimitiveHit staleOccluder{ 1.f, 99, 99, 0.f, 0.f, HitObjectType::Triangle };
+
+		const Vector3 lightPosition{ 1.f, 6.f, 3.f };
+		int occludedCount{ 0 };
+		for (int i{ 0 }; i < 2000; ++i)
+		{
+			const Vector3 origin{ position(generator), .01f, std::abs(position(generator)) };
+			const Vector3 toLight{ lightPosition - origin };
+			const float distance{ toLight.Magnitude() };
+			const Ray ray{ origin, toLight / distance, .0001f, distance };
+
+			const bool expected{ scene.DoesHit(ray) };
+			ASSERT_EQ(scene.IsOccluded(ray, lastOccluder), expected);
+
+			PrimitiveHit occluder{ staleOccluder };
+			ASSERT_EQ(scene.IsOccluded(ray, occluder), expected);
+
+			occludedCount += expected;
+		}
+
+		// Both outcomes got covered
+		EXPECT_GT(occludedCount, 20);
+		EXPECT_LT(occludedCount, 1980);
+	}
+
+	// Sphere hovering over a floor, whose shadow flags get switched between the checks
+	class ShadowFlagTestScene final : public Scene
+	{
+	public:
+		void Initialize() override
+		{
+			AddPlane({ 0.f, 0.f, 0.f }, { 0.f, 1.f, 0.f });
+			AddSphere({ 0.f, 2.f, 0.f }, 1.f);
+			UpdateAccelerationStructure();
+		}
+
+		void SetShadowFlags(bool planeCastsShadow, bool sphereCastsShadow, bool sphereReceivesShadow)
+		{
+			m_PlaneGeometries[0].castsShadow = planeCastsShadow;
+			m_SphereGeometries[0].castsShadow = sphereCastsShadow;
+			m_SphereGeometries[0].receivesShadow = sphereReceivesShadow;
+			UpdateAccelerationStructure();
+		}
+	};
+
+	TEST(Scene, ShadowFlags) {
+		ShadowFlagTestScene scene{};
+		scene.Initialize();
+
+		// Up from the floor through the sphere, and up from below the floor towards a light under the sphere
+		const Ray sphereShadowRay{ { 0.f, .01f, 0.f }, Vector3::UnitY, .0001f, 10.f };
+		const Ray floorShadowRay{ { 3.f, -1.f, 0.f }, Vector3::UnitY, .0001f, 1.5f };
+		EXPECT_TRUE(scene.DoesHit(sphereShadowRay));
+		EXPECT_TRUE(scene.DoesHit(floorShadowRay));
+
+		PrimitiveHit lastOccluder{};
+		EXPECT_TRUE(scene.IsOccluded(sphereShadowRay, lastOccluder));
+		EXPECT_EQ(lastOccluder.type, HitObjectType::Sphere);
+
+		// Objects that don't cast shadows are left out of the shadow queries, cached or not
+		scene.SetShadowFlags(false, false, false);
+		EXPECT_FALSE(scene.IsOccluded(sphereShadowRay, lastOccluder));
+		EXPECT_FALSE(scene.DoesHit(sphereShadowRay));
+		EXPECT_FALSE(scene.DoesHit(floorShadowRay));
+
+		// The primary rays still see them
+		HitRecord closestHit{};
+		scene.GetClosestHit(Ray{ { 0.f, 2.f, -5.f }, Vector3::UnitZ }, closestHit);
+		ASSERT_TRUE(closestHit.didHit);
+		EXPECT_FALSE(closestHit.receivesShadow);
+
+		scene.SetShadowFlags(true, true, true);
+		scene.GetClosestHit(Ray{ { 0.f, 2.f, -5.f }, Vector3::UnitZ }, closestHit);
+		EXPECT_TRUE(closestHit.receivesShadow);
+		EXPECT_TRUE(scene.DoesHit(sphereShadowRay));
+	}
+
+	TEST(Material, ShadeStaysUnderMaxBRDF) {
+		std::vector<std::unique_ptr<Material>> materials{};
+		materials.emplace_back(std::make_unique<Material_SolidColor>(colors::Magenta));
+		materials.emplace_back(std::make_unique<Material_Lambert>(ColorRGB{ .49f, .57f, .57f }, 1.f));
+		materials.emplace_back(std::make_unique<Material_LambertPhong>(colors::Blue, 1.f, 1.f, 60.f));
+		for (const float roughness : { .1f, .6f, 1.f })
+		{
+			materials.emplace_back(std::make_unique<Material_CookTorrence>(ColorRGB{ .972f, .960f, .915f }, 1.f, roughness));
+			materials.emplace_back(std::make_unique<Material_CookTorrence>(ColorRGB{ .75f, .75f, .75f }, 0.f, roughness));
+		}
+
+		std::mt19937 generator{ 29 };
+		std::uniform_real_distribution<float> component{ -1.f, 1.f };
+		const auto randomAboveSurface = [&]
+		{
+			const Vector3 direction{ component(generator), std::abs(component(generator)) + .01f, component(generator) };
+			return direction.Normalized();
+		};
+
+		HitRecord hitRecord{};
+		hitRecord.normal = Vector3::UnitY;
+
+		// Random directions above the surface, and mirrored pairs where the specular lobes peak
+		for (int i{ 0 }; i < 20000; ++i)
+		{
+			const Vector3 l{ randomAboveSurface() };
+			const Vector3 v{ i % 2 == 0 ? randomAboveSurface() : Vector3{ -l.x, l.y, -l.z } };
+			for (const std::unique_ptr<Material>& pMaterial : materials)
+			{
+				const ColorRGB brdf{ pMaterial->Shade(hitRecord, l, v) };
+				const float maxBRDF{ pMaterial->GetMaxBRDF() };
+				ASSERT_LE(std::max({ brdf.r, brdf.g, brdf.b }), maxBRDF * 1.0001f);
+			}
+		}
+	}
+
 	int main(int argc, char** argv) {
 		::testing::InitGoogleTest(&argc, argv);
 		return RUN_ALL_TESTS();